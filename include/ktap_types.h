@@ -11,6 +11,7 @@
 
 #ifdef __KERNEL__
 #include <linux/perf_event.h>
+#include <linux/wait.h>
 #else
 typedef char u8;
 #include <stdlib.h>
@@ -23,7 +24,8 @@ typedef int ptrdiff_t;
 #include "../include/ktap_bc.h"
 
 /* Various VM limits. */
-#define KP_MAX_MEMPOOL_SIZE	10000	/* Max. mempool size(Kbytes). */
+#define KP_DEF_MEMPOOL_SIZE	512	/* Default initial mempool size(Kbytes). */
+#define KP_MAX_MEMPOOL_SIZE	65536	/* Max. mempool size(Kbytes). */
 #define KP_MAX_STR	512		/* Max. string length. */
 #define KP_MAX_STRNUM	9999		/* Max. string number. */
 
@@ -69,8 +71,148 @@ typedef struct ktap_option {
 	int print_timestamp;
 	int quiet;
 	int dry_run;
+	int mempool_size; /* initial mempool size(Kbytes), 0 for default */
+	int user_symbolize; /* kernel symbols are resolved by reader */
+	int raw_output; /* trace_pipe streams binary records, not text */
+	int wakeup_watermark; /* records before waking reader, 0 for 1 */
+	int unordered_output; /* drain cpu buffers without time ordering */
+	int buffer_size; /* per-cpu ring buffer size(Kbytes), 0 for default */
+	int drop_newest; /* drop new records when ring buffer is full */
+	int percpu_readers; /* create trace_pipe file for each cpu */
+	int output_format; /* KTAP_FORMAT_*, for print_hist and events */
 } ktap_option_t;
 
+/*
+ * Structured output_format. print_hist prints one row per table entry:
+ *     JSON  {"key":<key>,"count":<count>}
+ *     CSV   <key>,<count>          after a "key,count" header line
+ * Event records are printed with all fields of the tracepoint:
+ *     JSON  {"ts":<ns>,"cpu":<cpu>,"event":"<system>:<name>",
+ *            "fields":{"<field>":<value>,...}}
+ *     CSV   <ns>,<cpu>,<system>:<name>,<value>,...
+ * Stack keys are folded frames joined by ';', printf text is unchanged.
+ * Binary form of the same records is raw_output, see ktap_raw_header_t,
+ * which -r renders as any of above, or as columnar binary, see
+ * ktap_col_header_t. Columnar is only a render format of -r.
+ */
+enum {
+	KTAP_FORMAT_TEXT = 0,
+	KTAP_FORMAT_JSON,
+	KTAP_FORMAT_CSV,
+	KTAP_FORMAT_COLUMNAR,
+};
+
+/*
+ * Kernel symbol token in trace_pipe output when user_symbolize is set,
+ * reader resolves the address against /proc/kallsyms:
+ *     KTAP_SYM_BEGIN <'S'|'s'> <hex address> [',' <width>] KTAP_SYM_END
+ * 'S' prints symbol with offset, 's' without offset, like printk %pS/%ps,
+ * width right-aligns the symbol and truncates long one with "...".
+ * User address is resolved against DSO symbols of process tgid:
+ *     KTAP_SYM_BEGIN <'U'|'u'> <tgid> ':' <hex address> KTAP_SYM_END
+ */
+#define KTAP_SYM_BEGIN		'\001'
+#define KTAP_SYM_END		'\002'
+
+/*
+ * With raw_output, trace_pipe streams binary records instead of text.
+ * Stream starts with ktap_raw_header_t, followed by records, each one
+ * is ktap_raw_record_t and payload, padded to 8 bytes. Payload is:
+ *   KTAP_RAW_PRINT       text, symbol tokens are not resolved
+ *   KTAP_RAW_STACK       unsigned long return addresses
+ *   KTAP_RAW_USER_STACK  unsigned int tgid, then unsigned long addresses
+ *                        aligned to long
+ *   KTAP_RAW_FN          unsigned long ip, unsigned long parent_ip
+ *   KTAP_RAW_EVENT       whole ftrace event entry, starts with event id,
+ *                        see format file of the event
+ */
+#define KTAP_RAW_MAGIC		0x7061746b	/* "ktap" */
+#define KTAP_RAW_VERSION	1
+
+typedef struct ktap_raw_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t long_size;	/* sizeof(long) in kernel */
+} ktap_raw_header_t;
+
+enum {
+	KTAP_RAW_PRINT = 1,
+	KTAP_RAW_STACK,
+	KTAP_RAW_USER_STACK,
+	KTAP_RAW_FN,
+	KTAP_RAW_EVENT,
+};
+
+typedef struct ktap_raw_record {
+	uint32_t size;		/* include this header and padding */
+	uint16_t type;
+	uint16_t cpu;
+	uint64_t timestamp;	/* ring buffer time stamp, in ns */
+} ktap_raw_record_t;
+
+/*
+ * Columnar output of -r, self-describing, in host byte order, no padding.
+ * Stream starts with ktap_col_header_t, followed by blocks, each one is
+ * ktap_col_block_t and payload. Records of one type share a schema,
+ * SCHEMA block of a schema comes before its first ROWS block:
+ *   KTAP_COL_SCHEMA  uint16_t nr_columns, uint16_t name length, name,
+ *                    then per column: uint8_t type, uint8_t size,
+ *                    uint16_t name length, name
+ *   KTAP_COL_ROWS    uint32_t nr_rows, then values of each column in
+ *                    schema order, KTAP_COL_INT and KTAP_COL_UINT are
+ *                    nr_rows values of size bytes, KTAP_COL_STR is
+ *                    nr_rows uint32_t lengths followed by the bytes
+ * Schema names and columns, every schema starts with "ts" and "cpu":
+ *   "print"            ts, cpu, text
+ *   "stack"            ts, cpu, frames     folded, root frame first
+ *   "ustack"           ts, cpu, pid, frames
+ *   "fn"               ts, cpu, fn, parent
+ *   "<system>:<name>"  ts, cpu, all fields of event format file
+ *   "event"            ts, cpu, id, data   event without format file
+ * Event field out of record is zero or empty string.
+ */
+#define KTAP_COL_MAGIC		0x6c6f636b	/* "kcol" */
+#define KTAP_COL_VERSION	1
+
+typedef struct ktap_col_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+} ktap_col_header_t;
+
+enum {
+	KTAP_COL_SCHEMA = 1,
+	KTAP_COL_ROWS,
+};
+
+typedef struct ktap_col_block {
+	uint32_t size;		/* include this header */
+	uint16_t type;		/* KTAP_COL_SCHEMA or KTAP_COL_ROWS */
+	uint16_t schema;	/* schema id, in order of SCHEMA blocks */
+} ktap_col_block_t;
+
+enum {
+	KTAP_COL_INT = 1,	/* signed integer */
+	KTAP_COL_UINT,		/* unsigned integer */
+	KTAP_COL_STR,		/* bytes, not '\0' terminated */
+};
+
+/*
+ * Output can be read through per-cpu buffers mmaped on ktap fd, one
+ * mmap covers all possible cpus, each cpu has a header page followed
+ * by KTAP_MMAP_PAGES data pages. Kernel appends text at data_head,
+ * reader consumes it and moves data_tail, both only increase, offset
+ * in data pages is (pos & (data_size - 1)).
+ */
+#define KTAP_MMAP_PAGES		64
+
+typedef struct ktap_mmap_page {
+	volatile unsigned long data_head;	/* written by kernel */
+	volatile unsigned long data_tail;	/* written by reader */
+	unsigned int data_size;
+	unsigned int lost;	/* records dropped as buffer is full */
+} ktap_mmap_page_t;
+
 /*
  * Ioctls that can be done on a ktap fd:
  * todo: use _IO macro in include/uapi/asm-generic/ioctl.h
@@ -124,6 +266,9 @@ typedef struct ktap_str {
 	u8 extra;
 	unsigned int hash;
 	int len;  /* number of characters in string */
+#ifdef __KERNEL__
+	void *fmt;  /* compiled printf format, see kp_str_fmt */
+#endif
 } ktap_str_t;
 
 typedef struct ktap_upval {
@@ -251,11 +396,26 @@ typedef struct ktap_cdata {
 } ktap_cdata_t;
 #endif
 
+/* unique stack in stack map, raw return addresses */
+typedef struct kp_stack {
+	struct kp_stack *next;	/* hash chain */
+	uint32_t hash;
+	uint16_t nr;		/* number of entries */
+	int pid;		/* tgid of user stack, 0 for kernel stack */
+	unsigned long entries[0];
+} kp_stack_t;
+
+/* cached symbol name of kernel address, see kp_symcache.c */
+typedef struct kp_sym {
+	struct kp_sym *next;	/* hash chain */
+	unsigned long addr;
+	uint16_t offset;	/* name is printed with offset */
+	uint16_t len;		/* length of name */
+	char name[0];
+} kp_sym_t;
+
 typedef struct ktap_stats {
-	int mem_allocated;
-	int nr_mem_allocate;
-	int events_hits;
-	int events_missed;
+	int events_missed;	/* records dropped on this cpu */
 } ktap_stats_t;
 
 #define KTAP_STATS(ks)	this_cpu_ptr(G(ks)->stats)
@@ -267,9 +427,14 @@ typedef struct ktap_stats {
 #define KTAP_ERROR	3 /* error state, called by kp_error */
 
 typedef struct ktap_global_state {
-	void *mempool;		/* string memory pool */
-	void *mp_freepos;	/* free position in memory pool */
-	int mp_size;		/* memory pool size */
+	void *mempool;		/* string memory pool, list of segments */
+	void *mp_cur;		/* current allocating segment */
+	void *mp_freepos;	/* free position in current segment */
+	void *mp_end;		/* end of current segment */
+	int mp_size;		/* total size of all segments */
+	int mp_used;		/* allocated bytes, high-water mark */
+	int mp_nseg;		/* number of segments */
+	int mp_failed;		/* allocation failed counter */
 #ifdef __KERNEL__
 	arch_spinlock_t mp_lock;/* mempool lock */
 #endif
@@ -281,6 +446,19 @@ typedef struct ktap_global_state {
 	arch_spinlock_t str_lock; /* string operation lock */
 #endif
 
+	kp_stack_t **stackhash;	/* stack map, see kp_stackmap.c */
+	int stackmask;		/* stack map hash mask */
+	int stacknum;		/* Number of stacks in stack map */
+#ifdef __KERNEL__
+	arch_spinlock_t stack_lock; /* stack map lock */
+#endif
+
+	kp_sym_t **symhash;	/* symbol cache, see kp_symcache.c */
+	int symnum;		/* Number of symbols in symbol cache */
+#ifdef __KERNEL__
+	arch_spinlock_t sym_lock; /* symbol cache lock */
+#endif
+
 	ktap_val_t registry;
 	ktap_tab_t *gtab;	/* global table contains cfunction and args */
 	ktap_obj_t *allgc; /* list of all collectable objects */
@@ -293,6 +471,7 @@ typedef struct ktap_global_state {
 	void __percpu *percpu_state[PERF_NR_CONTEXTS];
 	void __percpu *percpu_print_buffer[PERF_NR_CONTEXTS];
 	void __percpu *percpu_temp_buffer[PERF_NR_CONTEXTS];
+	void __percpu *percpu_scratch_buffer[PERF_NR_CONTEXTS];
 
 	/* for recursion tracing check */
 	int __percpu *recursion_context[PERF_NR_CONTEXTS];
@@ -303,12 +482,19 @@ typedef struct ktap_global_state {
 	cpumask_var_t cpumask;
 	struct ring_buffer *buffer;
 	struct dentry *trace_pipe_dentry;
+	struct kp_cpu_pipe *cpu_pipes;	/* per-cpu trace_pipe files */
+	struct dentry *stats_dentry;	/* see kp_stats.c */
+	struct dentry *export_dir;	/* tables_<pid>, see kp_export.c */
+	struct list_head exports;	/* exported tables */
+	struct kp_mmap *mmap;	/* mmaped per-cpu buffers, may be NULL */
+	wait_queue_head_t trace_wait; /* trace_pipe readers */
+	struct kp_cpu_wait __percpu *cpu_wait; /* see trace_wakeup */
 	struct task_struct *task;
 	int trace_enabled;
 	int wait_user; /* flag to indicat waiting user consume content */
 
 	struct list_head timers; /* timer list */
-	struct ktap_stats __percpu *stats; /* memory allocation stats */
+	struct ktap_stats __percpu *stats; /* per-cpu stats */
 	struct list_head events_head; /* probe event list */
 
 	ktap_func_t *trace_end_closure; /* trace_end closure */
@@ -335,6 +521,7 @@ typedef struct ktap_state {
 #ifdef __KERNEL__
 	/* current fired event which allocated on stack */
 	struct ktap_event_data *current_event;
+	int scratch_pos;	/* used bytes of percpu scratch buffer */
 #endif
 } ktap_state_t;
 
@@ -394,9 +581,12 @@ union ktap_obj {
 #define KTAP_TKSTACK		(~15u) /* stack(), not intern to string yet */
 #define KTAP_TKIP		(~16u) /* kernel function ip addres */
 #define KTAP_TUIP		(~17u) /* userspace function ip addres */
+#define KTAP_TSTRVIEW		(~18u) /* event string field, not intern yet */
+#define KTAP_TSTACKID		(~19u) /* unique stack in stack map */
+#define KTAP_TUSTACK		(~20u) /* ustack(), not intern to string yet */
 
 /* This is just the canonical number type used in some places. */
-#define KTAP_TNUMX		(~18u)
+#define KTAP_TNUMX		(~21u)
 
 
 #define itype(o)		((o)->type)
@@ -415,6 +605,8 @@ union ktap_obj {
 #define getstr(ts)		(const char *)((ts) + 1)
 #define rawtsvalue(o)		(&val_(o).gc->ts)
 #define svalue(o)		getstr(rawtsvalue(o))
+#define strviewvalue(o)		((const char *)val_(o).p)
+#define stackidvalue(o)		((const kp_stack_t *)val_(o).p)
 
 #define pvalue(o)		(&val_(o).p)
 #define fvalue(o)		(val_(o).f)
@@ -433,6 +625,8 @@ union ktap_obj {
 #define is_function(o)		(itype(o) == KTAP_TFUNC)
 #define is_cfunc(o)		(itype(o) == KTAP_TCFUNC)
 #define is_eventstr(o)		(itype(o) == KTAP_TEVENTSTR)
+#define is_strview(o)		(itype(o) == KTAP_TSTRVIEW)
+#define is_stackid(o)		(itype(o) == KTAP_TSTACKID)
 #define is_kip(o)		(itype(o) == KTAP_TKIP)
 #define is_btrace(o)		(itype(o) == KTAP_TBTRACE)
 #ifdef CONFIG_KTAP_FFI
@@ -474,6 +668,13 @@ static inline void set_kstack(ktap_val_t *o, uint16_t depth, uint16_t skip)
 	o->val.stack.skip = skip;
 }
 
+static inline void set_ustack(ktap_val_t *o, uint16_t depth)
+{
+	setitype(o, KTAP_TUSTACK);
+	o->val.stack.depth = depth;
+	o->val.stack.skip = 0;
+}
+
 static inline void set_func(ktap_val_t *o, ktap_func_t *fn)
 {
 	setitype(o, KTAP_TFUNC);
@@ -491,6 +692,22 @@ static inline void set_eventstr(ktap_val_t *o)
 	setitype(o, KTAP_TEVENTSTR);
 }
 
+/*
+ * string view only points into raw event data, it's valid in current
+ * event context, must be interned before stored into table or upvalue.
+ */
+static inline void set_strview(ktap_val_t *o, const char *s)
+{
+	setitype(o, KTAP_TSTRVIEW);
+	o->val.p = (void *)s;
+}
+
+static inline void set_stackid(ktap_val_t *o, const struct kp_stack *st)
+{
+	setitype(o, KTAP_TSTACKID);
+	o->val.p = (void *)st;
+}
+
 static inline void set_ip(ktap_val_t *o, unsigned long addr)
 {
 	setitype(o, KTAP_TKIP);
@@ -23,6 +23,10 @@
 #include "kp_bcread.c"
 #include "kp_str.c"
 #include "kp_mempool.c"
+#include "kp_stackmap.c"
+#include "kp_symcache.c"
+#include "kp_stats.c"
+#include "kp_export.c"
 #include "kp_tab.c"
 #include "kp_transport.c"
 #include "kp_vm.c"
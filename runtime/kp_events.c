@@ -121,6 +121,107 @@ static struct list_head *get_fields(trace_event_call *event_call)
 	return event_call->class->get_fields(event_call);
 }
 
+static void seq_quote(struct trace_seq *s, const char *str, int len,
+		      int format)
+{
+	int n;
+
+	if (s->full)
+		return;
+
+	n = kp_str_quote((char *)s->buffer + TRACE_SEQ_LEN(s),
+			 PAGE_SIZE - 1 - TRACE_SEQ_LEN(s), str, len, format);
+	if (n < 0)
+		s->full = 1;
+	else
+		TRACE_SEQ_LEN(s) += n;
+}
+
+static void seq_field(struct trace_seq *s, struct ftrace_event_field *field,
+		      const void *entry, int format)
+{
+	const void *p = entry + field->offset;
+
+	if (!strncmp(field->type, "__data_loc", 10)) {
+		u32 loc = *(u32 *)p;
+
+		seq_quote(s, entry + (loc & 0xffff),
+			  strnlen(entry + (loc & 0xffff), loc >> 16), format);
+		return;
+	}
+
+	if (strchr(field->type, '[')) {
+		if (!strncmp(field->type, "char", 4))
+			seq_quote(s, p, strnlen(p, field->size), format);
+		else if (format == KTAP_FORMAT_JSON)
+			_trace_seq_puts(s, "null");
+		return;
+	}
+
+	switch (field->size) {
+	case 1:
+		TRACE_SEQ_PRINTF(s, field->is_signed ? "%lld" : "%llu",
+				 field->is_signed ? (s64)*(s8 *)p :
+						    (u64)*(u8 *)p);
+		break;
+	case 2:
+		TRACE_SEQ_PRINTF(s, field->is_signed ? "%lld" : "%llu",
+				 field->is_signed ? (s64)*(s16 *)p :
+						    (u64)*(u16 *)p);
+		break;
+	case 4:
+		TRACE_SEQ_PRINTF(s, field->is_signed ? "%lld" : "%llu",
+				 field->is_signed ? (s64)*(s32 *)p :
+						    (u64)*(u32 *)p);
+		break;
+	case 8:
+		TRACE_SEQ_PRINTF(s, field->is_signed ? "%lld" : "%llu",
+				 *(u64 *)p);
+		break;
+	default:
+		if (format == KTAP_FORMAT_JSON)
+			_trace_seq_puts(s, "null");
+		break;
+	}
+}
+
+/*
+ * print event entry with all its fields as one JSON object or CSV row,
+ * see KTAP_FORMAT_JSON. Return 0 if trace_seq is full.
+ */
+int kp_event_print_fields(struct trace_seq *s, trace_event_call *call,
+			  const void *entry, u64 ts, int cpu, int format)
+{
+	struct ftrace_event_field *field;
+	struct list_head *head;
+	int first = 1;
+
+	if (format == KTAP_FORMAT_JSON)
+		TRACE_SEQ_PRINTF(s, "{\"ts\":%llu,\"cpu\":%d,"
+				 "\"event\":\"%s:%s\",\"fields\":{", ts, cpu,
+				 call->class->system, call->name);
+	else
+		TRACE_SEQ_PRINTF(s, "%llu,%d,%s:%s", ts, cpu,
+				 call->class->system, call->name);
+
+	head = get_fields(call);
+	list_for_each_entry_reverse(field, head, link) {
+		if (format == KTAP_FORMAT_JSON)
+			TRACE_SEQ_PRINTF(s, "%s\"%s\":", first ? "" : ",",
+					 field->name);
+		else
+			_trace_seq_puts(s, ",");
+
+		seq_field(s, field, entry, format);
+		first = 0;
+	}
+
+	if (format == KTAP_FORMAT_JSON)
+		_trace_seq_puts(s, "}}");
+
+	return !s->full;
+}
+
 void kp_event_getarg(ktap_state_t *ks, ktap_val_t *ra, int idx)
 {
 	struct ktap_event_data *e = ks->current_event;
@@ -144,13 +245,9 @@ void kp_event_getarg(ktap_state_t *ks, ktap_val_t *ra, int idx)
 		}
 	case KTAP_EVENT_FIELD_TYPE_STRING: {
 		struct trace_entry *entry = TRACE_EVENT_RAW_DATA(e);
-		ktap_str_t *ts;
 		void *value = (unsigned char *)entry + event_fields->offset;
-		ts = kp_str_newz(ks, (char *)value);
-		if (ts)
-			set_string(ra, ts);
-		else
-			set_nil(ra);
+		/* don't intern it, raw data is valid in event context */
+		set_strview(ra, (const char *)value);
 		return;
 		}
 	case KTAP_EVENT_FIELD_TYPE_CONST: {
@@ -233,12 +330,49 @@ static int init_event_fields(ktap_state_t *ks, struct ktap_event *event)
 	return 0;
 }
 
+static struct ktap_event *event_alloc(void)
+{
+	struct ktap_event *event;
+
+	event = kzalloc(sizeof(struct ktap_event), GFP_KERNEL);
+	if (!event)
+		return NULL;
+
+	event->stats = alloc_percpu(struct ktap_event_stats);
+	if (!event->stats) {
+		kfree(event);
+		return NULL;
+	}
+
+	return event;
+}
+
+static void event_free(struct ktap_event *event)
+{
+	free_percpu(event->stats);
+	kfree(event);
+}
+
+/* name shown in stats, events of one probe share the same name */
+const char *kp_event_name(struct ktap_event *event)
+{
+	if (event->name)
+		return getstr(event->name);
+
+	if (event->type == KTAP_EVENT_TYPE_PERF && event->perf->tp_event)
+		return event->perf->tp_event->name;
+
+	return "perf";
+}
+
 static inline void call_probe_closure(ktap_state_t *mainthread,
 				      ktap_func_t *fn,
 				      struct ktap_event_data *e, int rctx)
 {
+	struct ktap_event_stats *stats = kp_event_stats(e->event);
 	ktap_state_t *ks;
 	ktap_val_t *func;
+	u64 start = local_clock();
 
 	ks = kp_vm_new_thread(mainthread, rctx);
 	set_func(ks->top, fn);
@@ -251,6 +385,11 @@ static inline void call_probe_closure(ktap_state_t *mainthread,
 
 	ks->current_event = NULL;
 	kp_vm_exit_thread(ks);
+
+	if (unlikely(G(ks)->state == KTAP_ERROR))
+		stats->errors++;
+	stats->hits++;
+	stats->time += local_clock() - start;
 }
 
 /*
@@ -282,8 +421,10 @@ static void perf_callback(struct perf_event *perf_event,
 		return;
 
 	rctx = get_recursion_context(ks);
-	if (unlikely(rctx < 0))
+	if (unlikely(rctx < 0)) {
+		kp_event_stats(event)->recursion_missed++;
 		return;
+	}
 
 	e.event = event;
 	e.data = data;
@@ -324,7 +465,7 @@ int kp_event_create(ktap_state_t *ks, struct perf_event_attr *attr,
 	ks->stop = 1;
 
 	for_each_cpu(cpu, G(ks)->cpumask) {
-		event = kzalloc(sizeof(struct ktap_event), GFP_KERNEL);
+		event = event_alloc();
 		if (!event)
 			return -ENOMEM;
 
@@ -338,7 +479,7 @@ int kp_event_create(ktap_state_t *ks, struct perf_event_attr *attr,
 			kp_error(ks, "unable register perf event: "
 				     "[cpu: %d; id: %d; err: %d]\n",
 				     cpu, attr->config, err);
-			kfree(event);
+			event_free(event);
 			return err;
 		}
 
@@ -367,7 +508,7 @@ int kp_event_create(ktap_state_t *ks, struct perf_event_attr *attr,
 					attr->config);
 			perf_event_release_kernel(event->perf);
 			list_del(&event->list);
-			kfree(event);
+			event_free(event);
 			return ret;
 		}
 
@@ -382,7 +523,7 @@ int kp_event_create(ktap_state_t *ks, struct perf_event_attr *attr,
 				     attr->config, filter, ret);
 			perf_event_release_kernel(event->perf);
 			list_del(&event->list);
-			kfree(event);
+			event_free(event);
 			return ret;
 		}
 	}
@@ -412,8 +553,10 @@ static void probe_callback(void *__data)
 		return;
 
 	rctx = get_recursion_context(ks);
-	if (unlikely(rctx < 0))
+	if (unlikely(rctx < 0)) {
+		kp_event_stats(event)->recursion_missed++;
 		return;
+	}
 
 	perf_fetch_caller_regs(&regs);
 
@@ -466,8 +609,10 @@ static void trace_syscall_enter(void *data, struct pt_regs *regs, long id)
 		return;
 
 	rctx = get_recursion_context(ks);
-	if (unlikely(rctx < 0))
+	if (unlikely(rctx < 0)) {
+		kp_event_stats(event)->recursion_missed++;
 		return;
+	}
 
 	e.event = event;
 	e.regs = regs;
@@ -496,8 +641,10 @@ static void trace_syscall_exit(void *data, struct pt_regs *regs, long id)
 		return;
 
 	rctx = get_recursion_context(ks);
-	if (unlikely(rctx < 0))
+	if (unlikely(rctx < 0)) {
+		kp_event_stats(event)->recursion_missed++;
 		return;
+	}
 
 	e.event = event;
 	e.regs = regs;
@@ -671,7 +818,7 @@ int kp_event_create_tracepoint(ktap_state_t *ks, const char *event_name,
 	    !strncmp(event_name, "sys_exit_", 9))
 		is_syscall = 1;
 
-	event = kzalloc(sizeof(struct ktap_event), GFP_KERNEL);
+	event = event_alloc();
 	if (!event)
 		return -ENOMEM;
 
@@ -679,7 +826,7 @@ int kp_event_create_tracepoint(ktap_state_t *ks, const char *event_name,
 	event->fn = fn;
 	event->name = kp_str_newz(ks, event_name);
 	if (unlikely(!event->name)) {
-		kfree(event);
+		event_free(event);
 		return -ENOMEM;
 	}
 
@@ -697,7 +844,7 @@ int kp_event_create_tracepoint(ktap_state_t *ks, const char *event_name,
 		kp_error(ks, "register tracepoint %s failed, ret: %d\n",
 				event_name, ret);
 		list_del(&event->list);
-		kfree(event);
+		event_free(event);
 		return ret;
 	}
 	return 0;
@@ -717,8 +864,10 @@ static int __kprobes pre_handler_kprobe(struct kprobe *p, struct pt_regs *regs)
 		return 0;
 
 	rctx = get_recursion_context(ks);
-	if (unlikely(rctx < 0))
+	if (unlikely(rctx < 0)) {
+		kp_event_stats(event)->recursion_missed++;
 		return 0;
+	}
 
 	e.event = event;
 	e.regs = regs;
@@ -747,7 +896,7 @@ int kp_event_create_kprobe(ktap_state_t *ks, const char *event_name,
 	if (G(ks)->parm->dry_run)
 		callback = NULL;
 
-	event = kzalloc(sizeof(struct ktap_event), GFP_KERNEL);
+	event = event_alloc();
 	if (!event)
 		return -ENOMEM;
 
@@ -755,7 +904,7 @@ int kp_event_create_kprobe(ktap_state_t *ks, const char *event_name,
 	event->fn = fn;
 	event->name = kp_str_newz(ks, event_name);
 	if (unlikely(!event->name)) {
-		kfree(event);
+		event_free(event);
 		return -ENOMEM;
 	}
 
@@ -771,17 +920,17 @@ int kp_event_create_kprobe(ktap_state_t *ks, const char *event_name,
 		kp_error(ks, "register kprobe event %s failed, ret: %d\n",
 				event_name, ret);
 		list_del(&event->list);
-		kfree(event);
+		event_free(event);
 		return ret;
 	}
 	return 0;
 }
 
 
-static void events_destroy(ktap_state_t *ks)
+static void events_unregister(ktap_state_t *ks)
 {
 	struct ktap_event *event;
-	struct list_head *tmp, *pos;
+	struct list_head *pos;
 	struct list_head *head = &G(ks)->events_head;
 
 	list_for_each(pos, head) {
@@ -805,12 +954,20 @@ static void events_destroy(ktap_state_t *ks)
 	 * will be freed after that.
 	 */
 	tracepoint_synchronize_unregister();
+}
+
+/* events are freed after exit stats report, see kp_stats_report */
+void kp_events_free(ktap_state_t *ks)
+{
+	struct ktap_event *event;
+	struct list_head *tmp, *pos;
+	struct list_head *head = &G(ks)->events_head;
 
 	list_for_each_safe(pos, tmp, head) {
 		event = container_of(pos, struct ktap_event,
 					   list);
 		list_del(&event->list);
-		kfree(event);
+		event_free(event);
 	}
 }
 
@@ -819,7 +976,7 @@ void kp_events_exit(ktap_state_t *ks)
 	if (!G(ks)->trace_enabled)
 		return;
 
-	events_destroy(ks);
+	events_unregister(ks);
 
 	/* call trace_end_closure after all event unregistered */
 	if ((G(ks)->state != KTAP_ERROR) && G(ks)->trace_end_closure) {
@@ -32,6 +32,15 @@ enum KTAP_EVENT_TYPE {
 	KTAP_EVENT_TYPE_KPROBE,
 };
 
+/* per-cpu statistics of one event, see kp_stats.c */
+struct ktap_event_stats {
+	u64 hits;
+	u64 recursion_missed;	/* get_recursion_context failed */
+	u64 missed;		/* records dropped by ring buffer */
+	u64 errors;		/* handler ended in error state */
+	u64 time;		/* ns spent in handler */
+};
+
 struct ktap_event {
 	struct list_head list;
 	int type;
@@ -43,8 +52,11 @@ struct ktap_event {
 	ktap_str_t *name; /* intern probename string */
 
 	struct kprobe kp; /* kprobe event */
+	struct ktap_event_stats __percpu *stats;
 };
 
+#define kp_event_stats(event)	this_cpu_ptr((event)->stats)
+
 /* this structure allocate on stack */
 struct ktap_event_data {
 	struct ktap_event *event;
@@ -55,6 +67,10 @@ struct ktap_event_data {
 
 int kp_events_init(ktap_state_t *ks);
 void kp_events_exit(ktap_state_t *ks);
+void kp_events_free(ktap_state_t *ks);
+const char *kp_event_name(struct ktap_event *event);
+int kp_event_print_fields(struct trace_seq *s, trace_event_call *call,
+			  const void *entry, u64 ts, int cpu, int format);
 
 int kp_event_create(ktap_state_t *ks, struct perf_event_attr *attr,
 		    struct task_struct *task, const char *filter,
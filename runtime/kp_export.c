@@ -0,0 +1,317 @@
+/*
+ * kp_export.c - export tables through debugfs while tracing
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/kallsyms.h>
+#include "../include/ktap_types.h"
+#include "ktap.h"
+#include "kp_obj.h"
+#include "kp_str.h"
+#include "kp_tab.h"
+#include "kp_export.h"
+
+/*
+ * Table exported by table.export() is a read-only file tables_<pid>/<name>
+ * in debugfs, external collector can scrape it while tracing, without
+ * script or ring buffer involved. Content is a snapshot taken under table
+ * lock at open, one entry per line, in output_format:
+ *     text  <key> <value>
+ *     JSON  {"key":<key>,"value":<value>}
+ *     CSV   <key>,<value>          after a "key,value" header line
+ * Stack keys are folded frames like print_folded, so text content can be
+ * fed to flame graph tools directly.
+ */
+
+struct kp_export {
+	struct list_head list;
+	ktap_state_t *ks;
+	ktap_tab_t *t;
+	struct dentry *dentry;
+};
+
+/* snapshot content of one open */
+struct kp_export_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+#define EXPORT_LINE_SIZE	(PAGE_SIZE * 2)
+
+static int export_put(struct kp_export_buf *b, const char *str, int len)
+{
+	if (b->len + len > b->size) {
+		size_t size = max(b->size * 2, b->len + len);
+		char *data = vmalloc(size);
+
+		if (!data)
+			return -ENOMEM;
+
+		memcpy(data, b->data, b->len);
+		vfree(b->data);
+		b->data = data;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, str, len);
+	b->len += len;
+	return 0;
+}
+
+/*
+ * symbols are always resolved in kernel here, symbol tokens of
+ * user_symbolize are only understood by ktap reader. Not through
+ * kp_symcache, reader of export file is not mainthread, it must not
+ * allocate from mempool.
+ */
+static int export_key(ktap_state_t *ks, char *buf, int size,
+		      const ktap_val_t *key)
+{
+	char str[KSYM_SYMBOL_LEN];
+	int len = 0;
+
+	if (is_stackid(key)) {
+		const kp_stack_t *st = stackidvalue(key);
+		int i;
+
+		for (i = st->nr - 1; i >= 0; i--) {
+			if (st->pid)
+				sprintf(str, "0x%lx", st->entries[i]);
+			else
+				SPRINT_SYMBOL(str, st->entries[i]);
+
+			len += scnprintf(buf + len, size - len, "%s%s",
+					 len ? ";" : "", str);
+		}
+	} else if (is_string(key)) {
+		len = scnprintf(buf, size, "%s", svalue(key));
+	} else if (is_number(key)) {
+		len = scnprintf(buf, size, "%ld", nvalue(key));
+	} else if (is_kip(key)) {
+		SPRINT_SYMBOL(str, nvalue(key));
+		len = scnprintf(buf, size, "%s", str);
+	}
+
+	return len;
+}
+
+/* quote string key or value, number is printed as is */
+static int export_value(char *buf, int size, const ktap_val_t *v,
+			const char *str, int len, int format)
+{
+	if (format == KTAP_FORMAT_TEXT || is_number(v)) {
+		if (len > size)
+			return -1;
+		memcpy(buf, str, len);
+		return len;
+	}
+
+	return kp_str_quote(buf, size, str, len, format);
+}
+
+static int export_entry(ktap_state_t *ks, struct kp_export_buf *b,
+			char *line, const ktap_val_t *key,
+			const ktap_val_t *val, int format)
+{
+	char *str = line + EXPORT_LINE_SIZE / 2;
+	int size = EXPORT_LINE_SIZE / 2 - 32, len, n = 0, q;
+
+	if (format == KTAP_FORMAT_JSON)
+		n = sprintf(line, "{\"key\":");
+
+	len = export_key(ks, str, size, key);
+	q = export_value(line + n, size - n, key, str, len, format);
+	if (q < 0)
+		return 0;
+	n += q;
+
+	if (format == KTAP_FORMAT_JSON)
+		n += sprintf(line + n, ",\"value\":");
+	else
+		line[n++] = format == KTAP_FORMAT_CSV ? ',' : ' ';
+
+	if (is_number(val))
+		len = scnprintf(str, size, "%ld", nvalue(val));
+	else if (is_string(val))
+		len = scnprintf(str, size, "%s", svalue(val));
+	else
+		return 0;
+
+	q = export_value(line + n, EXPORT_LINE_SIZE / 2 - n - 3, val, str, len,
+			 format);
+	if (q < 0)
+		return 0;
+	n += q;
+
+	if (format == KTAP_FORMAT_JSON)
+		line[n++] = '}';
+	line[n++] = '\n';
+
+	return export_put(b, line, n);
+}
+
+static int export_sprint(struct kp_export *e, struct kp_export_buf *b)
+{
+	ktap_state_t *ks = e->ks;
+	int format = G(ks)->parm->output_format;
+	ktap_val_t *kv;
+	char *line;
+	int i, n, nr, ret = -ENOMEM;
+
+	line = kmalloc(EXPORT_LINE_SIZE, GFP_KERNEL);
+	if (!line)
+		return -ENOMEM;
+
+	/* table may grow between sizing and copying it, then retry */
+	n = kp_tab_len(ks, e->t) + 16;
+	for (;;) {
+		kv = vmalloc(n * 2 * sizeof(ktap_val_t));
+		if (!kv)
+			goto out;
+
+		nr = kp_tab_snapshot(e->t, kv, n);
+		if (nr >= 0)
+			break;
+
+		vfree(kv);
+		n *= 2;
+	}
+
+	ret = 0;
+	if (format == KTAP_FORMAT_CSV)
+		ret = export_put(b, "key,value\n", 10);
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = export_entry(ks, b, line, &kv[i * 2], &kv[i * 2 + 1],
+				   format);
+
+	vfree(kv);
+ out:
+	kfree(line);
+	return ret;
+}
+
+static int export_open(struct inode *inode, struct file *file)
+{
+	struct kp_export_buf *b;
+	int ret;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+
+	ret = export_sprint(inode->i_private, b);
+	if (ret) {
+		vfree(b->data);
+		kfree(b);
+		return ret;
+	}
+
+	file->private_data = b;
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t export_read(struct file *file, char __user *ubuf, size_t cnt,
+			   loff_t *ppos)
+{
+	struct kp_export_buf *b = file->private_data;
+
+	return simple_read_from_buffer(ubuf, cnt, ppos, b->data, b->len);
+}
+
+static int export_release(struct inode *inode, struct file *file)
+{
+	struct kp_export_buf *b = file->private_data;
+
+	vfree(b->data);
+	kfree(b);
+	return 0;
+}
+
+static const struct file_operations export_fops = {
+	.open		= export_open,
+	.read		= export_read,
+	.release	= export_release,
+	.llseek		= no_llseek,
+};
+
+int kp_export_table(ktap_state_t *ks, ktap_tab_t *t, const char *name)
+{
+	struct kp_export *e;
+
+	if (!G(ks)->export_dir) {
+		kp_error(ks, "cannot export table after tracing ends\n");
+		return -1;
+	}
+
+	if (!*name || strchr(name, '/')) {
+		kp_error(ks, "invalid export name \"%s\"\n", name);
+		return -1;
+	}
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e) {
+		kp_error(ks, "cannot allocate export of table %s\n", name);
+		return -1;
+	}
+
+	e->ks = ks;
+	e->t = t;
+	e->dentry = debugfs_create_file(name, 0444, G(ks)->export_dir, e,
+					&export_fops);
+	if (!e->dentry) {
+		kp_error(ks, "cannot export table %s, name is used?\n", name);
+		kfree(e);
+		return -1;
+	}
+
+	list_add_tail(&e->list, &G(ks)->exports);
+	return 0;
+}
+
+/* export files read tables, remove them before tables are freed */
+void kp_export_exit(ktap_state_t *ks)
+{
+	struct kp_export *e, *tmp;
+
+	debugfs_remove_recursive(G(ks)->export_dir);
+	G(ks)->export_dir = NULL;
+
+	list_for_each_entry_safe(e, tmp, &G(ks)->exports, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+}
+
+int kp_export_init(ktap_state_t *ks, struct dentry *dir)
+{
+	char dirname[32] = {0};
+
+	sprintf(dirname, "tables_%d", (int)task_tgid_vnr(current));
+
+	G(ks)->export_dir = debugfs_create_dir(dirname, dir);
+	if (!G(ks)->export_dir) {
+		pr_err("ktapvm: cannot create tables directory in debugfs\n");
+		return -1;
+	}
+
+	return 0;
+}
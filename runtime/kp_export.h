@@ -0,0 +1,8 @@
+#ifndef __KTAP_EXPORT_H__
+#define __KTAP_EXPORT_H__
+
+int kp_export_table(ktap_state_t *ks, ktap_tab_t *t, const char *name);
+void kp_export_exit(ktap_state_t *ks);
+int kp_export_init(ktap_state_t *ks, struct dentry *dir);
+
+#endif /* __KTAP_EXPORT_H__ */
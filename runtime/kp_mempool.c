@@ -26,6 +26,34 @@
 #include "ktap.h"
 
 
+/*
+ * mempool is a list of vmalloc'ed segments, allocation only bumps
+ * freepos inside current segment, so it's safe in any context.
+ * New segments are only allocated in process context by
+ * kp_mempool_grow, before current segment is running out: periodically
+ * in sleep_loop for probes, and by kp_mempool_reserve before each
+ * allocation of mainthread, which runs script body and trace_end.
+ */
+struct kp_mempool_seg {
+	struct kp_mempool_seg *next;
+	int size;
+};
+
+#define SEG_DATA(seg)	((char *)(seg) + sizeof(struct kp_mempool_seg))
+
+static struct kp_mempool_seg *mempool_seg_new(int size)
+{
+	struct kp_mempool_seg *seg;
+
+	seg = vmalloc(sizeof(*seg) + size);
+	if (!seg)
+		return NULL;
+
+	seg->next = NULL;
+	seg->size = size;
+	return seg;
+}
+
 /*
  * allocate memory from mempool, the allocated memory will be free
  * util ktap exit.
@@ -34,22 +62,34 @@
 void *kp_mempool_alloc(ktap_state_t *ks, int size)
 {
 	ktap_global_state_t *g = G(ks);
-	void *mempool = g->mempool;
-	void *freepos = g->mp_freepos;
+	struct kp_mempool_seg *seg;
 	void *addr;
 	unsigned long flags;
 
+	/* keep allocations aligned, compiled formats contain pointers */
+	size = ALIGN(size, sizeof(long));
+
 	local_irq_save(flags);
 	arch_spin_lock(&g->mp_lock);
 
-	if (unlikely((unsigned long)((char *)freepos + size)) >
-		     (unsigned long)((char *)mempool + g->mp_size)) {
-		addr = NULL;
-		goto out;
+	while (unlikely((char *)g->mp_freepos + size > (char *)g->mp_end)) {
+		seg = ((struct kp_mempool_seg *)g->mp_cur)->next;
+		if (!seg) {
+			g->mp_failed++;
+			addr = NULL;
+			goto out;
+		}
+
+		/* tail of previous segment is wasted, count it as used */
+		g->mp_used += (char *)g->mp_end - (char *)g->mp_freepos;
+		g->mp_cur = seg;
+		g->mp_freepos = SEG_DATA(seg);
+		g->mp_end = SEG_DATA(seg) + seg->size;
 	}
 
-	addr = freepos;
-	g->mp_freepos = (char *)freepos + size;
+	addr = g->mp_freepos;
+	g->mp_freepos = (char *)addr + size;
+	g->mp_used += size;
  out:
 
 	arch_spin_unlock(&g->mp_lock);
@@ -57,20 +97,86 @@ void *kp_mempool_alloc(ktap_state_t *ks, int size)
 	return addr;
 }
 
+/*
+ * make sure there have at least reserve bytes free in mempool,
+ * otherwise append a new segment, until reach KP_MAX_MEMPOOL_SIZE.
+ * Must be called in process context.
+ */
+int kp_mempool_grow(ktap_state_t *ks, int reserve)
+{
+	ktap_global_state_t *g = G(ks);
+	struct kp_mempool_seg *seg, *last;
+	unsigned long flags;
+	int avail, size;
+
+	if (!g->mempool)
+		return -EINVAL;
+
+	/* probes on other cpus may switch to next segment meanwhile */
+	local_irq_save(flags);
+	arch_spin_lock(&g->mp_lock);
+	last = g->mp_cur;
+	avail = (char *)g->mp_end - (char *)g->mp_freepos;
+	while (last->next) {
+		last = last->next;
+		avail += last->size;
+	}
+	arch_spin_unlock(&g->mp_lock);
+	local_irq_restore(flags);
+
+	/* keep a quarter of first segment free, at least */
+	size = ((struct kp_mempool_seg *)g->mempool)->size;
+	if (reserve < size / 4)
+		reserve = size / 4;
+
+	if (avail >= reserve)
+		return 0;
+
+	if (reserve > size)
+		size = reserve;
+	if (g->mp_size + size > KP_MAX_MEMPOOL_SIZE * 1024)
+		return -ENOMEM;
+
+	seg = mempool_seg_new(size);
+	if (!seg)
+		return -ENOMEM;
+
+	/*
+	 * segments are only appended here, by mainthread, so last is
+	 * still the tail of list.
+	 */
+	local_irq_save(flags);
+	arch_spin_lock(&g->mp_lock);
+	last->next = seg;
+	g->mp_size += size;
+	g->mp_nseg++;
+	arch_spin_unlock(&g->mp_lock);
+	local_irq_restore(flags);
+
+	return 0;
+}
+
 /*
  * destroy mempool.
  */
 void kp_mempool_destroy(ktap_state_t *ks)
 {
 	ktap_global_state_t *g = G(ks);
+	struct kp_mempool_seg *seg = g->mempool, *next;
 
-	if (!g->mempool)
-		return;
+	while (seg) {
+		next = seg->next;
+		vfree(seg);
+		seg = next;
+	}
 
-	vfree(g->mempool);
 	g->mempool = NULL;
+	g->mp_cur = NULL;
 	g->mp_freepos = NULL;
+	g->mp_end = NULL;
 	g->mp_size = 0;
+	g->mp_used = 0;
+	g->mp_nseg = 0;
 }
 
 /*
@@ -79,14 +185,23 @@ void kp_mempool_destroy(ktap_state_t *ks)
 int kp_mempool_init(ktap_state_t *ks, int size)
 {
 	ktap_global_state_t *g = G(ks);
+	struct kp_mempool_seg *seg;
 
-	g->mempool = vmalloc(size * 1024);
-	if (!g->mempool)
+	if (size > KP_MAX_MEMPOOL_SIZE)
+		size = KP_MAX_MEMPOOL_SIZE;
+
+	seg = mempool_seg_new(size * 1024);
+	if (!seg)
 		return -ENOMEM;
 
-	g->mp_freepos = g->mempool;
-	g->mp_size = size * 1024;
+	g->mempool = seg;
+	g->mp_cur = seg;
+	g->mp_freepos = SEG_DATA(seg);
+	g->mp_end = SEG_DATA(seg) + seg->size;
+	g->mp_size = seg->size;
+	g->mp_used = 0;
+	g->mp_nseg = 1;
+	g->mp_failed = 0;
 	g->mp_lock = (arch_spinlock_t)__ARCH_SPIN_LOCK_UNLOCKED;
 	return 0;
 }
-
@@ -2,7 +2,18 @@
 #define __KTAP_MEMPOOL_H__
 
 void *kp_mempool_alloc(ktap_state_t *ks, int size);
+int kp_mempool_grow(ktap_state_t *ks, int reserve);
 void kp_mempool_destroy(ktap_state_t *ks);
 int kp_mempool_init(ktap_state_t *ks, int size);
 
+/*
+ * mainthread is in process context, grow mempool for size bytes before
+ * allocation, must be called without holding any spinlock.
+ */
+static inline void kp_mempool_reserve(ktap_state_t *ks, int size)
+{
+	if (ks == G(ks)->mainthread)
+		kp_mempool_grow(ks, size);
+}
+
 #endif /* __KTAP_MEMPOOL_H__ */
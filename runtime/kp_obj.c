@@ -33,6 +33,7 @@
 #include "ktap.h"
 #include "kp_vm.h"
 #include "kp_transport.h"
+#include "kp_stackmap.h"
 
 /* Error message strings. */
 const char *kp_err_allmsg =
@@ -105,6 +106,9 @@ void kp_obj_dump(ktap_state_t *ks, const ktap_val_t *v)
 	case KTAP_TSTR:
 		kp_printf(ks, "STR #%s", svalue(v));
 		break;
+	case KTAP_TSTRVIEW:
+		kp_printf(ks, "STRVIEW #%s", strviewvalue(v));
+		break;
 	case KTAP_TTAB:
 		kp_printf(ks, "TABLE 0x%lx", (unsigned long)hvalue(v));
 		break;
@@ -141,6 +145,9 @@ void kp_obj_show(ktap_state_t *ks, const ktap_val_t *v)
 	case KTAP_TSTR:
 		kp_puts(ks, svalue(v));
 		break;
+	case KTAP_TSTRVIEW:
+		kp_puts(ks, strviewvalue(v));
+		break;
 	case KTAP_TTAB:
 		kp_printf(ks, "table 0x%lx", (unsigned long)hvalue(v));
 		break;
@@ -163,6 +170,12 @@ void kp_obj_show(ktap_state_t *ks, const ktap_val_t *v)
 		kp_transport_print_kstack(ks, v->val.stack.depth,
 					      v->val.stack.skip);
 		break;
+	case KTAP_TUSTACK:
+		kp_transport_print_ustack(ks, v->val.stack.depth);
+		break;
+	case KTAP_TSTACKID:
+		kp_stack_print(ks, stackidvalue(v));
+		break;
         default:
 		kp_error(ks, "print unknown value type: %d\n", itype(v));
 		break;
@@ -188,6 +201,8 @@ int kp_obj_rawequal(const ktap_val_t *t1, const ktap_val_t *t2)
 		return fvalue(t1) == fvalue(t2);
 	case KTAP_TSTR:
 		return rawtsvalue(t1) == rawtsvalue(t2);
+	case KTAP_TSTRVIEW:
+		return !strcmp(strviewvalue(t1), strviewvalue(t2));
 	case KTAP_TTAB:
 		return hvalue(t1) == hvalue(t2);
 	default:
@@ -197,6 +212,23 @@ int kp_obj_rawequal(const ktap_val_t *t1, const ktap_val_t *t2)
 	return 0;
 }
 
+/*
+ * equality of string view and string, without interning string view.
+ */
+int kp_obj_strviewequal(const ktap_val_t *t1, const ktap_val_t *t2)
+{
+	if (is_strview(t2)) {
+		const ktap_val_t *t = t1;
+		t1 = t2;
+		t2 = t;
+	}
+
+	if (!is_strview(t1) || !is_string(t2))
+		return 0;
+
+	return !strcmp(strviewvalue(t1), svalue(t2));
+}
+
 /*
  * ktap will not use lua's length operator for table,
  * also # is not for length operator any more in ktap.
@@ -208,6 +240,8 @@ int kp_obj_len(ktap_state_t *ks, const ktap_val_t *v)
 		return kp_tab_len(ks, hvalue(v));
 	case KTAP_TSTR:
 		return rawtsvalue(v)->len;
+	case KTAP_TSTRVIEW:
+		return strlen(strviewvalue(v));
 	default:
 		kp_printf(ks, "cannot get length of type %d\n", v->type);
 		return -1;
@@ -237,36 +271,6 @@ ktap_obj_t *kp_obj_new(ktap_state_t *ks, size_t size)
 }
 
 
-/* this function may be time consuming, move out from table set/get? */
-ktap_str_t *kp_obj_kstack2str(ktap_state_t *ks, uint16_t depth, uint16_t skip)
-{
-	struct stack_trace trace;
-	unsigned long *bt;
-	char *btstr, *p;
-	int i;
-
-	bt = kp_this_cpu_print_buffer(ks); /* use print percpu buffer */
-	trace.nr_entries = 0;
-	trace.skip = skip;
-	trace.max_entries = depth;
-	trace.entries = (unsigned long *)(bt + 1);
-	save_stack_trace(&trace);
-
-	/* convert backtrace to string */
-	p = btstr = kp_this_cpu_temp_buffer(ks);
-	for (i = 0; i < trace.nr_entries; i++) {
-		unsigned long addr = trace.entries[i];
-
-		if (addr == ULONG_MAX)
-			break;
-
-		p += sprint_symbol(p, addr);
-		*p++ = '\n';
-        }
-
-	return kp_str_new(ks, btstr, p - btstr);
-}
-
 void kp_obj_free_gclist(ktap_state_t *ks, ktap_obj_t *o)
 {
 	while (o) {
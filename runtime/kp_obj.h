@@ -10,11 +10,12 @@ void kp_obj_show(ktap_state_t *ks, const ktap_val_t *v);
 int kp_obj_len(ktap_state_t *ks, const ktap_val_t *rb);
 ktap_obj_t *kp_obj_new(ktap_state_t *ks, size_t size);
 int kp_obj_rawequal(const ktap_val_t *t1, const ktap_val_t *t2);
-ktap_str_t *kp_obj_kstack2str(ktap_state_t *ks, uint16_t depth, uint16_t skip);
+int kp_obj_strviewequal(const ktap_val_t *t1, const ktap_val_t *t2);
 void kp_obj_free_gclist(ktap_state_t *ks, ktap_obj_t *o);
 void kp_obj_freeall(ktap_state_t *ks);
 
 #define kp_obj_equal(o1, o2) \
-	(((o1)->type == (o2)->type) && kp_obj_rawequal(o1, o2))
+	(((o1)->type == (o2)->type) ? kp_obj_rawequal(o1, o2) : \
+	 ((is_strview(o1) || is_strview(o2)) && kp_obj_strviewequal(o1, o2)))
 
 #endif /* __KTAP_OBJ_H__ */
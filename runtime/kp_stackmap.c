@@ -0,0 +1,199 @@
+/*
+ * kp_stackmap.c - map of unique stacks, keyed by raw addresses
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/sched.h>
+#include <linux/stacktrace.h>
+#include <linux/module.h>
+#include <linux/kallsyms.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include "../include/ktap_types.h"
+#include "ktap.h"
+#include "kp_obj.h"
+#include "kp_mempool.h"
+#include "kp_transport.h"
+#include "kp_stackmap.h"
+
+/*
+ * stack() or ustack() used as table key is interned into stack map,
+ * like string,
+ * table only store the unique stack id. Probe context only save raw
+ * return addresses, symbolization happens once for each unique stack
+ * when it's printed. User stack is also keyed by tgid, the same
+ * addresses in different processes are different stacks.
+ */
+
+#define KP_STACKMAP_BITS	10
+#define KP_STACKMAP_MAX_BITS	16
+
+static uint32_t stack_hash(const unsigned long *entries, int nr, int pid)
+{
+	return jhash(entries, nr * sizeof(unsigned long), pid);
+}
+
+/*
+ * find or add current kernel stack, or user stack if user is set,
+ * in stack map.
+ */
+kp_stack_t *kp_stackmap_get(ktap_state_t *ks, uint16_t depth, uint16_t skip,
+			    int user)
+{
+	ktap_global_state_t *g = G(ks);
+	struct stack_trace trace;
+	unsigned long *entries;
+	unsigned long flags;
+	kp_stack_t *st;
+	int pid = 0;
+	uint32_t h;
+
+	entries = kp_this_cpu_print_buffer(ks); /* use print percpu buffer */
+	trace.nr_entries = 0;
+	trace.skip = skip;
+	trace.max_entries = depth;
+	trace.entries = entries;
+
+	if (user) {
+#ifdef CONFIG_USER_STACKTRACE_SUPPORT
+		save_stack_trace_user(&trace);
+		pid = current->tgid;
+#endif
+	} else
+		save_stack_trace(&trace);
+
+	/* drop ULONG_MAX end marker */
+	while (trace.nr_entries &&
+	       entries[trace.nr_entries - 1] == ULONG_MAX)
+		trace.nr_entries--;
+
+	h = stack_hash(entries, trace.nr_entries, pid);
+
+	kp_mempool_reserve(ks, sizeof(*st) +
+			       trace.nr_entries * sizeof(unsigned long));
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->stack_lock);
+
+	for (st = g->stackhash[h & g->stackmask]; st; st = st->next) {
+		if (st->hash == h && st->nr == trace.nr_entries &&
+		    st->pid == pid && !memcmp(st->entries, entries,
+			    st->nr * sizeof(unsigned long)))
+			goto out;
+	}
+
+	st = kp_mempool_alloc(ks, sizeof(*st) +
+				  trace.nr_entries * sizeof(unsigned long));
+	if (unlikely(!st)) {
+		kp_error(ks, "cannot allocate stack in stack map\n");
+		goto out;
+	}
+
+	st->hash = h;
+	st->nr = trace.nr_entries;
+	st->pid = pid;
+	memcpy(st->entries, entries, st->nr * sizeof(unsigned long));
+
+	h &= g->stackmask;
+	st->next = g->stackhash[h];
+	g->stackhash[h] = st;
+	g->stacknum++;
+
+ out:
+	arch_spin_unlock(&g->stack_lock);
+	local_irq_restore(flags);
+	return st;
+}
+
+/*
+ * print symbolized stack, one frame per line.
+ */
+void kp_stack_print(ktap_state_t *ks, const kp_stack_t *st)
+{
+	char str[KSYM_SYMBOL_LEN];
+	int i;
+
+	for (i = 0; i < st->nr; i++) {
+		if (st->pid)
+			kp_sprint_usymbol(ks, str, st->pid, st->entries[i], 1);
+		else
+			kp_sprint_symbol(ks, str, st->entries[i], 1, 0);
+		kp_printf(ks, "%s\n", str);
+	}
+}
+
+/*
+ * Double stack map when it holds more stacks than buckets, keeping hash
+ * chains short for lookup in probe context. Only called in process
+ * context, by sleep_loop, same as mempool growing.
+ */
+void kp_stackmap_resize(ktap_state_t *ks)
+{
+	ktap_global_state_t *g = G(ks);
+	kp_stack_t **newhash, **oldhash, *st, *next;
+	unsigned long flags;
+	int i, newmask;
+
+	if (!g->stackhash || g->stacknum <= g->stackmask ||
+	    g->stackmask >= (1 << KP_STACKMAP_MAX_BITS) - 1)
+		return;
+
+	newmask = (g->stackmask << 1) | 1;
+	newhash = kzalloc((newmask + 1) * sizeof(kp_stack_t *),
+			  GFP_KERNEL | __GFP_NOWARN);
+	if (!newhash)
+		return;
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->stack_lock);
+	for (i = 0; i <= g->stackmask; i++) {
+		for (st = g->stackhash[i]; st; st = next) {
+			next = st->next;
+			st->next = newhash[st->hash & newmask];
+			newhash[st->hash & newmask] = st;
+		}
+	}
+	oldhash = g->stackhash;
+	g->stackhash = newhash;
+	g->stackmask = newmask;
+	arch_spin_unlock(&g->stack_lock);
+	local_irq_restore(flags);
+
+	kfree(oldhash);
+}
+
+void kp_stackmap_exit(ktap_state_t *ks)
+{
+	/* stacks are freed with mempool */
+	kp_free(ks, G(ks)->stackhash);
+	G(ks)->stackhash = NULL;
+}
+
+int kp_stackmap_init(ktap_state_t *ks)
+{
+	ktap_global_state_t *g = G(ks);
+
+	g->stackhash = kp_zalloc(ks, (1 << KP_STACKMAP_BITS) *
+				     sizeof(kp_stack_t *));
+	if (!g->stackhash)
+		return -ENOMEM;
+
+	g->stackmask = (1 << KP_STACKMAP_BITS) - 1;
+	g->stacknum = 0;
+	g->stack_lock = (arch_spinlock_t)__ARCH_SPIN_LOCK_UNLOCKED;
+	return 0;
+}
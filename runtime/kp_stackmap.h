@@ -0,0 +1,11 @@
+#ifndef __KTAP_STACKMAP_H__
+#define __KTAP_STACKMAP_H__
+
+kp_stack_t *kp_stackmap_get(ktap_state_t *ks, uint16_t depth, uint16_t skip,
+			    int user);
+void kp_stack_print(ktap_state_t *ks, const kp_stack_t *st);
+void kp_stackmap_resize(ktap_state_t *ks);
+void kp_stackmap_exit(ktap_state_t *ks);
+int kp_stackmap_init(ktap_state_t *ks);
+
+#endif /* __KTAP_STACKMAP_H__ */
@@ -0,0 +1,215 @@
+/*
+ * kp_stats.c - runtime statistics of ktap itself
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/ring_buffer.h>
+#include "../include/ktap_types.h"
+#include "ktap.h"
+#include "kp_events.h"
+#include "kp_stats.h"
+
+/*
+ * Per-probe counters and global usage, shown by stats_<pid> file in
+ * debugfs while tracing, and printed at exit in verbose mode.
+ */
+
+#define KP_STATS_BUF_SIZE	(PAGE_SIZE * 4)
+
+static void stats_add(struct ktap_event_stats *sum, struct ktap_event *event)
+{
+	struct ktap_event_stats *stats;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(event->stats, cpu);
+		sum->hits += stats->hits;
+		sum->recursion_missed += stats->recursion_missed;
+		sum->missed += stats->missed;
+		sum->errors += stats->errors;
+		sum->time += stats->time;
+	}
+}
+
+static int stats_sprint_events(ktap_state_t *ks, char *buf, int size)
+{
+	struct list_head *head = &G(ks)->events_head;
+	struct ktap_event *event, *next;
+	struct ktap_event_stats sum;
+	int len;
+
+	len = scnprintf(buf, size, "%-32s %12s %10s %10s %8s %14s %8s\n",
+			"probe", "hits", "recursion", "dropped", "errors",
+			"time(ns)", "avg(ns)");
+
+	memset(&sum, 0, sizeof(sum));
+	list_for_each_entry(event, head, list) {
+		const char *name = kp_event_name(event);
+
+		stats_add(&sum, event);
+
+		/* perf events of one probe are created in a row, per cpu */
+		next = list_entry(event->list.next, struct ktap_event, list);
+		if (&next->list != head && next->fn == event->fn &&
+		    !strcmp(kp_event_name(next), name))
+			continue;
+
+		len += scnprintf(buf + len, size - len,
+				 "%-32s %12llu %10llu %10llu %8llu %14llu "
+				 "%8llu\n", name, sum.hits,
+				 sum.recursion_missed, sum.missed, sum.errors,
+				 sum.time, sum.hits ?
+				 div64_u64(sum.time, sum.hits) : 0);
+		memset(&sum, 0, sizeof(sum));
+	}
+
+	return len;
+}
+
+static int stats_sprint(ktap_state_t *ks, char *buf, int size)
+{
+	ktap_global_state_t *g = G(ks);
+	unsigned long entries = 0, lost = 0;
+	unsigned int ntab = 0, asize = 0, hsize = 0;
+	ktap_obj_t *o;
+	int len, cpu;
+
+	len = stats_sprint_events(ks, buf, size);
+
+	len += scnprintf(buf + len, size - len,
+			 "mempool: used %d/%d Kbytes, %d segments, "
+			 "%d strings, %d allocations failed\n",
+			 g->mp_used / 1024, g->mp_size / 1024,
+			 g->mp_nseg, g->strnum, g->mp_failed);
+
+	/* objects are only added at list head by mainthread */
+	for (o = g->allgc; o; o = gch(o)->nextgc) {
+		ktap_tab_t *t = (ktap_tab_t *)o;
+
+		if (gch(o)->gct != ~KTAP_TTAB)
+			continue;
+
+		ntab++;
+		asize += t->asize;
+		hsize += t->hmask + 1;
+	}
+
+	len += scnprintf(buf + len, size - len,
+			 "tables: %u, %u array slots, %u hash slots\n",
+			 ntab, asize, hsize);
+	len += scnprintf(buf + len, size - len,
+			 "stack map: %d stacks, %d buckets, "
+			 "symbol cache: %d symbols\n",
+			 g->stacknum, g->stackmask + 1, g->symnum);
+
+	for_each_possible_cpu(cpu) {
+		entries += ring_buffer_entries_cpu(g->buffer, cpu);
+		lost += per_cpu_ptr(g->stats, cpu)->events_missed;
+		lost += ring_buffer_overrun_cpu(g->buffer, cpu);
+	}
+
+	len += scnprintf(buf + len, size - len,
+			 "ring buffer: %lu records pending, %lu lost\n",
+			 entries, lost);
+
+	return len;
+}
+
+/* print stats at exit in verbose mode, before events are freed */
+void kp_stats_report(ktap_state_t *ks)
+{
+	char *buf, *p, *line;
+
+	if (!G(ks)->parm->verbose || !G(ks)->buffer)
+		return;
+
+	buf = vmalloc(KP_STATS_BUF_SIZE);
+	if (!buf)
+		return;
+
+	stats_sprint(ks, buf, KP_STATS_BUF_SIZE);
+
+	p = buf;
+	while ((line = strsep(&p, "\n")) && *line)
+		kp_printf(ks, "[verbose] %s\n", line);
+
+	vfree(buf);
+}
+
+/* snapshot stats at open, so reads see consistent content */
+static int stats_open(struct inode *inode, struct file *file)
+{
+	ktap_state_t *ks = inode->i_private;
+	char *buf;
+
+	buf = vmalloc(KP_STATS_BUF_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	stats_sprint(ks, buf, KP_STATS_BUF_SIZE);
+	file->private_data = buf;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t stats_read(struct file *file, char __user *ubuf, size_t cnt,
+			  loff_t *ppos)
+{
+	const char *buf = file->private_data;
+
+	return simple_read_from_buffer(ubuf, cnt, ppos, buf, strlen(buf));
+}
+
+static int stats_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations stats_fops = {
+	.open		= stats_open,
+	.read		= stats_read,
+	.release	= stats_release,
+	.llseek		= no_llseek,
+};
+
+/* stats file reads events and objects, remove it before they are freed */
+void kp_stats_exit(ktap_state_t *ks)
+{
+	debugfs_remove(G(ks)->stats_dentry);
+	G(ks)->stats_dentry = NULL;
+}
+
+int kp_stats_init(ktap_state_t *ks, struct dentry *dir)
+{
+	struct dentry *dentry;
+	char filename[32] = {0};
+
+	sprintf(filename, "stats_%d", (int)task_tgid_vnr(current));
+
+	dentry = debugfs_create_file(filename, 0444, dir, ks, &stats_fops);
+	if (!dentry) {
+		pr_err("ktapvm: cannot create stats file in debugfs\n");
+		return -1;
+	}
+
+	G(ks)->stats_dentry = dentry;
+	return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef __KTAP_STATS_H__
+#define __KTAP_STATS_H__
+
+void kp_stats_report(ktap_state_t *ks);
+void kp_stats_exit(ktap_state_t *ks);
+int kp_stats_init(ktap_state_t *ks, struct dentry *dir);
+
+#endif /* __KTAP_STATS_H__ */
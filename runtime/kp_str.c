@@ -33,6 +33,7 @@
 #include "kp_transport.h"
 #include "kp_vm.h"
 #include "kp_events.h"
+#include "kp_symcache.h"
 
 int kp_str_cmp(const ktap_str_t *ls, const ktap_str_t *rs)
 {
@@ -125,47 +126,77 @@ int kp_str_resize(ktap_state_t *ks, int newmask)
 }
 
 /*
- * Intern a string and return string object.
+ * find string in string hashtable, called with str_lock held.
  */
-ktap_str_t * kp_str_new(ktap_state_t *ks, const char *str, size_t len)
+static ktap_str_t *str_lookup(ktap_global_state_t *g, const char *str,
+			      size_t len, unsigned int h)
 {
-	ktap_global_state_t *g = G(ks);
-	ktap_str_t *s;
-	ktap_obj_t *o;
-	unsigned int h = kp_str_hash(str, len);
-	unsigned long flags;
+	ktap_obj_t *o = (ktap_obj_t *)g->strhash[h & g->strmask];
 
-	if (len >= KP_MAX_STR)
-		return NULL;
-
-	local_irq_save(flags);
-	arch_spin_lock(&g->str_lock);
-
-	o = (ktap_obj_t *)g->strhash[h & g->strmask];
 	if (likely((((uintptr_t)str+len-1) & (PAGE_SIZE-1)) <= PAGE_SIZE-4)) {
 		while (o != NULL) {
 			ktap_str_t *sx = (ktap_str_t *)o;
 			if (sx->len == len &&
-			    !str_fastcmp(str, getstr(sx), len)) {
-				arch_spin_unlock(&g->str_lock);
-				local_irq_restore(flags);
-				return sx; /* Return existing string. */
-			}
+			    !str_fastcmp(str, getstr(sx), len))
+				return sx;
 			o = gch(o)->nextgc;
 		}
 	} else { /* Slow path: end of string is too close to a page boundary */
 		while (o != NULL) {
 			ktap_str_t *sx = (ktap_str_t *)o;
 			if (sx->len == len &&
-			    !memcmp(str, getstr(sx), len)) {
-				arch_spin_unlock(&g->str_lock);
-				local_irq_restore(flags);
-				return sx; /* Return existing string. */
-			}
+			    !memcmp(str, getstr(sx), len))
+				return sx;
 			o = gch(o)->nextgc;
 		}
 	}
 
+	return NULL;
+}
+
+/*
+ * Find a interned string, return NULL if it's not interned.
+ * Never allocate, used for string view lookup.
+ */
+ktap_str_t *kp_str_find(ktap_state_t *ks, const char *str, size_t len)
+{
+	ktap_global_state_t *g = G(ks);
+	ktap_str_t *s;
+	unsigned long flags;
+
+	if (len >= KP_MAX_STR)
+		return NULL;
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->str_lock);
+	s = str_lookup(g, str, len, kp_str_hash(str, len));
+	arch_spin_unlock(&g->str_lock);
+	local_irq_restore(flags);
+	return s;
+}
+
+/*
+ * Intern a string and return string object.
+ */
+ktap_str_t * kp_str_new(ktap_state_t *ks, const char *str, size_t len)
+{
+	ktap_global_state_t *g = G(ks);
+	ktap_str_t *s;
+	unsigned int h = kp_str_hash(str, len);
+	unsigned long flags;
+
+	if (len >= KP_MAX_STR)
+		return NULL;
+
+	kp_mempool_reserve(ks, sizeof(ktap_str_t) + len + 1);
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->str_lock);
+
+	s = str_lookup(g, str, len, h);
+	if (s)
+		goto out; /* Return existing string. */
+
 	/* create a new string, allocate it from mempool, not use kmalloc. */
 	s = kp_mempool_alloc(ks, sizeof(ktap_str_t) + len + 1);
 	if (unlikely(!s))
@@ -174,6 +205,7 @@ ktap_str_t * kp_str_new(ktap_state_t *ks, const char *str, size_t len)
 	s->len = len;
 	s->hash = h;
 	s->reserved = 0;
+	s->fmt = NULL;
 	memcpy(s + 1, str, len);
 	((char *)(s + 1))[len] = '\0';  /* ending 0 */
 
@@ -275,117 +307,437 @@ static void arg_error(ktap_state_t *ks, int narg, const char *extramsg)
 	kp_error(ks, "bad argument #%d: (%s)\n", narg, extramsg);
 }
 
+/*
+ * printf format is compiled into op list at first use, and cached in
+ * format string object, so per-event cost is only argument formatting.
+ */
+enum {
+	KP_FMT_LITERAL,	/* literal run, including "%%" */
+	KP_FMT_CHAR,	/* %c */
+	KP_FMT_INT,	/* %d %i */
+	KP_FMT_UINT,	/* %o %u %x %X */
+	KP_FMT_SYM,	/* %p, print kernel symbol */
+	KP_FMT_STR,	/* %s */
+};
+
+typedef struct kp_fmt_op {
+	u8 type;
+	u8 prec;	/* %s has precision */
+	uint16_t len;	/* length of literal run */
+	union {
+		const char *lit;	/* literal run, point to format string */
+		char form[MAX_FORMAT];	/* conversion, length modifier added */
+	};
+} kp_fmt_op_t;
+
+typedef struct kp_fmt {
+	int nops;
+	int nargs;
+	kp_fmt_op_t ops[0];
+} kp_fmt_t;
+
+/* cached in ts->fmt when format is invalid, see fmt_get */
+#define KP_FMT_INVALID	((kp_fmt_t *)-1L)
+
+/*
+ * return NULL if it cannot allocate, KP_FMT_INVALID if format is
+ * invalid, space allocated for it is not reused then.
+ */
+static kp_fmt_t *fmt_compile(ktap_state_t *ks, const ktap_str_t *ts)
+{
+	const char *strfrmt = getstr(ts);
+	const char *strfrmt_end = strfrmt + ts->len;
+	const char *p;
+	kp_fmt_t *fmt;
+	kp_fmt_op_t *op;
+	int nops = 0;
+
+	/* worst case: every literal run is followed by a conversion */
+	for (p = strfrmt; p < strfrmt_end; p++) {
+		if (*p == L_ESC)
+			nops += 2;
+	}
+	nops++;
+
+	kp_mempool_reserve(ks, sizeof(*fmt) + nops * sizeof(*op));
+	fmt = kp_mempool_alloc(ks, sizeof(*fmt) + nops * sizeof(*op));
+	if (unlikely(!fmt)) {
+		kp_error(ks, "cannot allocate printf format\n");
+		return NULL;
+	}
+
+	fmt->nops = 0;
+	fmt->nargs = 0;
+	op = &fmt->ops[0];
+
+	while (strfrmt < strfrmt_end) {
+		if (*strfrmt != L_ESC || *(strfrmt + 1) == L_ESC) {
+			/* append to current literal run */
+			if (op == &fmt->ops[0] ||
+			    (op - 1)->type != KP_FMT_LITERAL ||
+			    (op - 1)->lit + (op - 1)->len != strfrmt) {
+				op->type = KP_FMT_LITERAL;
+				op->lit = strfrmt;
+				op->len = 0;
+				op++;
+			}
+
+			/* "%%" prints one '%', literal ends at first one */
+			(op - 1)->len++;
+			strfrmt += (*strfrmt == L_ESC) ? 2 : 1;
+			continue;
+		}
+
+		strfrmt = scanformat(ks, strfrmt + 1, op->form);
+		if (!strfrmt)
+			return KP_FMT_INVALID;
+
+		switch (*strfrmt++) {
+		case 'c':
+			op->type = KP_FMT_CHAR;
+			break;
+		case 'd':  case 'i':
+			op->type = KP_FMT_INT;
+			addlenmod(op->form, INTFRMLEN);
+			break;
+		case 'p':
+			op->type = KP_FMT_SYM;
+			break;
+		case 'o':  case 'u':  case 'x':  case 'X':
+			op->type = KP_FMT_UINT;
+			addlenmod(op->form, INTFRMLEN);
+			break;
+		case 's':
+			op->type = KP_FMT_STR;
+			op->prec = !!strchr(op->form, '.');
+			break;
+		default: /* also treat cases `pnLlh' */
+			kp_error(ks, "invalid option " KTAP_QL("%%%c")
+				     " to " KTAP_QL("format"),
+				     *(strfrmt - 1));
+			return KP_FMT_INVALID;
+		}
+
+		op++;
+		fmt->nargs++;
+	}
+
+	fmt->nops = op - &fmt->ops[0];
+	return fmt;
+}
+
+static const kp_fmt_t *fmt_get(ktap_state_t *ks, ktap_str_t *ts)
+{
+	kp_fmt_t *fmt = ts->fmt;
+
+	if (likely(fmt))
+		return fmt == KP_FMT_INVALID ? NULL : fmt;
+
+	fmt = fmt_compile(ks, ts);
+	if (!fmt)
+		return NULL;
+
+	/*
+	 * other cpu may compiled it at same time, just use that one.
+	 * Invalid format is cached as well, error is reported once and
+	 * mempool is not consumed again by other probes of it.
+	 */
+	smp_wmb();
+	if (cmpxchg(&ts->fmt, NULL, fmt))
+		fmt = ts->fmt;
+	return fmt == KP_FMT_INVALID ? NULL : fmt;
+}
+
+static int fmt_str(ktap_state_t *ks, struct trace_seq *seq,
+		   const kp_fmt_op_t *op, int arg)
+{
+	ktap_val_t *v = kp_arg(ks, arg);
+	const char *s;
+	size_t l;
+
+	if (is_nil(v)) {
+		_trace_seq_puts(seq, "nil");
+		return 0;
+	}
+
+	if (is_eventstr(v)) {
+		s = kp_event_tostr(ks);
+		if (!s)
+			return -1;
+		_trace_seq_puts(seq, s);
+		return 0;
+	}
+
+	if (is_strview(v)) {
+		s = strviewvalue(v);
+		l = strlen(s);
+	} else {
+		kp_arg_checkstring(ks, arg);
+		s = svalue(v);
+		l = rawtsvalue(v)->len;
+	}
+
+	if (!op->prec && l >= 100) {
+		/*
+		 * no precision and string is too long
+		 * to be formatted;
+		 * keep original string
+		 */
+		_trace_seq_puts(seq, s);
+	} else
+		trace_seq_printf(seq, op->form, s);
+
+	return 0;
+}
+
 int kp_str_fmt(ktap_state_t *ks, struct trace_seq *seq)
 {
 	int arg = 1;
-	size_t sfl;
-	ktap_val_t *arg_fmt = kp_arg(ks, 1);
 	int argnum = kp_arg_nr(ks);
-	const char *strfrmt, *strfrmt_end;
+	const kp_fmt_t *fmt;
+	const kp_fmt_op_t *op, *end;
+
+	if (unlikely(!is_string(kp_arg(ks, 1)))) {
+		kp_error(ks, "wrong type of argument %d\n", 1);
+		return -1;
+	}
 
-	strfrmt = svalue(arg_fmt);
-	sfl = rawtsvalue(arg_fmt)->len;
-	strfrmt_end = strfrmt + sfl;
+	fmt = fmt_get(ks, rawtsvalue(kp_arg(ks, 1)));
+	if (unlikely(!fmt))
+		return -1;
 
-	while (strfrmt < strfrmt_end) {
-		if (*strfrmt != L_ESC)
-			trace_seq_putc(seq, *strfrmt++);
-		else if (*++strfrmt == L_ESC)
-			trace_seq_putc(seq, *strfrmt++);
-		else { /* format item */
-			char form[MAX_FORMAT];
-
-			if (++arg > argnum) {
-				arg_error(ks, arg, "no value");
+	if (unlikely(fmt->nargs >= argnum)) {
+		arg_error(ks, argnum + 1, "no value");
+		return -1;
+	}
+
+	end = fmt->ops + fmt->nops;
+	for (op = fmt->ops; op < end; op++) {
+		if (op->type == KP_FMT_LITERAL) {
+			trace_seq_putmem(seq, op->lit, op->len);
+			continue;
+		}
+
+		arg++;
+		if (op->type == KP_FMT_STR) {
+			if (fmt_str(ks, seq, op, arg))
 				return -1;
+			continue;
+		}
+
+		kp_arg_checknumber(ks, arg);
+
+		switch (op->type) {
+		case KP_FMT_CHAR:
+			trace_seq_printf(seq, op->form,
+					 nvalue(kp_arg(ks, arg)));
+			break;
+		case KP_FMT_INT:
+			trace_seq_printf(seq, op->form,
+					 (INTFRM_T)nvalue(kp_arg(ks, arg)));
+			break;
+		case KP_FMT_UINT:
+			trace_seq_printf(seq, op->form,
+				(unsigned INTFRM_T)nvalue(kp_arg(ks, arg)));
+			break;
+		case KP_FMT_SYM: {
+			char str[KSYM_SYMBOL_LEN];
+
+			kp_symcache_sprint(ks, str, nvalue(kp_arg(ks, arg)), 0);
+			_trace_seq_puts(seq, str);
+			break;
 			}
+		}
+	}
 
-			strfrmt = scanformat(ks, strfrmt, form);
-			switch (*strfrmt++) {
-			case 'c':
-				kp_arg_checknumber(ks, arg);
+	return 0;
+}
 
-				trace_seq_printf(seq, form,
-						 nvalue(kp_arg(ks, arg)));
-				break;
-			case 'd':  case 'i': {
-				ktap_number n;
-				INTFRM_T ni;
+/*
+ * Binary printf, like kernel trace_bprintk.
+ *
+ * Probe context only records compiled format and raw argument values,
+ * formatting is deferred to trace_pipe reading side.
+ * Record layout: kp_fmt_t pointer, then one slot for each conversion,
+ * ktap_number for numbers, long aligned NUL-terminated chars for %s.
+ */
+int kp_str_bfmt(ktap_state_t *ks, void *buf, int size)
+{
+	int arg = 1;
+	int argnum = kp_arg_nr(ks);
+	const kp_fmt_t *fmt;
+	const kp_fmt_op_t *op, *end;
+	char *p = buf, *bufend = (char *)buf + size;
 
-				kp_arg_checknumber(ks, arg);
+	if (unlikely(!is_string(kp_arg(ks, 1)))) {
+		kp_error(ks, "wrong type of argument %d\n", 1);
+		return -1;
+	}
 
-				n = nvalue(kp_arg(ks, arg));
-				ni = (INTFRM_T)n;
-				addlenmod(form, INTFRMLEN);
-				trace_seq_printf(seq, form, ni);
-				break;
-			}
-			case 'p': {
-				char str[KSYM_SYMBOL_LEN];
+	fmt = fmt_get(ks, rawtsvalue(kp_arg(ks, 1)));
+	if (unlikely(!fmt))
+		return -1;
 
-				kp_arg_checknumber(ks, arg);
+	if (unlikely(fmt->nargs >= argnum)) {
+		arg_error(ks, argnum + 1, "no value");
+		return -1;
+	}
 
-				SPRINT_SYMBOL(str, nvalue(kp_arg(ks, arg)));
-				_trace_seq_puts(seq, str);
+	*(const kp_fmt_t **)p = fmt;
+	p += sizeof(fmt);
+
+	end = fmt->ops + fmt->nops;
+	for (op = fmt->ops; op < end; op++) {
+		ktap_val_t *v;
+
+		if (op->type == KP_FMT_LITERAL)
+			continue;
+
+		v = kp_arg(ks, ++arg);
+		if (op->type == KP_FMT_STR) {
+			const char *s;
+			int l;
+
+			if (is_nil(v))
+				s = "nil";
+			else if (is_eventstr(v))
+				s = kp_event_tostr(ks);
+			else if (is_strview(v))
+				s = strviewvalue(v);
+			else
+				s = kp_arg_checkstring(ks, arg);
+			if (!s)
+				return -1;
+
+			/* truncate string like trace_seq does when full */
+			l = min_t(int, strlen(s), bufend - p - 1);
+			if (l < 0)
 				break;
-			}
-			case 'o':  case 'u':  case 'x':  case 'X': {
-				ktap_number n;
-				unsigned INTFRM_T ni;
+			memcpy(p, s, l);
+			p[l] = '\0';
+			p += ALIGN(l + 1, sizeof(long));
+			continue;
+		}
 
-				kp_arg_checknumber(ks, arg);
+		kp_arg_checknumber(ks, arg);
+		if (p + sizeof(ktap_number) > bufend)
+			break;
+		*(ktap_number *)p = nvalue(v);
+		p += sizeof(ktap_number);
+	}
 
-				n = nvalue(kp_arg(ks, arg));
-				ni = (unsigned INTFRM_T)n;
-				addlenmod(form, INTFRMLEN);
-				trace_seq_printf(seq, form, ni);
-				break;
-			}
-			case 's': {
-				ktap_val_t *v = kp_arg(ks, arg);
-				const char *s;
-				size_t l;
-
-				if (is_nil(v)) {
-					_trace_seq_puts(seq, "nil");
-					return 0;
-				}
-
-				if (is_eventstr(v)) {
-					const char *str = kp_event_tostr(ks);
-					if (!str)
-						return  -1;
-					_trace_seq_puts(seq,
-						kp_event_tostr(ks));
-					return 0;
-				}
-
-				kp_arg_checkstring(ks, arg);
-
-				s = svalue(v);
-				l = rawtsvalue(v)->len;
-				if (!strchr(form, '.') && l >= 100) {
-					/*
-					 * no precision and string is too long
-					 * to be formatted;
-					 * keep original string
-					 */
-					_trace_seq_puts(seq, s);
-					break;
-				} else {
-					trace_seq_printf(seq, form, s);
-					break;
-				}
-			}
-			default: /* also treat cases `pnLlh' */
-				kp_error(ks, "invalid option " KTAP_QL("%%%c")
-					     " to " KTAP_QL("format"),
-					     *(strfrmt - 1));
-				return -1;
+	return min_t(int, p - (char *)buf, size);
+}
+
+/*
+ * format binary printf record into seq, called in trace_pipe reading.
+ */
+int kp_str_bfmt_print(ktap_state_t *ks, struct trace_seq *seq,
+		      const void *buf, int size)
+{
+	const char *p = buf, *bufend = (const char *)buf + size;
+	const kp_fmt_t *fmt = *(const kp_fmt_t **)p;
+	const kp_fmt_op_t *op, *end;
+
+	p += sizeof(fmt);
+
+	end = fmt->ops + fmt->nops;
+	for (op = fmt->ops; op < end; op++) {
+		ktap_number n;
+
+		if (op->type == KP_FMT_LITERAL) {
+			trace_seq_putmem(seq, op->lit, op->len);
+			continue;
+		}
+
+		/* record is truncated */
+		if (p >= bufend)
+			break;
+
+		if (op->type == KP_FMT_STR) {
+			int l = strlen(p);
+
+			if (!op->prec && l >= 100)
+				_trace_seq_puts(seq, p);
+			else
+				trace_seq_printf(seq, op->form, p);
+			p += ALIGN(l + 1, sizeof(long));
+			continue;
+		}
+
+		n = *(const ktap_number *)p;
+		p += sizeof(ktap_number);
+
+		switch (op->type) {
+		case KP_FMT_CHAR:
+			trace_seq_printf(seq, op->form, n);
+			break;
+		case KP_FMT_INT:
+			trace_seq_printf(seq, op->form, (INTFRM_T)n);
+			break;
+		case KP_FMT_UINT:
+			trace_seq_printf(seq, op->form, (unsigned INTFRM_T)n);
+			break;
+		case KP_FMT_SYM: {
+			char str[KSYM_SYMBOL_LEN];
+
+			kp_sprint_symbol(ks, str, n, 0, 0);
+			_trace_seq_puts(seq, str);
+			break;
 			}
 		}
 	}
 
-	return 0;
+	return seq->full ? -1 : 0;
 }
 
+/*
+ * quote string as JSON or CSV value into buf, see KTAP_FORMAT_JSON,
+ * return length, or -1 if buf is too small. CSV value is quoted only
+ * when it has to be. Symbol tokens are kept for reader to resolve.
+ */
+int kp_str_quote(char *buf, int size, const char *str, int len, int format)
+{
+	int i, n = 0, quote = (format == KTAP_FORMAT_JSON);
+
+	for (i = 0; !quote && i < len; i++) {
+		if (str[i] == ',' || str[i] == '"' || str[i] == '\n' ||
+		    str[i] == '\r')
+			quote = 1;
+	}
+
+#define QUOTE_PUTC(c)			\
+	do {				\
+		if (n >= size)		\
+			return -1;	\
+		buf[n++] = (c);		\
+	} while (0)
+
+	if (quote)
+		QUOTE_PUTC('"');
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (format == KTAP_FORMAT_CSV) {
+			if (c == '"')
+				QUOTE_PUTC('"');
+			QUOTE_PUTC(c);
+		} else if (c == '"' || c == '\\') {
+			QUOTE_PUTC('\\');
+			QUOTE_PUTC(c);
+		} else if (c < 0x20 && c != KTAP_SYM_BEGIN &&
+			   c != KTAP_SYM_END) {
+			if (n + 7 > size)
+				return -1;
+			n += sprintf(buf + n, "\\u%04x", c);
+		} else
+			QUOTE_PUTC(c);
+	}
+
+	if (quote)
+		QUOTE_PUTC('"');
+
+#undef QUOTE_PUTC
+	return n;
+}
@@ -5,10 +5,36 @@ int kp_str_cmp(const ktap_str_t *ls, const ktap_str_t *rs);
 int kp_str_resize(ktap_state_t *ks, int newmask);
 void kp_str_freeall(ktap_state_t *ks);
 ktap_str_t * kp_str_new(ktap_state_t *ks, const char *str, size_t len);
+ktap_str_t *kp_str_find(ktap_state_t *ks, const char *str, size_t len);
 
 #define kp_str_newz(ks, s)	(kp_str_new(ks, s, strlen(s)))
 
+/*
+ * intern string view before it escapes from event context,
+ * return val itself if it's not a string view.
+ */
+static inline const ktap_val_t *kp_str_internview(ktap_state_t *ks,
+						  const ktap_val_t *val,
+						  ktap_val_t *tmp)
+{
+	ktap_str_t *ts;
+
+	if (likely(!is_strview(val)))
+		return val;
+
+	ts = kp_str_newz(ks, strviewvalue(val));
+	if (unlikely(!ts))
+		return NULL;
+
+	set_string(tmp, ts);
+	return tmp;
+}
+
 #include <linux/trace_seq.h>
 int kp_str_fmt(ktap_state_t *ks, struct trace_seq *seq);
+int kp_str_bfmt(ktap_state_t *ks, void *buf, int size);
+int kp_str_bfmt_print(ktap_state_t *ks, struct trace_seq *seq,
+		      const void *buf, int size);
+int kp_str_quote(char *buf, int size, const char *str, int len, int format);
 
 #endif /* __KTAP_STR_H__ */
@@ -0,0 +1,126 @@
+/*
+ * kp_symcache.c - cache of kernel symbol names, keyed by address
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/kallsyms.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include "../include/ktap_types.h"
+#include "ktap.h"
+#include "kp_mempool.h"
+#include "kp_symcache.h"
+
+/*
+ * sprintf %p and stringof need symbol names in kernel, they symbolize
+ * the same addresses again and again, each sprint_symbol walks kallsyms.
+ * Symbol names are cached in mempool, so only the first lookup of each
+ * address walks kallsyms. Histogram, stack and print output only use it
+ * when reader doesn't resolve symbols, otherwise they emit symbol tokens,
+ * see kp_sprint_symbol. Entries are only allocated on lookup, so the
+ * cache costs no mempool when nothing uses it.
+ */
+
+#define KP_SYMCACHE_BITS	10
+
+static kp_sym_t *symcache_find(ktap_global_state_t *g, unsigned long addr,
+			       int offset, uint32_t h)
+{
+	kp_sym_t *sym;
+
+	for (sym = g->symhash[h]; sym; sym = sym->next) {
+		if (sym->addr == addr && sym->offset == offset)
+			return sym;
+	}
+
+	return NULL;
+}
+
+/*
+ * sprint symbol of kernel address, like sprint_symbol with offset,
+ * like SPRINT_SYMBOL without offset. Can be called in any context.
+ */
+int kp_symcache_sprint(ktap_state_t *ks, char *buffer, unsigned long addr,
+		       int offset)
+{
+	ktap_global_state_t *g = G(ks);
+	uint32_t h = hash_long(addr, KP_SYMCACHE_BITS);
+	unsigned long flags;
+	kp_sym_t *sym;
+	int len;
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->sym_lock);
+	sym = symcache_find(g, addr, offset, h);
+	if (sym) {
+		len = sym->len;
+		memcpy(buffer, sym->name, len + 1);
+	}
+	arch_spin_unlock(&g->sym_lock);
+	local_irq_restore(flags);
+
+	if (sym)
+		return len;
+
+	len = offset ? sprint_symbol(buffer, addr) :
+		       SPRINT_SYMBOL(buffer, addr);
+
+	/* cache is best effort, mempool may be exhausted */
+	kp_mempool_reserve(ks, sizeof(*sym) + len + 1);
+	sym = kp_mempool_alloc(ks, sizeof(*sym) + len + 1);
+	if (!sym)
+		return len;
+
+	sym->addr = addr;
+	sym->offset = offset;
+	sym->len = len;
+	memcpy(sym->name, buffer, len + 1);
+
+	local_irq_save(flags);
+	arch_spin_lock(&g->sym_lock);
+	/* other cpu may added it meanwhile, keep the first one */
+	if (!symcache_find(g, addr, offset, h)) {
+		sym->next = g->symhash[h];
+		g->symhash[h] = sym;
+		g->symnum++;
+	}
+	arch_spin_unlock(&g->sym_lock);
+	local_irq_restore(flags);
+
+	return len;
+}
+
+void kp_symcache_exit(ktap_state_t *ks)
+{
+	/* symbols are freed with mempool */
+	kp_free(ks, G(ks)->symhash);
+	G(ks)->symhash = NULL;
+}
+
+int kp_symcache_init(ktap_state_t *ks)
+{
+	ktap_global_state_t *g = G(ks);
+
+	g->symhash = kp_zalloc(ks, (1 << KP_SYMCACHE_BITS) * sizeof(kp_sym_t *));
+	if (!g->symhash)
+		return -ENOMEM;
+
+	g->symnum = 0;
+	g->sym_lock = (arch_spinlock_t)__ARCH_SPIN_LOCK_UNLOCKED;
+	return 0;
+}
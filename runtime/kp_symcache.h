@@ -0,0 +1,9 @@
+#ifndef __KTAP_SYMCACHE_H__
+#define __KTAP_SYMCACHE_H__
+
+int kp_symcache_sprint(ktap_state_t *ks, char *buffer, unsigned long addr,
+		       int offset);
+void kp_symcache_exit(ktap_state_t *ks);
+int kp_symcache_init(ktap_state_t *ks);
+
+#endif /* __KTAP_SYMCACHE_H__ */
@@ -32,6 +32,8 @@
 #include "kp_obj.h"
 #include "kp_str.h"
 #include "kp_events.h"
+#include "kp_stackmap.h"
+#include "kp_transport.h"
 #include "kp_tab.h"
 
 #define tab_lock_init(t)						\
@@ -347,6 +349,16 @@ static const ktap_val_t *tab_get(ktap_state_t *ks, ktap_tab_t *t,
 			return niltv;
 
 		return tab_getstr(t, rawtsvalue(key));
+	} else if (is_strview(key)) {
+		const char *str = strviewvalue(key);
+		ktap_str_t *ts;
+
+		/* string is not interned, then it cannot be a key */
+		ts = kp_str_find(ks, str, strlen(str));
+		if (!ts)
+			return niltv;
+
+		return tab_getstr(t, ts);
 	} else if (!is_nil(key)) {
 		ktap_node_t *n;
  genlookup:
@@ -359,11 +371,40 @@ static const ktap_val_t *tab_get(ktap_state_t *ks, ktap_tab_t *t,
 	return niltv;
 }
 
+/*
+ * Change key into the form stored in table, before tab_lock is taken:
+ * stack() is interned into stack map, string view is interned when set.
+ * Both allocate from mempool, mainthread may grow it, which sleeps.
+ */
+static const ktap_val_t *tab_internkey(ktap_state_t *ks, const ktap_val_t *key,
+				       ktap_val_t *tmp, int set)
+{
+	if (itype(key) == KTAP_TKSTACK || itype(key) == KTAP_TUSTACK) {
+		/* change stack into unique stack id, symbolize it when print */
+		kp_stack_t *st = kp_stackmap_get(ks, key->val.stack.depth,
+						 key->val.stack.skip,
+						 itype(key) == KTAP_TUSTACK);
+		if (!st)
+			return NULL;
+		set_stackid(tmp, st);
+		return tmp;
+	}
+
+	return set ? kp_str_internview(ks, key, tmp) : key;
+}
+
 void kp_tab_get(ktap_state_t *ks, ktap_tab_t *t, const ktap_val_t *key,
 		ktap_val_t *val)
 {
+	ktap_val_t tmp;
 	unsigned long flags;
 
+	key = tab_internkey(ks, key, &tmp, 0);
+	if (unlikely(!key)) {
+		set_nil(val);
+		return;
+	}
+
 	tab_lock(t);
 	set_obj(val, tab_get(ks, t, key));
 	tab_unlock(t);
@@ -453,9 +494,13 @@ ktap_val_t *tab_setint(ktap_state_t *ks, ktap_tab_t *t, uint32_t key)
 void kp_tab_setint(ktap_state_t *ks, ktap_tab_t *t,
 		   uint32_t key, const ktap_val_t *val)
 {
-	ktap_val_t *v;
+	ktap_val_t *v, tmp;
 	unsigned long flags;
 
+	val = kp_str_internview(ks, val, &tmp);
+	if (unlikely(!val))
+		return;
+
 	tab_lock(t);
 	v = tab_setint(ks, t, key);
 	if (likely(v))
@@ -501,9 +546,13 @@ static ktap_val_t *tab_setstr(ktap_state_t *ks, ktap_tab_t *t,
 void kp_tab_setstr(ktap_state_t *ks, ktap_tab_t *t, const ktap_str_t *key,
 		   const ktap_val_t *val)
 {
-	ktap_val_t *v;
+	ktap_val_t *v, tmp;
 	unsigned long flags;
 
+	val = kp_str_internview(ks, val, &tmp);
+	if (unlikely(!val))
+		return;
+
 	tab_lock(t);
 	v = tab_setstr(ks, t, key);
 	if (likely(v))
@@ -532,6 +581,7 @@ void kp_tab_incrstr(ktap_state_t *ks, ktap_tab_t *t, const ktap_str_t *key,
 	tab_unlock(t);
 }
 
+/* key is interned by tab_internkey already */
 static ktap_val_t *tab_set(ktap_state_t *ks, ktap_tab_t *t,
 			   const ktap_val_t *key)
 {
@@ -544,13 +594,6 @@ static ktap_val_t *tab_set(ktap_state_t *ks, ktap_tab_t *t,
 		uint32_t k = (ktap_number)nk;
 		if (nk == (ktap_number)k)
 			return tab_setint(ks, t, k);
-	} else if (itype(key) == KTAP_TKSTACK) {
-		/* change stack into string */
-		ktap_str_t *bt = kp_obj_kstack2str(ks, key->val.stack.depth,
-						       key->val.stack.skip);
-		if (!bt)
-			return NULL;
-		return tab_setstr(ks, t, bt);
 	} else if (is_eventstr(key)) {
 		const ktap_str_t *ts;
 
@@ -582,9 +625,14 @@ static ktap_val_t *tab_set(ktap_state_t *ks, ktap_tab_t *t,
 void kp_tab_set(ktap_state_t *ks, ktap_tab_t *t,
 		const ktap_val_t *key, const ktap_val_t *val)
 {
-	ktap_val_t *v;
+	ktap_val_t *v, tmp, ktmp;
 	unsigned long flags;
 
+	val = kp_str_internview(ks, val, &tmp);
+	key = tab_internkey(ks, key, &ktmp, 1);
+	if (unlikely(!val || !key))
+		return;
+
 	tab_lock(t);
 	v = tab_set(ks, t, key);
 	if (likely(v))
@@ -595,11 +643,16 @@ void kp_tab_set(ktap_state_t *ks, ktap_tab_t *t,
 void kp_tab_incr(ktap_state_t *ks, ktap_tab_t *t, ktap_val_t *key,
 		 ktap_number n)
 {
-	ktap_val_t *v;
+	const ktap_val_t *k;
+	ktap_val_t *v, tmp;
 	unsigned long flags;
 
+	k = tab_internkey(ks, key, &tmp, 1);
+	if (unlikely(!k))
+		return;
+
 	tab_lock(t);
-	v = tab_set(ks, t, key);
+	v = tab_set(ks, t, k);
 	if (unlikely(!v))
 		goto out;
 
@@ -701,13 +754,50 @@ int kp_tab_len(ktap_state_t *ks, ktap_tab_t *t)
 	return len;
 }
 
-static void string_convert(char *output, const char *input)
+/*
+ * copy key and value of all entries into kv under table lock, so the
+ * copy is consistent while probes update table. Return number of
+ * entries, or -1 if there are more than n.
+ */
+int kp_tab_snapshot(ktap_tab_t *t, ktap_val_t *kv, int n)
 {
-	if (strlen(input) > 32) {
-		strncpy(output, input, 32-4);
-		memset(output + 32-4, '.', 3);
-	} else
-		memcpy(output, input, strlen(input));
+	unsigned long flags;
+	int i, nr = 0;
+
+	tab_lock(t);
+	for (i = 0; i < t->asize; i++) {
+		ktap_val_t *v = &t->array[i];
+
+		if (is_nil(v))
+			continue;
+
+		if (nr == n)
+			goto full;
+
+		set_number(&kv[nr * 2], i);
+		set_obj(&kv[nr * 2 + 1], v);
+		nr++;
+	}
+
+	for (i = 0; i <= t->hmask; i++) {
+		ktap_node_t *node = &t->node[i];
+
+		if (is_nil(&node->val))
+			continue;
+
+		if (nr == n)
+			goto full;
+
+		set_obj(&kv[nr * 2], &node->key);
+		set_obj(&kv[nr * 2 + 1], &node->val);
+		nr++;
+	}
+	tab_unlock(t);
+	return nr;
+
+ full:
+	tab_unlock(t);
+	return -1;
 }
 
 typedef struct ktap_node2 {
@@ -728,10 +818,14 @@ static int hist_record_cmp(const void *i, const void *j)
 		return -1;
 }
 
+static void tab_histrows(ktap_state_t *ks, const ktap_node2_t *rows,
+			 int total, int shownums, int format);
+
 /* todo: make histdump to be faster, just need to sort n entries, not all */
 
 /* print_hist: key should be number/string/ip, value must be number */
-static void tab_histdump(ktap_state_t *ks, ktap_tab_t *t, int shownums)
+static void tab_histdump(ktap_state_t *ks, ktap_tab_t *t, int shownums,
+			 int format)
 {
 	long start_time, delta_time;
 	uint32_t i, asize = t->asize;
@@ -787,6 +881,11 @@ static void tab_histdump(ktap_state_t *ks, ktap_tab_t *t, int shownums)
 	/* sort */
 	sort(sort_mem, total, sizeof(ktap_node2_t), hist_record_cmp, NULL);
 
+	if (format != KTAP_FORMAT_TEXT) {
+		tab_histrows(ks, sort_mem, total, shownums, format);
+		goto out;
+	}
+
 	dist_str[sizeof(dist_str) - 1] = '\0';
 
 	for (i = 0; i < total; i++) {
@@ -815,13 +914,14 @@ static void tab_histdump(ktap_state_t *ks, ktap_tab_t *t, int shownums)
 		} else if (is_number(key)) {
 			kp_printf(ks, "%31d |%s%-7d\n", nvalue(key),
 						dist_str, num);
+		} else if (is_stackid(key)) {
+			kp_stack_print(ks, stackidvalue(key));
+			kp_printf(ks, "%s\n%d\n\n", dist_str, num);
 		} else if (is_kip(key)) {
 			char str[KSYM_SYMBOL_LEN];
-			char buf[32] = {0};
 
-			SPRINT_SYMBOL(str, nvalue(key));
-			string_convert(buf, str);
-			kp_printf(ks, "%31s |%s%-7d\n", buf, dist_str, num);
+			kp_sprint_symbol(ks, str, nvalue(key), 0, 31);
+			kp_printf(ks, "%s |%s%-7d\n", str, dist_str, num);
 		}
 	}
 
@@ -838,6 +938,157 @@ static void tab_histdump(ktap_state_t *ks, ktap_tab_t *t, int shownums)
 #define DISTRIBUTION_STR "------------- Distribution -------------"
 void kp_tab_print_hist(ktap_state_t *ks, ktap_tab_t *t, int n)
 {
-	kp_printf(ks, "%31s%s%s\n", "value ", DISTRIBUTION_STR, " count");
-	tab_histdump(ks, t, n);
+	int format = G(ks)->parm->output_format;
+
+	if (format == KTAP_FORMAT_CSV)
+		kp_puts(ks, "key,count\n");
+	else if (format == KTAP_FORMAT_TEXT)
+		kp_printf(ks, "%31s%s%s\n", "value ", DISTRIBUTION_STR,
+			  " count");
+
+	tab_histdump(ks, t, n, format);
+}
+
+/* folded lines are batched in chunk, then written into ring buffer */
+#define FOLDED_CHUNK_SIZE	(PAGE_SIZE / 2)
+
+/* sprint key as folded frames, from root frame to leaf frame */
+static int folded_key(ktap_state_t *ks, char *buf, int size,
+		      const ktap_val_t *key)
+{
+	char str[KSYM_SYMBOL_LEN];
+	int len = 0;
+
+	if (is_stackid(key)) {
+		const kp_stack_t *st = stackidvalue(key);
+		int i;
+
+		for (i = st->nr - 1; i >= 0; i--) {
+			if (st->pid)
+				kp_sprint_usymbol(ks, str, st->pid,
+						  st->entries[i], 0);
+			else
+				kp_sprint_symbol(ks, str, st->entries[i], 0, 0);
+
+			len += scnprintf(buf + len, size - len, "%s%s",
+					 len ? ";" : "", str);
+		}
+	} else if (is_string(key)) {
+		len = scnprintf(buf, size, "%s", svalue(key));
+	} else if (is_number(key)) {
+		len = scnprintf(buf, size, "%ld", nvalue(key));
+	} else if (is_kip(key)) {
+		kp_sprint_symbol(ks, str, nvalue(key), 0, 0);
+		len = scnprintf(buf, size, "%s", str);
+	}
+
+	return len;
+}
+
+/* print_hist rows as JSON lines or CSV, see KTAP_FORMAT_JSON */
+static void tab_histrows(ktap_state_t *ks, const ktap_node2_t *rows,
+			 int total, int shownums, int format)
+{
+	char *key, *row;
+	int i, len, n, q;
+
+	key = kmalloc(FOLDED_CHUNK_SIZE * 2, GFP_KERNEL);
+	if (!key)
+		return;
+
+	row = key + FOLDED_CHUNK_SIZE;
+
+	for (i = 0; i < total; i++) {
+		const ktap_val_t *k = &rows[i].key;
+
+		if (!--shownums)
+			break;
+
+		len = folded_key(ks, key, FOLDED_CHUNK_SIZE, k);
+
+		n = 0;
+		if (format == KTAP_FORMAT_JSON)
+			n = scnprintf(row, FOLDED_CHUNK_SIZE, "{\"key\":");
+
+		/* number key is not quoted, it's a JSON number */
+		if (is_number(k)) {
+			memcpy(row + n, key, len);
+			q = len;
+		} else
+			q = kp_str_quote(row + n, FOLDED_CHUNK_SIZE - n - 32,
+					 key, len, format);
+		if (q < 0)
+			continue;
+		n += q;
+
+		if (format == KTAP_FORMAT_JSON)
+			scnprintf(row + n, FOLDED_CHUNK_SIZE - n,
+				  ",\"count\":%ld}\n", nvalue(&rows[i].val));
+		else
+			scnprintf(row + n, FOLDED_CHUNK_SIZE - n, ",%ld\n",
+				  nvalue(&rows[i].val));
+
+		kp_puts(ks, row);
+	}
+
+	kfree(key);
+}
+
+/*
+ * print_folded: one "frame1;frame2;... count" line per table entry,
+ * it's the input format of flame graph tools.
+ */
+void kp_tab_print_folded(ktap_state_t *ks, ktap_tab_t *t)
+{
+	char *chunk, *line;
+	int i, len = 0;
+
+	chunk = kmalloc(FOLDED_CHUNK_SIZE * 2, GFP_KERNEL);
+	if (!chunk)
+		return;
+
+	line = chunk + FOLDED_CHUNK_SIZE;
+
+	for (i = 0; i < t->asize + t->hmask + 1; i++) {
+		const ktap_val_t *key, *val;
+		ktap_val_t k;
+		int n;
+
+		if (i < t->asize) {
+			set_number(&k, i);
+			key = &k;
+			val = &t->array[i];
+		} else {
+			key = &t->node[i - t->asize].key;
+			val = &t->node[i - t->asize].val;
+		}
+
+		if (is_nil(val))
+			continue;
+
+		if (!is_number(val)) {
+			kp_error(ks, "print_folded only can print number\n");
+			break;
+		}
+
+		n = folded_key(ks, line, FOLDED_CHUNK_SIZE - 32, key);
+		n += scnprintf(line + n, FOLDED_CHUNK_SIZE - n, " %ld\n",
+			       nvalue(val));
+
+		if (len + n + 1 > FOLDED_CHUNK_SIZE) {
+			chunk[len] = '\0';
+			kp_transport_write(ks, chunk, len + 1);
+			len = 0;
+		}
+
+		memcpy(chunk + len, line, n);
+		len += n;
+	}
+
+	if (len) {
+		chunk[len] = '\0';
+		kp_transport_write(ks, chunk, len + 1);
+	}
+
+	kfree(chunk);
 }
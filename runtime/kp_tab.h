@@ -48,9 +48,11 @@ ktap_tab_t *kp_tab_dup(ktap_state_t *ks, const ktap_tab_t *kt);
 
 void kp_tab_free(ktap_state_t *ks, ktap_tab_t *t);
 int kp_tab_len(ktap_state_t *ks, ktap_tab_t *t);
+int kp_tab_snapshot(ktap_tab_t *t, ktap_val_t *kv, int n);
 void kp_tab_dump(ktap_state_t *ks, ktap_tab_t *t);
 void kp_tab_clear(ktap_tab_t *t);
 void kp_tab_print_hist(ktap_state_t *ks, ktap_tab_t *t, int n);
+void kp_tab_print_folded(ktap_state_t *ks, ktap_tab_t *t);
 int kp_tab_next(ktap_state_t *ks, ktap_tab_t *t, StkId key);
 int kp_tab_sort_next(ktap_state_t *ks, ktap_tab_t *t, StkId key);
 void kp_tab_sort(ktap_state_t *ks, ktap_tab_t *t, ktap_func_t *cmp_func);
@@ -24,15 +24,28 @@
 #include <asm/uaccess.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
 #include <linux/kallsyms.h>
+#include <linux/irq_work.h>
 #include "../include/ktap_types.h"
 #include "ktap.h"
 #include "kp_events.h"
+#include "kp_str.h"
 #include "kp_transport.h"
+#include "kp_symcache.h"
 
 struct ktap_trace_iterator {
 	struct ring_buffer	*buffer;
 	int			print_timestamp;
+	int			raw;	/* binary records, see raw_output */
+	int			raw_started;
+	int			unordered; /* drain cpus without merging */
+	int			drain_cpu; /* cpu being drained when unordered */
+	int			drain_count; /* entries taken from drain_cpu */
+	int			cpu_file; /* only read this cpu, -1 for all */
+	int			format;	/* events as JSON or CSV, see output_format */
+	cpumask_var_t		mid_line; /* cpus in middle of text line */
 	void			*private;
 
 	struct trace_iterator	iter;
@@ -46,6 +59,7 @@ enum ktap_trace_type {
 	TRACE_BPUTS,
 	TRACE_STACK,
 	TRACE_USER_STACK,
+	TRACE_BPRINT,	/* binary printf, see kp_str_bfmt */
 
 	__TRACE_LAST_TYPE,
 };
@@ -96,11 +110,31 @@ int _trace_seq_puts(struct trace_seq *s, const char *str)
 	return len;
 }
 
+static int _trace_seq_putmem(struct trace_seq *s, const void *mem, int len)
+{
+	if (s->full)
+		return 0;
+
+	if (len > ((PAGE_SIZE - 1) - TRACE_SEQ_LEN(s))) {
+		s->full = 1;
+		return 0;
+	}
+
+	memcpy(s->buffer + TRACE_SEQ_LEN(s), mem, len);
+	TRACE_SEQ_LEN(s) += len;
+
+	return len;
+}
+
 static int trace_empty(struct trace_iterator *iter)
 {
 	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
 	int cpu;
 
+	if (ktap_iter->cpu_file >= 0)
+		return ring_buffer_empty_cpu(ktap_iter->buffer,
+					     ktap_iter->cpu_file);
+
 	for_each_online_cpu(cpu) {
 		if (!ring_buffer_empty_cpu(ktap_iter->buffer, cpu))
 			return 0;
@@ -134,9 +168,26 @@ static int trace_print_timestamp(struct trace_iterator *iter)
 	usec_rem = do_div(t, USEC_PER_SEC);
 	secs = (unsigned long)t;
 
+	/* records are not time ordered across cpus, tag them with cpu */
+	if (KTAP_TRACE_ITER(iter)->unordered)
+		return TRACE_SEQ_PRINTF(s, "%5lu.%06lu [%03d]: ", secs,
+					usec_rem, iter->cpu);
+
 	return TRACE_SEQ_PRINTF(s, "%5lu.%06lu: ", secs, usec_rem);
 }
 
+/*
+ * time stamp goes at the start of a text line only, record which
+ * continues a line of this cpu, e.g. event in print(), is not stamped.
+ */
+static int trace_line_timestamp(struct trace_iterator *iter)
+{
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+
+	return ktap_iter->print_timestamp &&
+	       !cpumask_test_cpu(iter->cpu, ktap_iter->mid_line);
+}
+
 /* todo: export kernel function ftrace_find_event in future, and make faster */
 static struct trace_event *(*ftrace_find_event)(int type);
 
@@ -148,7 +199,18 @@ static enum print_line_t print_trace_fmt(struct trace_iterator *iter)
 
 	ev = ftrace_find_event(entry->type);
 
-	if (ktap_iter->print_timestamp && !trace_print_timestamp(iter))
+	/* structured record carries its own time stamp */
+	if (ev && ktap_iter->format != KTAP_FORMAT_TEXT) {
+		trace_event_call *call = container_of(ev, trace_event_call,
+						      event);
+
+		if (!kp_event_print_fields(&iter->seq, call, entry, iter->ts,
+					   iter->cpu, ktap_iter->format))
+			return TRACE_TYPE_PARTIAL_LINE;
+		return TRACE_TYPE_HANDLED;
+	}
+
+	if (trace_line_timestamp(iter) && !trace_print_timestamp(iter))
 		return TRACE_TYPE_PARTIAL_LINE;
 
 	if (ev) {
@@ -163,8 +225,55 @@ static enum print_line_t print_trace_fmt(struct trace_iterator *iter)
 	return TRACE_TYPE_PARTIAL_LINE;
 }
 
+/*
+ * sprint symbol of kernel address, or only a symbol token when reader
+ * resolves symbols in userspace, see KTAP_SYM_BEGIN.
+ */
+int kp_sprint_symbol(ktap_state_t *ks, char *buffer, unsigned long addr,
+		     int offset, int width)
+{
+	char str[KSYM_SYMBOL_LEN];
+	int len;
+
+	if (G(ks)->parm->user_symbolize) {
+		if (width)
+			return sprintf(buffer, "%c%c%lx,%d%c", KTAP_SYM_BEGIN,
+				       offset ? 'S' : 's', addr, width,
+				       KTAP_SYM_END);
+		return sprintf(buffer, "%c%c%lx%c", KTAP_SYM_BEGIN,
+			       offset ? 'S' : 's', addr, KTAP_SYM_END);
+	}
+
+	if (!width)
+		return kp_symcache_sprint(ks, buffer, addr, offset);
+
+	len = kp_symcache_sprint(ks, str, addr, offset);
+	if (len > width + 1) {
+		/* too long, truncate it with "..." */
+		memset(str + width - 3, '.', 3);
+		str[width] = '\0';
+	}
+
+	return sprintf(buffer, "%*s", width, str);
+}
+
+/*
+ * sprint user address of process pid, kernel cannot resolve DSO symbols,
+ * so it's only resolved by reader, otherwise print the raw address.
+ */
+int kp_sprint_usymbol(ktap_state_t *ks, char *buffer, int pid,
+		      unsigned long addr, int offset)
+{
+	if (G(ks)->parm->user_symbolize)
+		return sprintf(buffer, "%c%c%d:%lx%c", KTAP_SYM_BEGIN,
+			       offset ? 'U' : 'u', pid, addr, KTAP_SYM_END);
+
+	return sprintf(buffer, "0x%lx", addr);
+}
+
 static enum print_line_t print_trace_stack(struct trace_iterator *iter)
 {
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
 	struct trace_entry *entry = iter->ent;
 	struct stack_trace trace;
 	char str[KSYM_SYMBOL_LEN];
@@ -183,7 +292,39 @@ static enum print_line_t print_trace_stack(struct trace_iterator *iter)
 		if (p == ULONG_MAX)
 			break;
 
-		sprint_symbol(str, p);
+		kp_sprint_symbol(ktap_iter->private, str, p, 1, 0);
+		if (!TRACE_SEQ_PRINTF(&iter->seq, " => %s\n", str))
+			return TRACE_TYPE_PARTIAL_LINE;
+	}
+
+	return TRACE_TYPE_HANDLED;
+}
+
+struct ktap_ustack_entry {
+	struct trace_entry entry;
+	unsigned int tgid;
+	unsigned long caller[0];
+};
+
+static enum print_line_t print_trace_ustack(struct trace_iterator *iter)
+{
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+	struct ktap_ustack_entry *field = (struct ktap_ustack_entry *)iter->ent;
+	char str[KSYM_SYMBOL_LEN];
+	int i, nr;
+
+	nr = (iter->ent_size - sizeof(*field)) / sizeof(unsigned long);
+
+	if (!_trace_seq_puts(&iter->seq, "<user stack trace>\n"))
+		return TRACE_TYPE_PARTIAL_LINE;
+
+	for (i = 0; i < nr; i++) {
+		unsigned long p = field->caller[i];
+
+		if (p == ULONG_MAX || !p)
+			break;
+
+		kp_sprint_usymbol(ktap_iter->private, str, field->tgid, p, 1);
 		if (!TRACE_SEQ_PRINTF(&iter->seq, " => %s\n", str))
 			return TRACE_TYPE_PARTIAL_LINE;
 	}
@@ -203,17 +344,17 @@ static enum print_line_t print_trace_fn(struct trace_iterator *iter)
 	struct ktap_ftrace_entry *field = (struct ktap_ftrace_entry *)iter->ent;
 	char str[KSYM_SYMBOL_LEN];
 
-	if (ktap_iter->print_timestamp && !trace_print_timestamp(iter))
+	if (trace_line_timestamp(iter) && !trace_print_timestamp(iter))
 		return TRACE_TYPE_PARTIAL_LINE;
 
-	sprint_symbol(str, field->ip);
+	kp_sprint_symbol(ktap_iter->private, str, field->ip, 1, 0);
 	if (!_trace_seq_puts(&iter->seq, str))
 		return TRACE_TYPE_PARTIAL_LINE;
 
 	if (!_trace_seq_puts(&iter->seq, " <- "))
 		return TRACE_TYPE_PARTIAL_LINE;
 
-	sprint_symbol(str, field->parent_ip);
+	kp_sprint_symbol(ktap_iter->private, str, field->parent_ip, 1, 0);
 	if (!_trace_seq_puts(&iter->seq, str))
 		return TRACE_TYPE_PARTIAL_LINE;
 
@@ -229,6 +370,24 @@ static enum print_line_t print_trace_bputs(struct trace_iterator *iter)
 	return TRACE_TYPE_HANDLED;
 }
 
+static enum print_line_t print_trace_bprint(struct trace_iterator *iter)
+{
+	struct trace_entry *entry = iter->ent;
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+	int len = TRACE_SEQ_LEN(&iter->seq);
+
+	if (kp_str_bfmt_print(ktap_iter->private, &iter->seq, entry + 1,
+			      iter->ent_size - sizeof(*entry))) {
+		if (len)
+			return TRACE_TYPE_PARTIAL_LINE;
+
+		/* too long to fit in one page, print it truncated */
+		iter->seq.full = 0;
+	}
+
+	return TRACE_TYPE_HANDLED;
+}
+
 static enum print_line_t print_trace_line(struct trace_iterator *iter)
 {
 	struct trace_entry *entry = iter->ent;
@@ -241,18 +400,94 @@ static enum print_line_t print_trace_line(struct trace_iterator *iter)
 		return TRACE_TYPE_HANDLED;
 	}
 
+	if (entry->type == TRACE_BPRINT)
+		return print_trace_bprint(iter);
+
 	if (entry->type == TRACE_BPUTS)
 		return print_trace_bputs(iter);
 
 	if (entry->type == TRACE_STACK)
 		return print_trace_stack(iter);
 
+	if (entry->type == TRACE_USER_STACK)
+		return print_trace_ustack(iter);
+
 	if (entry->type == TRACE_FN)
 		return print_trace_fn(iter);
 
 	return print_trace_fmt(iter);
 }
 
+/*
+ * binary record for raw output, see ktap_raw_record_t. Binary printf and
+ * bputs records point to kernel memory, they are rendered into text.
+ */
+static enum print_line_t print_raw_record(struct trace_iterator *iter)
+{
+	static const char pad[8];
+	struct trace_entry *entry = iter->ent;
+	struct trace_seq *s = &iter->seq;
+	const void *data = entry + 1;
+	int len = iter->ent_size - sizeof(*entry);
+	int start = TRACE_SEQ_LEN(s);
+	enum print_line_t ret = TRACE_TYPE_HANDLED;
+	ktap_raw_record_t rec;
+
+	if (!_trace_seq_putmem(s, &rec, sizeof(rec)))
+		return TRACE_TYPE_PARTIAL_LINE;
+
+	switch (entry->type) {
+	case TRACE_PRINT:
+		rec.type = KTAP_RAW_PRINT;
+		_trace_seq_putmem(s, data, strnlen(data, len));
+		break;
+	case TRACE_BPRINT:
+		rec.type = KTAP_RAW_PRINT;
+		ret = print_trace_bprint(iter);
+		break;
+	case TRACE_BPUTS:
+		rec.type = KTAP_RAW_PRINT;
+		ret = print_trace_bputs(iter);
+		break;
+	case TRACE_STACK:
+		rec.type = KTAP_RAW_STACK;
+		_trace_seq_putmem(s, data, len);
+		break;
+	case TRACE_USER_STACK:
+		rec.type = KTAP_RAW_USER_STACK;
+		_trace_seq_putmem(s, data, len);
+		break;
+	case TRACE_FN:
+		rec.type = KTAP_RAW_FN;
+		_trace_seq_putmem(s, data, len);
+		break;
+	default:
+		rec.type = KTAP_RAW_EVENT;
+		_trace_seq_putmem(s, entry, iter->ent_size);
+		break;
+	}
+
+	_trace_seq_putmem(s, pad, ALIGN(TRACE_SEQ_LEN(s) - start, 8) -
+				  (TRACE_SEQ_LEN(s) - start));
+
+	if (ret == TRACE_TYPE_PARTIAL_LINE || s->full) {
+		TRACE_SEQ_LEN(s) = start;
+		s->full = 0;
+		if (start)
+			return TRACE_TYPE_PARTIAL_LINE;
+
+		/* cannot fit in one page, drop it */
+		return TRACE_TYPE_HANDLED;
+	}
+
+	rec.size = TRACE_SEQ_LEN(s) - start;
+	rec.cpu = iter->cpu;
+	rec.timestamp = iter->ts;
+	memcpy(s->buffer + start, &rec, sizeof(rec));
+
+	return TRACE_TYPE_HANDLED;
+}
+
 static struct trace_entry *
 peek_next_entry(struct trace_iterator *iter, int cpu, u64 *ts,
 		unsigned long *lost_events)
@@ -313,22 +548,97 @@ __find_next_entry(struct trace_iterator *iter, int *ent_cpu,
 	return next;
 }
 
+#define KTAP_DRAIN_BATCH	64
+
+/*
+ * Keep draining one cpu for a batch of entries, then move to next cpu,
+ * so finding an entry doesn't peek all cpus for the oldest timestamp,
+ * and a busy cpu cannot starve the others.
+ */
+static struct trace_entry *
+__find_next_entry_unordered(struct trace_iterator *iter, int *ent_cpu,
+			    unsigned long *missing_events, u64 *ent_ts)
+{
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+	struct trace_entry *ent;
+	int cpu = ktap_iter->drain_cpu;
+	int i;
+
+	if (ktap_iter->drain_count >= KTAP_DRAIN_BATCH) {
+		ktap_iter->drain_count = 0;
+		if (++cpu >= nr_cpu_ids)
+			cpu = 0;
+	}
+
+	for (i = 0; i < nr_cpu_ids; i++) {
+		if (cpu_online(cpu) &&
+		    !ring_buffer_empty_cpu(ktap_iter->buffer, cpu)) {
+			ent = peek_next_entry(iter, cpu, ent_ts, missing_events);
+			if (ent) {
+				if (cpu != ktap_iter->drain_cpu)
+					ktap_iter->drain_count = 0;
+				ktap_iter->drain_cpu = cpu;
+				ktap_iter->drain_count++;
+				*ent_cpu = cpu;
+				return ent;
+			}
+		}
+
+		if (++cpu >= nr_cpu_ids)
+			cpu = 0;
+	}
+
+	return NULL;
+}
+
 /* Find the next real entry, and increment the iterator to the next entry */
 static void *trace_find_next_entry_inc(struct trace_iterator *iter)
 {
-	iter->ent = __find_next_entry(iter, &iter->cpu,
-				      &iter->lost_events, &iter->ts);
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+
+	if (ktap_iter->cpu_file >= 0) {
+		iter->cpu = ktap_iter->cpu_file;
+		iter->ent = peek_next_entry(iter, iter->cpu, &iter->ts,
+					    &iter->lost_events);
+	} else if (ktap_iter->unordered)
+		iter->ent = __find_next_entry_unordered(iter, &iter->cpu,
+						&iter->lost_events, &iter->ts);
+	else
+		iter->ent = __find_next_entry(iter, &iter->cpu,
+					      &iter->lost_events, &iter->ts);
 	if (iter->ent)
 		iter->idx++;
 
 	return iter->ent ? iter : NULL;
 }
 
-static void poll_wait_pipe(void)
+/* mmap buffers have data which is not consumed by reader */
+static int mmap_pending(ktap_state_t *ks);
+
+static int trace_ready(struct trace_iterator *iter)
+{
+	ktap_state_t *ks = KTAP_TRACE_ITER(iter)->private;
+
+	return !trace_empty(iter) || mmap_pending(ks) || G(ks)->wait_user;
+}
+
+/* per-cpu wakeup state, so commit never touches other cpu's cacheline */
+struct kp_cpu_wait {
+	ktap_global_state_t *g;
+	wait_queue_head_t wait;	/* trace_pipe_cpuN reader */
+	struct irq_work work;	/* wake readers out of probe context */
+	int pending;		/* records since last wakeup on this cpu */
+};
+
+/* waitqueue of trace_pipe reader, per-cpu pipe only waits its own cpu */
+static wait_queue_head_t *trace_waitqueue(struct ktap_trace_iterator *ktap_iter)
 {
-	set_current_state(TASK_INTERRUPTIBLE);
-	/* sleep for 100 msecs, and try again. */
-	schedule_timeout(HZ / 10);
+	ktap_state_t *ks = ktap_iter->private;
+
+	if (ktap_iter->cpu_file >= 0)
+		return &per_cpu_ptr(G(ks)->cpu_wait, ktap_iter->cpu_file)->wait;
+
+	return &G(ks)->trace_wait;
 }
 
 static int tracing_wait_pipe(struct file *filp)
@@ -336,16 +646,30 @@ static int tracing_wait_pipe(struct file *filp)
 	struct trace_iterator *iter = filp->private_data;
 	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
 	ktap_state_t *ks = ktap_iter->private;
+	wait_queue_head_t *wq = trace_waitqueue(ktap_iter);
 
 	while (trace_empty(iter)) {
 
 		if ((filp->f_flags & O_NONBLOCK)) {
+			/* tell nonblocking reader that tracing is finished */
+			if (G(ks)->wait_user)
+				return -EINTR;
 			return -EAGAIN;
 		}
 
 		mutex_unlock(&iter->mutex);
 
-		poll_wait_pipe();
+		/*
+		 * woken up when records are committed, the timeout covers
+		 * wakeups lost to the unlocked waitqueue_active check and
+		 * records left below wakeup watermark.
+		 */
+		if (wait_event_interruptible_timeout(*wq,
+				!trace_empty(iter) || G(ks)->wait_user,
+				HZ / 10) < 0) {
+			mutex_lock(&iter->mutex);
+			return -ERESTARTSYS;
+		}
 
 		mutex_lock(&iter->mutex);
 
@@ -356,11 +680,66 @@ static int tracing_wait_pipe(struct file *filp)
 	return 1;
 }
 
+/* put raw output header in front of the first record */
+static void trace_raw_header(struct trace_iterator *iter)
+{
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+	ktap_raw_header_t header = {
+		.magic = KTAP_RAW_MAGIC,
+		.version = KTAP_RAW_VERSION,
+		.long_size = sizeof(long),
+	};
+
+	if (!ktap_iter->raw || ktap_iter->raw_started)
+		return;
+
+	_trace_seq_putmem(&iter->seq, &header, sizeof(header));
+	ktap_iter->raw_started = 1;
+}
+
+static enum print_line_t print_text_record(struct trace_iterator *iter)
+{
+	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
+	struct trace_entry *entry = iter->ent;
+	int start = TRACE_SEQ_LEN(&iter->seq);
+	enum print_line_t ret;
+
+	/*
+	 * printed text gets time stamp at the start of each line, one line
+	 * may take several records, records of cpus are interleaved.
+	 */
+	if (trace_line_timestamp(iter) &&
+	    ktap_iter->format == KTAP_FORMAT_TEXT &&
+	    (entry->type == TRACE_PRINT || entry->type == TRACE_BPRINT ||
+	     entry->type == TRACE_BPUTS) && !trace_print_timestamp(iter))
+		return TRACE_TYPE_PARTIAL_LINE;
+
+	ret = print_trace_line(iter);
+	if (ret != TRACE_TYPE_PARTIAL_LINE &&
+	    TRACE_SEQ_LEN(&iter->seq) > start) {
+		if (iter->seq.buffer[TRACE_SEQ_LEN(&iter->seq) - 1] == '\n')
+			cpumask_clear_cpu(iter->cpu, ktap_iter->mid_line);
+		else
+			cpumask_set_cpu(iter->cpu, ktap_iter->mid_line);
+	}
+
+	return ret;
+}
+
+static enum print_line_t print_record(struct trace_iterator *iter)
+{
+	if (KTAP_TRACE_ITER(iter)->raw)
+		return print_raw_record(iter);
+
+	return print_text_record(iter);
+}
+
 static ssize_t
 tracing_read_pipe(struct file *filp, char __user *ubuf, size_t cnt,
 		  loff_t *ppos)
 {
 	struct trace_iterator *iter = filp->private_data;
+	size_t copied = 0, page_cnt;
 	ssize_t sret;
 
 	/* return any leftover data */
@@ -385,8 +764,12 @@ waitagain:
 		goto out;
 	}
 
-	if (cnt >= PAGE_SIZE)
-		cnt = PAGE_SIZE - 1;
+	/*
+	 * Format one page at a time and keep copying until the user buffer
+	 * is full or ring buffer is drained, one read returns many records.
+	 */
+nextpage:
+	page_cnt = min_t(size_t, cnt - copied, PAGE_SIZE - 1);
 
 	/* reset all but tr, trace, and overruns */
 	memset(&iter->seq, 0,
@@ -394,11 +777,13 @@ waitagain:
 	       offsetof(struct trace_iterator, seq));
 	iter->pos = -1;
 
+	trace_raw_header(iter);
+
 	while (trace_find_next_entry_inc(iter) != NULL) {
 		enum print_line_t ret;
 		int len = TRACE_SEQ_LEN(&iter->seq);
 
-		ret = print_trace_line(iter);
+		ret = print_record(iter);
 		if (ret == TRACE_TYPE_PARTIAL_LINE) {
 			/* don't print partial lines */
 			TRACE_SEQ_LEN(&iter->seq) = len;
@@ -407,7 +792,7 @@ waitagain:
 		if (ret != TRACE_TYPE_NO_CONSUME)
 			trace_consume(iter);
 
-		if (TRACE_SEQ_LEN(&iter->seq) >= cnt)
+		if (TRACE_SEQ_LEN(&iter->seq) >= page_cnt)
 			break;
 
 		/*
@@ -420,15 +805,26 @@ waitagain:
 	}
 
 	/* Now copy what we have to the user */
-	sret = _trace_seq_to_user(&iter->seq, ubuf, cnt);
+	sret = _trace_seq_to_user(&iter->seq, ubuf + copied, page_cnt);
 	if (TRACE_SEQ_READPOS(&iter->seq) >= TRACE_SEQ_LEN(&iter->seq))
 		trace_seq_init(&iter->seq);
 
+	if (sret > 0) {
+		copied += sret;
+
+		/* leftover stays in iter->seq for next read */
+		if (copied < cnt && !TRACE_SEQ_LEN(&iter->seq) &&
+		    !trace_empty(iter))
+			goto nextpage;
+	}
+
 	/*
 	 * If there was nothing to send to user, in spite of consuming trace
 	 * entries, go back to wait for more entries.
 	 */
-	if (sret == -EBUSY)
+	if (copied)
+		sret = copied;
+	else if (sret == -EBUSY)
 		goto waitagain;
 
 out:
@@ -437,19 +833,169 @@ out:
 	return sret;
 }
 
-static int tracing_open_pipe(struct inode *inode, struct file *filp)
+/* fill iter->seq with formatted entries, at most one page */
+static size_t tracing_fill_pipe_page(size_t rem, struct trace_iterator *iter)
+{
+	size_t count;
+	int ret;
+
+	for (;;) {
+		count = TRACE_SEQ_LEN(&iter->seq);
+		ret = print_record(iter);
+		count = TRACE_SEQ_LEN(&iter->seq) - count;
+		if (rem < count) {
+			rem = 0;
+			TRACE_SEQ_LEN(&iter->seq) -= count;
+			break;
+		}
+		if (ret == TRACE_TYPE_PARTIAL_LINE) {
+			TRACE_SEQ_LEN(&iter->seq) -= count;
+			break;
+		}
+
+		if (ret != TRACE_TYPE_NO_CONSUME)
+			trace_consume(iter);
+		rem -= count;
+		if (!trace_find_next_entry_inc(iter)) {
+			rem = 0;
+			iter->ent = NULL;
+			break;
+		}
+	}
+
+	return rem;
+}
+
+static void tracing_spd_release_pipe(struct splice_pipe_desc *spd,
+				     unsigned int idx)
+{
+	__free_page(spd->pages[idx]);
+}
+
+static const struct pipe_buf_operations tracing_pipe_buf_ops = {
+	.can_merge		= 0,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	.map			= generic_pipe_buf_map,
+	.unmap			= generic_pipe_buf_unmap,
+#endif
+	.confirm		= generic_pipe_buf_confirm,
+	.release		= generic_pipe_buf_release,
+	.steal			= generic_pipe_buf_steal,
+	.get			= generic_pipe_buf_get,
+};
+
+/*
+ * Format entries straight into freshly allocated pages and hand them
+ * over to the pipe, so reader can splice them into output file without
+ * copying through userspace.
+ */
+static ssize_t
+tracing_splice_read_pipe(struct file *filp, loff_t *ppos,
+			 struct pipe_inode_info *pipe, size_t len,
+			 unsigned int flags)
+{
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct trace_iterator *iter = filp->private_data;
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages	= 0, /* This gets updated below. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+#endif
+		.flags		= flags,
+		.ops		= &tracing_pipe_buf_ops,
+		.spd_release	= tracing_spd_release_pipe,
+	};
+	ssize_t ret;
+	size_t rem;
+	unsigned int i;
+
+	mutex_lock(&iter->mutex);
+
+	ret = tracing_wait_pipe(filp);
+	if (ret <= 0)
+		goto out_err;
+
+	if (!iter->ent && !trace_find_next_entry_inc(iter)) {
+		/* tracing is finished */
+		ret = 0;
+		goto out_err;
+	}
+
+	/* Fill as many pages as possible. */
+	for (i = 0, rem = len; i < PIPE_DEF_BUFFERS && rem; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i])
+			break;
+
+		trace_seq_init(&iter->seq);
+		trace_raw_header(iter);
+		rem = tracing_fill_pipe_page(rem, iter);
+
+		memcpy(page_address(pages[i]), iter->seq.buffer,
+		       TRACE_SEQ_LEN(&iter->seq));
+		partial[i].offset = 0;
+		partial[i].len = TRACE_SEQ_LEN(&iter->seq);
+	}
+
+	trace_seq_init(&iter->seq);
+	mutex_unlock(&iter->mutex);
+
+	spd.nr_pages = i;
+	if (!i)
+		return -ENOMEM;
+
+	return splice_to_pipe(pipe, &spd);
+
+out_err:
+	mutex_unlock(&iter->mutex);
+	return ret;
+}
+
+static unsigned int tracing_poll_pipe(struct file *filp, poll_table *wait)
+{
+	struct trace_iterator *iter = filp->private_data;
+
+	poll_wait(filp, trace_waitqueue(KTAP_TRACE_ITER(iter)), wait);
+
+	if (trace_ready(iter))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/* per-cpu trace pipe, see percpu_readers */
+struct kp_cpu_pipe {
+	ktap_state_t *ks;
+	int cpu;
+	struct dentry *dentry;
+};
+
+static int __tracing_open_pipe(struct inode *inode, struct file *filp,
+			       ktap_state_t *ks, int cpu)
 {
 	struct ktap_trace_iterator *ktap_iter;
-	ktap_state_t *ks = inode->i_private;
 
 	/* create a buffer to store the information to pass to userspace */
 	ktap_iter = kzalloc(sizeof(*ktap_iter), GFP_KERNEL);
 	if (!ktap_iter)
 		return -ENOMEM;
 
+	if (!alloc_cpumask_var(&ktap_iter->mid_line, GFP_KERNEL)) {
+		kfree(ktap_iter);
+		return -ENOMEM;
+	}
+	cpumask_clear(ktap_iter->mid_line);
+
 	ktap_iter->private = ks;
 	ktap_iter->buffer = G(ks)->buffer;
 	ktap_iter->print_timestamp = G(ks)->parm->print_timestamp;
+	ktap_iter->raw = G(ks)->parm->raw_output;
+	ktap_iter->format = G(ks)->parm->output_format;
+	ktap_iter->unordered = G(ks)->parm->unordered_output;
+	ktap_iter->cpu_file = cpu;
 	mutex_init(&ktap_iter->iter.mutex);
 	filp->private_data = &ktap_iter->iter;
 
@@ -458,12 +1004,25 @@ static int tracing_open_pipe(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int tracing_open_pipe(struct inode *inode, struct file *filp)
+{
+	return __tracing_open_pipe(inode, filp, inode->i_private, -1);
+}
+
+static int tracing_open_cpu_pipe(struct inode *inode, struct file *filp)
+{
+	struct kp_cpu_pipe *pipe = inode->i_private;
+
+	return __tracing_open_pipe(inode, filp, pipe->ks, pipe->cpu);
+}
+
 static int tracing_release_pipe(struct inode *inode, struct file *file)
 {
 	struct trace_iterator *iter = file->private_data;
 	struct ktap_trace_iterator *ktap_iter = KTAP_TRACE_ITER(iter);
 
 	mutex_destroy(&iter->mutex);
+	free_cpumask_var(ktap_iter->mid_line);
 	kfree(ktap_iter);
 	return 0;
 }
@@ -471,11 +1030,162 @@ static int tracing_release_pipe(struct inode *inode, struct file *file)
 static const struct file_operations tracing_pipe_fops = {
 	.open		= tracing_open_pipe,
 	.read		= tracing_read_pipe,
-	.splice_read	= NULL,
+	.poll		= tracing_poll_pipe,
+	.splice_read	= tracing_splice_read_pipe,
 	.release	= tracing_release_pipe,
 	.llseek		= no_llseek,
 };
 
+static const struct file_operations tracing_cpu_pipe_fops = {
+	.open		= tracing_open_cpu_pipe,
+	.read		= tracing_read_pipe,
+	.poll		= tracing_poll_pipe,
+	.splice_read	= tracing_splice_read_pipe,
+	.release	= tracing_release_pipe,
+	.llseek		= no_llseek,
+};
+
+static void destroy_cpu_pipes(ktap_state_t *ks)
+{
+	struct kp_cpu_pipe *pipes = G(ks)->cpu_pipes;
+	int cpu;
+
+	if (!pipes)
+		return;
+
+	for_each_possible_cpu(cpu)
+		debugfs_remove(pipes[cpu].dentry);
+
+	kfree(pipes);
+	G(ks)->cpu_pipes = NULL;
+}
+
+/*
+ * trace_pipe_<pid>.<cpu> reads only one cpu buffer, so each cpu can be
+ * consumed by its own reader thread, without merging all cpus.
+ */
+static int create_cpu_pipes(ktap_state_t *ks, struct dentry *dir)
+{
+	struct kp_cpu_pipe *pipes;
+	char filename[32] = {0};
+	int cpu;
+
+	pipes = kcalloc(nr_cpu_ids, sizeof(*pipes), GFP_KERNEL);
+	if (!pipes)
+		return -ENOMEM;
+
+	G(ks)->cpu_pipes = pipes;
+
+	for_each_online_cpu(cpu) {
+		sprintf(filename, "trace_pipe_%d.%d",
+			(int)task_tgid_vnr(current), cpu);
+
+		pipes[cpu].ks = ks;
+		pipes[cpu].cpu = cpu;
+		pipes[cpu].dentry = debugfs_create_file(filename, 0444, dir,
+					&pipes[cpu], &tracing_cpu_pipe_fops);
+		if (!pipes[cpu].dentry) {
+			pr_err("ktapvm: cannot create %s in debugfs\n",
+				filename);
+			destroy_cpu_pipes(ks);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void transport_write(ktap_state_t *ks, int type, const void *data,
+			    size_t length);
+static int mmap_write(ktap_state_t *ks, const char *data, size_t len);
+
+static void trace_wakeup_func(struct irq_work *work)
+{
+	struct kp_cpu_wait *cw = container_of(work, struct kp_cpu_wait, work);
+
+	if (waitqueue_active(&cw->wait))
+		wake_up_all(&cw->wait);
+	if (waitqueue_active(&cw->g->trace_wait))
+		wake_up_all(&cw->g->trace_wait);
+}
+
+/*
+ * Called after a record is committed. Probe context may hold scheduler
+ * locks, so readers are woken from irq_work, not directly.
+ *
+ * Wake the reader of this cpu's trace_pipe_cpuN and the merged
+ * trace_pipe reader, watermark is counted per cpu.
+ */
+static void trace_wakeup(ktap_state_t *ks)
+{
+	struct kp_cpu_wait *cw = this_cpu_ptr(G(ks)->cpu_wait);
+	int watermark = G(ks)->parm->wakeup_watermark;
+
+	if (!waitqueue_active(&cw->wait) &&
+	    !waitqueue_active(&G(ks)->trace_wait))
+		return;
+
+	if (watermark > 1) {
+		if (++cw->pending < watermark)
+			return;
+		cw->pending = 0;
+	}
+
+	irq_work_queue(&cw->work);
+}
+
+
+/* record is dropped, account it to cpu and to current event */
+static void trace_missed(ktap_state_t *ks)
+{
+	KTAP_STATS(ks)->events_missed += 1;
+	if (ks->current_event)
+		kp_event_stats(ks->current_event->event)->missed++;
+}
+
+static void trace_commit(ktap_state_t *ks, struct ring_buffer *buffer,
+			 struct ring_buffer_event *event)
+{
+	ring_buffer_unlock_commit(buffer, event);
+	trace_wakeup(ks);
+}
+
+/* wake up readers in process context, e.g. tracing is finished */
+void kp_transport_wakeup(ktap_state_t *ks)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		wake_up_all(&per_cpu_ptr(G(ks)->cpu_wait, cpu)->wait);
+	wake_up_all(&G(ks)->trace_wait);
+}
+
+/* render stack as text for mmap buffer, pid is 0 for kernel stack */
+static void mmap_print_stack(ktap_state_t *ks, const char *title,
+			     const unsigned long *entries, int nr, int pid)
+{
+	char *p = kp_this_cpu_temp_buffer(ks);
+	int i, len;
+
+	len = sprintf(p, "%s", title);
+	for (i = 0; i < nr; i++) {
+		if (entries[i] == ULONG_MAX || !entries[i])
+			break;
+		if (len + KSYM_SYMBOL_LEN + 8 > KTAP_PERCPU_BUFFER_SIZE)
+			break;
+
+		len += sprintf(p + len, " => ");
+		if (pid)
+			len += kp_sprint_usymbol(ks, p + len, pid, entries[i], 1);
+		else
+			len += kp_sprint_symbol(ks, p + len, entries[i], 1, 0);
+		p[len++] = '\n';
+	}
+
+	p[len] = '\0';
+	transport_write(ks, TRACE_PRINT, p, len + 1);
+}
+
 /*
  * preempt disabled in ring_buffer_lock_reserve
  *
@@ -488,10 +1198,23 @@ void kp_transport_print_kstack(ktap_state_t *ks, uint16_t depth, uint16_t skip)
 	struct trace_entry *entry;
 	int size;
 
+	if (G(ks)->mmap) {
+		struct stack_trace trace;
+
+		trace.nr_entries = 0;
+		trace.skip = skip;
+		trace.max_entries = depth;
+		trace.entries = kp_this_cpu_print_buffer(ks);
+		save_stack_trace(&trace);
+		mmap_print_stack(ks, "<stack trace>\n", trace.entries,
+				 trace.nr_entries, 0);
+		return;
+	}
+
 	size = depth * sizeof(unsigned long);
 	event = ring_buffer_lock_reserve(buffer, sizeof(*entry) + size);
 	if (!event) {
-		KTAP_STATS(ks)->events_missed += 1;
+		trace_missed(ks);
 		return;
 	} else {
 		struct stack_trace trace;
@@ -506,9 +1229,60 @@ void kp_transport_print_kstack(ktap_state_t *ks, uint16_t depth, uint16_t skip)
 		trace.entries = (unsigned long *)(entry + 1);
 		save_stack_trace(&trace);
 
-		ring_buffer_unlock_commit(buffer, event);
+		trace_commit(ks, buffer, event);
+	}
+}
+
+#ifdef CONFIG_USER_STACKTRACE_SUPPORT
+/*
+ * save user stack of current task by frame pointer unwinding,
+ * similar with function ftrace_trace_userstack.
+ */
+void kp_transport_print_ustack(ktap_state_t *ks, uint16_t depth)
+{
+	struct ring_buffer *buffer = G(ks)->buffer;
+	struct ring_buffer_event *event;
+	struct ktap_ustack_entry *entry;
+	struct stack_trace trace;
+	int size;
+
+	if (G(ks)->mmap) {
+		trace.nr_entries = 0;
+		trace.skip = 0;
+		trace.max_entries = depth;
+		trace.entries = kp_this_cpu_print_buffer(ks);
+		save_stack_trace_user(&trace);
+		mmap_print_stack(ks, "<user stack trace>\n", trace.entries,
+				 trace.nr_entries, current->tgid);
+		return;
+	}
+
+	size = depth * sizeof(unsigned long);
+	event = ring_buffer_lock_reserve(buffer, sizeof(*entry) + size);
+	if (!event) {
+		trace_missed(ks);
+		return;
 	}
+
+	entry = ring_buffer_event_data(event);
+	tracing_generic_entry_update(&entry->entry, 0, 0);
+	entry->entry.type = TRACE_USER_STACK;
+	entry->tgid = current->tgid;
+	memset(entry->caller, 0, size);
+
+	trace.nr_entries = 0;
+	trace.skip = 0;
+	trace.max_entries = depth;
+	trace.entries = entry->caller;
+	save_stack_trace_user(&trace);
+
+	trace_commit(ks, buffer, event);
 }
+#else
+void kp_transport_print_ustack(ktap_state_t *ks, uint16_t depth)
+{
+}
+#endif
 
 void kp_transport_event_write(ktap_state_t *ks, struct ktap_event_data *e)
 {
@@ -518,42 +1292,231 @@ void kp_transport_event_write(ktap_state_t *ks, struct ktap_event_data *e)
 	struct trace_entry *entry;
 	int entry_size = e->data->raw->size;
 
+	/*
+	 * mmap buffer only carries text, render event in place, otherwise
+	 * one line of print() would be split into two streams.
+	 */
+	if (G(ks)->mmap) {
+		const char *str = kp_event_tostr(ks);
+		int len;
+
+		if (!str)
+			return;
+
+		/* drop '\n' at the ending, as print_trace_fmt does */
+		len = strlen(str);
+		if (len && str[len - 1] == '\n')
+			len--;
+		if (!mmap_write(ks, str, len))
+			return;
+	}
+
 	event = ring_buffer_lock_reserve(buffer, entry_size +
 					 sizeof(struct ftrace_event_call *));
 	if (!event) {
-		KTAP_STATS(ks)->events_missed += 1;
+		trace_missed(ks);
 		return;
 	} else {
 		entry = ring_buffer_event_data(event);
 
 		memcpy(entry, ev_entry, entry_size);
 
-		ring_buffer_unlock_commit(buffer, event);
+		trace_commit(ks, buffer, event);
 	}
 }
 
-void kp_transport_write(ktap_state_t *ks, const void *data, size_t length)
+/*
+ * per-cpu buffers mmaped by reader on ktap fd, see ktap_mmap_page_t.
+ * Text output is appended into them in place, reader consumes it
+ * without any syscall or copy per record.
+ */
+struct kp_mmap {
+	void *base;
+	int *busy;	/* per-cpu, writer is in progress */
+};
+
+#define MMAP_CPU_SIZE	((1 + KTAP_MMAP_PAGES) * PAGE_SIZE)
+#define MMAP_DATA_SIZE	(KTAP_MMAP_PAGES * PAGE_SIZE)
+
+int kp_transport_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct kp_mmap *m;
+	int cpu, ret;
+
+	if (file->private_data)
+		return -EBUSY;
+
+	if (vma->vm_pgoff || size != nr_cpu_ids * MMAP_CPU_SIZE)
+		return -EINVAL;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->busy = kzalloc(nr_cpu_ids * sizeof(int), GFP_KERNEL);
+	m->base = vmalloc_user(size);
+	if (!m->busy || !m->base) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ktap_mmap_page_t *hdr = m->base + cpu * MMAP_CPU_SIZE;
+
+		hdr->data_size = MMAP_DATA_SIZE;
+	}
+
+	ret = remap_vmalloc_range(vma, m->base, 0);
+	if (ret)
+		goto err;
+
+	file->private_data = m;
+	return 0;
+
+ err:
+	vfree(m->base);
+	kfree(m->busy);
+	kfree(m);
+	return ret;
+}
+
+/* the mapping holds ktap file, so it's unmapped when file is released */
+void kp_transport_mmap_free(struct file *file)
+{
+	struct kp_mmap *m = file->private_data;
+
+	if (!m)
+		return;
+
+	vfree(m->base);
+	kfree(m->busy);
+	kfree(m);
+	file->private_data = NULL;
+}
+
+/*
+ * append text into mmap buffer of current cpu, return -EBUSY if it
+ * nests in other writer on this cpu(like NMI), caller should fallback
+ * to ring buffer.
+ */
+static int mmap_write(ktap_state_t *ks, const char *data, size_t len)
+{
+	struct kp_mmap *m = G(ks)->mmap;
+	ktap_mmap_page_t *hdr;
+	unsigned long flags, head, used, off;
+	char *buf;
+	size_t n;
+	int cpu;
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	if (m->busy[cpu]) {
+		local_irq_restore(flags);
+		return -EBUSY;
+	}
+	m->busy[cpu] = 1;
+
+	hdr = m->base + cpu * MMAP_CPU_SIZE;
+	buf = (char *)hdr + PAGE_SIZE;
+
+	head = hdr->data_head;
+	used = head - hdr->data_tail;
+	/* read data_tail before overwriting data, pairs with reader */
+	smp_mb();
+
+	/* data_tail is written by reader, don't trust it */
+	if (used > MMAP_DATA_SIZE || len > MMAP_DATA_SIZE - used) {
+		hdr->lost++;
+		trace_missed(ks);
+		goto out;
+	}
+
+	off = head & (MMAP_DATA_SIZE - 1);
+	n = min_t(size_t, len, MMAP_DATA_SIZE - off);
+	memcpy(buf + off, data, n);
+	memcpy(buf, data + n, len - n);
+
+	/* make data visible before data_head */
+	smp_wmb();
+	hdr->data_head = head + len;
+	trace_wakeup(ks);
+
+ out:
+	m->busy[cpu] = 0;
+	local_irq_restore(flags);
+	return 0;
+}
+
+static int mmap_pending(ktap_state_t *ks)
+{
+	struct kp_mmap *m = G(ks)->mmap;
+	int cpu;
+
+	if (!m)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		ktap_mmap_page_t *hdr = m->base + cpu * MMAP_CPU_SIZE;
+
+		if (hdr->data_head != hdr->data_tail)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void transport_write(ktap_state_t *ks, int type, const void *data,
+			    size_t length)
 {
 	struct ring_buffer *buffer = G(ks)->buffer;
 	struct ring_buffer_event *event;
 	struct trace_entry *entry;
 	int size;
 
+	/* text record is NUL terminated, no need the NUL in mmap buffer */
+	if (type == TRACE_PRINT && G(ks)->mmap &&
+	    !mmap_write(ks, data, length - 1))
+		return;
+
 	size = sizeof(struct trace_entry) + length;
 
 	event = ring_buffer_lock_reserve(buffer, size);
 	if (!event) {
-		KTAP_STATS(ks)->events_missed += 1;
+		trace_missed(ks);
 		return;
 	} else {
 		entry = ring_buffer_event_data(event);
 
 		tracing_generic_entry_update(entry, 0, 0);
-		entry->type = TRACE_PRINT;
+		entry->type = type;
 		memcpy(entry + 1, data, length);
 
-		ring_buffer_unlock_commit(buffer, event);
+		trace_commit(ks, buffer, event);
+	}
+}
+
+void kp_transport_write(ktap_state_t *ks, const void *data, size_t length)
+{
+	transport_write(ks, TRACE_PRINT, data, length);
+}
+
+/*
+ * write binary printf record, it's formatted when reading trace_pipe,
+ * mmap buffer only carries text, so format it in place for mmap.
+ */
+void kp_transport_bprint(ktap_state_t *ks, const void *data, size_t length)
+{
+	if (G(ks)->mmap) {
+		struct trace_seq *seq = kp_this_cpu_temp_buffer(ks);
+
+		trace_seq_init(seq);
+		kp_str_bfmt_print(ks, seq, data, length);
+		if (!mmap_write(ks, seq->buffer, TRACE_SEQ_LEN(seq)))
+			return;
 	}
+
+	transport_write(ks, TRACE_BPRINT, data, length);
 }
 
 /* general print function */
@@ -583,11 +1546,14 @@ void __kp_bputs(ktap_state_t *ks, const char *str)
 	struct trace_entry *entry;
 	int size;
 
+	if (G(ks)->mmap && !mmap_write(ks, str, strlen(str)))
+		return;
+
 	size = sizeof(struct trace_entry) + sizeof(unsigned long *);
 
 	event = ring_buffer_lock_reserve(buffer, size);
 	if (!event) {
-		KTAP_STATS(ks)->events_missed += 1;
+		trace_missed(ks);
 		return;
 	} else {
 		entry = ring_buffer_event_data(event);
@@ -596,14 +1562,70 @@ void __kp_bputs(ktap_state_t *ks, const char *str)
 		entry->type = TRACE_BPUTS;
 		*(unsigned long *)(entry + 1) = (unsigned long)str;
 
-		ring_buffer_unlock_commit(buffer, event);
+		trace_commit(ks, buffer, event);
+	}
+}
+
+/*
+ * report records lost on each cpu, either dropped or overwritten.
+ * Buffer is likely full when records are lost, so the report would be
+ * lost as well, let reader drain the buffer before writing it.
+ */
+void kp_transport_report(ktap_state_t *ks)
+{
+	struct task_struct *tsk = G(ks)->task;
+	unsigned long *lost;
+	int cpu, nr = 0;
+
+	if (!G(ks)->buffer)
+		return;
+
+	lost = kcalloc(nr_cpu_ids, sizeof(*lost), GFP_KERNEL);
+	if (!lost)
+		return;
+
+	/* probes are gone, counters don't change any more */
+	for_each_possible_cpu(cpu) {
+		lost[cpu] = per_cpu_ptr(G(ks)->stats, cpu)->events_missed;
+		lost[cpu] += ring_buffer_overrun_cpu(G(ks)->buffer, cpu);
+		if (lost[cpu])
+			nr++;
+	}
+
+	if (!nr)
+		goto out;
+
+	kp_transport_wakeup(ks);
+	while (!ring_buffer_empty(G(ks)->buffer) &&
+	       get_nr_threads(tsk) > 1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		/* sleep for 100 msecs, and try again. */
+		schedule_timeout(HZ / 10);
 	}
+
+	for_each_possible_cpu(cpu) {
+		if (lost[cpu])
+			kp_printf(ks, "ktap: cpu %d lost %lu records, "
+				      "ring buffer is full\n", cpu, lost[cpu]);
+	}
+
+ out:
+	kfree(lost);
 }
 
 void kp_transport_exit(ktap_state_t *ks)
 {
+	int cpu;
+
+	destroy_cpu_pipes(ks);
+	if (G(ks)->cpu_wait) {
+		for_each_possible_cpu(cpu)
+			irq_work_sync(&per_cpu_ptr(G(ks)->cpu_wait, cpu)->work);
+		free_percpu(G(ks)->cpu_wait);
+	}
 	if (G(ks)->buffer)
 		ring_buffer_free(G(ks)->buffer);
+	free_percpu(G(ks)->stats);
 	debugfs_remove(G(ks)->trace_pipe_dentry);
 }
 
@@ -611,9 +1633,12 @@ void kp_transport_exit(ktap_state_t *ks)
 
 int kp_transport_init(ktap_state_t *ks, struct dentry *dir)
 {
+	ktap_option_t *parm = G(ks)->parm;
 	struct ring_buffer *buffer;
 	struct dentry *dentry;
 	char filename[32] = {0};
+	unsigned long size;
+	int cpu;
 
 #ifdef CONFIG_PPC64
 	ftrace_find_event = (void *)kallsyms_lookup_name(".ftrace_find_event");
@@ -625,10 +1650,32 @@ int kp_transport_init(ktap_state_t *ks, struct dentry *dir)
 		return -EINVAL;
 	}
 
-	buffer = ring_buffer_alloc(TRACE_BUF_SIZE_DEFAULT, RB_FL_OVERWRITE);
-	if (!buffer)
+	G(ks)->stats = alloc_percpu(ktap_stats_t);
+	if (!G(ks)->stats)
 		return -ENOMEM;
 
+	G(ks)->cpu_wait = alloc_percpu(struct kp_cpu_wait);
+	if (!G(ks)->cpu_wait)
+		goto out_stats;
+
+	for_each_possible_cpu(cpu) {
+		struct kp_cpu_wait *cw = per_cpu_ptr(G(ks)->cpu_wait, cpu);
+
+		cw->g = G(ks);
+		init_waitqueue_head(&cw->wait);
+		init_irq_work(&cw->work, trace_wakeup_func);
+		cw->pending = 0;
+	}
+
+	size = parm->buffer_size > 0 ? parm->buffer_size * 1024UL :
+				       TRACE_BUF_SIZE_DEFAULT;
+
+	/* without overwrite flag, reserve fails and new record is dropped */
+	buffer = ring_buffer_alloc(size, parm->drop_newest ? 0 :
+						RB_FL_OVERWRITE);
+	if (!buffer)
+		goto out_wait;
+
 	sprintf(filename, "trace_pipe_%d", (int)task_tgid_vnr(current));
 
 	dentry = debugfs_create_file(filename, 0444, dir,
@@ -636,12 +1683,29 @@ int kp_transport_init(ktap_state_t *ks, struct dentry *dir)
 	if (!dentry) {
 		pr_err("ktapvm: cannot create trace_pipe file in debugfs\n");
 		ring_buffer_free(buffer);
+		free_percpu(G(ks)->cpu_wait);
+		G(ks)->cpu_wait = NULL;
+		free_percpu(G(ks)->stats);
+		G(ks)->stats = NULL;
 		return -1;
 	}
 
 	G(ks)->buffer = buffer;
 	G(ks)->trace_pipe_dentry = dentry;
+	init_waitqueue_head(&G(ks)->trace_wait);
+
+	/* ring buffer is freed by kp_transport_exit from now on */
+	if (parm->percpu_readers && create_cpu_pipes(ks, dir))
+		return -1;
 
 	return 0;
+
+ out_wait:
+	free_percpu(G(ks)->cpu_wait);
+	G(ks)->cpu_wait = NULL;
+ out_stats:
+	free_percpu(G(ks)->stats);
+	G(ks)->stats = NULL;
+	return -ENOMEM;
 }
 
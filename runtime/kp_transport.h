@@ -2,12 +2,22 @@
 #define __KTAP_TRANSPORT_H__
 
 void kp_transport_write(ktap_state_t *ks, const void *data, size_t length);
+void kp_transport_bprint(ktap_state_t *ks, const void *data, size_t length);
 void kp_transport_event_write(ktap_state_t *ks, struct ktap_event_data *e);
 void kp_transport_print_kstack(ktap_state_t *ks, uint16_t depth, uint16_t skip);
+void kp_transport_print_ustack(ktap_state_t *ks, uint16_t depth);
 void *kp_transport_reserve(ktap_state_t *ks, size_t length);
+void kp_transport_wakeup(ktap_state_t *ks);
+void kp_transport_report(ktap_state_t *ks);
 void kp_transport_exit(ktap_state_t *ks);
 int kp_transport_init(ktap_state_t *ks, struct dentry *dir);
+int kp_transport_mmap(struct file *file, struct vm_area_struct *vma);
+void kp_transport_mmap_free(struct file *file);
 
 int _trace_seq_puts(struct trace_seq *s, const char *str);
+int kp_sprint_symbol(ktap_state_t *ks, char *buffer, unsigned long addr,
+		     int offset, int width);
+int kp_sprint_usymbol(ktap_state_t *ks, char *buffer, int pid,
+		      unsigned long addr, int offset);
 
 #endif /* __KTAP_TRANSPORT_H__ */
@@ -33,6 +33,10 @@
 #include "kp_obj.h"
 #include "kp_str.h"
 #include "kp_mempool.h"
+#include "kp_stackmap.h"
+#include "kp_symcache.h"
+#include "kp_stats.h"
+#include "kp_export.h"
 #include "kp_tab.h"
 #include "kp_transport.h"
 #include "kp_vm.h"
@@ -42,21 +46,30 @@
 #define KTAP_STACK_SIZE		120 /* enlarge this value for big stack */
 #define KTAP_STACK_SIZE_BYTES	(KTAP_STACK_SIZE * sizeof(ktap_val_t))
 
-#define KTAP_PERCPU_BUFFER_SIZE	(3 * PAGE_SIZE)
 
 static ktap_cfunction gfunc_get(ktap_state_t *ks, int idx);
 static int gfunc_getidx(ktap_global_state_t *g, ktap_cfunction cfunc);
 
-static ktap_str_t *str_concat(ktap_state_t *ks, StkId top, int start, int end)
+/*
+ * concat strings into ra, result is built in scratch buffer as string
+ * view if possible, it's interned only when it escapes from event handler.
+ */
+static int str_concat(ktap_state_t *ks, StkId top, int start, int end,
+		      StkId ra)
 {
 	int i, len = 0;
 	ktap_str_t *ts;
-	char *ptr, *buffer;
+	char *ptr, *buffer, *scratch;
 
 	for (i = start; i <= end; i++) {
+		if (is_strview(top + i)) {
+			len += strlen(strviewvalue(top + i));
+			continue;
+		}
+
 		if (!is_string(top + i)) {
 			kp_error(ks, "cannot concat non-string\n");
-			return NULL;
+			return -1;
 		}
 
 		len += rawtsvalue(top + i)->len;
@@ -64,24 +77,57 @@ static ktap_str_t *str_concat(ktap_state_t *ks, StkId top, int start, int end)
 
 	if (len >= KTAP_PERCPU_BUFFER_SIZE) {
 		kp_error(ks, "Error: too long string concatenation\n");
-		return NULL;
+		return -1;
 	}
 
 	preempt_disable_notrace();
 
-	buffer = kp_this_cpu_print_buffer(ks);
+	scratch = kp_scratch_alloc(ks, len + 1);
+	buffer = scratch ? scratch : kp_this_cpu_print_buffer(ks);
 	ptr = buffer;
 
 	for (i = start; i <= end; i++) {
-		int len = rawtsvalue(top + i)->len;
-		strncpy(ptr, svalue(top + i), len);
+		const char *s;
+		int len;
+
+		if (is_strview(top + i)) {
+			s = strviewvalue(top + i);
+			len = strlen(s);
+		} else {
+			s = svalue(top + i);
+			len = rawtsvalue(top + i)->len;
+		}
+		strncpy(ptr, s, len);
 		ptr += len;
 	}
+	*ptr = '\0';
+
+	if (scratch) {
+		set_strview(ra, scratch);
+		preempt_enable_notrace();
+		return 0;
+	}
+
 	ts = kp_str_new(ks, buffer, len);
 
 	preempt_enable_notrace();
 
-	return ts;
+	if (!ts)
+		return -1;
+
+	set_string(ra, ts);
+	return 0;
+}
+
+/* compare string or string view with interned string constant */
+static __always_inline int str_eqconst(const ktap_val_t *v,
+				       const ktap_str_t *ts)
+{
+	if (likely(is_string(v)))
+		return rawtsvalue(v) == ts;
+	if (is_strview(v))
+		return !strcmp(strviewvalue(v), getstr(ts));
+	return 0;
 }
 
 static ktap_upval_t *findupval(ktap_state_t *ks, StkId slot)
@@ -436,8 +482,7 @@ void kp_vm_call(ktap_state_t *ks, StkId func, int nresults)
 	DO_BC_ISEQS: { /* Jump if A = D */
 		int idx = ~bc_d(instr);
 
-		if (!is_string(RA) ||
-				rawtsvalue(RA) != (ktap_str_t *)kbase[idx])
+		if (!str_eqconst(RA, (ktap_str_t *)kbase[idx]))
 			pc++;
 		else
 			donextjump;
@@ -446,8 +491,7 @@ void kp_vm_call(ktap_state_t *ks, StkId func, int nresults)
 	DO_BC_ISNES: { /* Jump if A != D */
 		int idx = ~bc_d(instr);
 
-		if (is_string(RA) &&
-			rawtsvalue(RA) == (ktap_str_t *)kbase[idx])
+		if (str_eqconst(RA, (ktap_str_t *)kbase[idx]))
 			pc++;
 		else
 			donextjump;
@@ -598,12 +642,9 @@ void kp_vm_call(ktap_state_t *ks, StkId func, int nresults)
 	DO_BC_CAT: { /* A = B .. ~ .. C */
 		/* The CAT instruction concatenates all values in
 		 * variable slots B to C inclusive. */
-		ktap_str_t *ts = str_concat(ks, base, bc_b(instr),
-					    bc_c(instr));
-		if (!ts)
+		if (str_concat(ks, base, bc_b(instr), bc_c(instr), RA))
 			return;
-		
-		set_string(RA, ts);
+
 		DISPATCH();
 		}
 	DO_BC_KSTR: { /* Set A to string constant D */
@@ -632,9 +673,15 @@ void kp_vm_call(ktap_state_t *ks, StkId func, int nresults)
 	DO_BC_UGET: /* Set A to upvalue D */
 		set_obj(RA, fn->upvals[bc_d(instr)]->v);
 		DISPATCH();
-	DO_BC_USETV: /* Set upvalue A to D */
-		set_obj(fn->upvals[bc_a(instr)]->v, RD);
+	DO_BC_USETV: { /* Set upvalue A to D */
+		ktap_val_t tmp;
+		const ktap_val_t *v = kp_str_internview(ks, RD, &tmp);
+
+		if (unlikely(!v))
+			return;
+		set_obj(fn->upvals[bc_a(instr)]->v, v);
 		DISPATCH();
+		}
 	DO_BC_UINCV: { /* upvalus[A] += D */
 		ktap_val_t *v = fn->upvals[bc_a(instr)]->v;
 		if (unlikely(!is_number(RD) || !is_number(v))) {
@@ -1444,6 +1491,12 @@ static void free_preserved_data(ktap_state_t *ks)
 			free_percpu(G(ks)->percpu_temp_buffer[i]);
 	}
 
+	/* free percpu ktap scratch buffer */
+	for (i = 0; i < PERF_NR_CONTEXTS; i++) {
+		if (G(ks)->percpu_scratch_buffer[i])
+			free_percpu(G(ks)->percpu_scratch_buffer[i]);
+	}
+
 	/* free percpu ktap recursion context flag */
 	for (i = 0; i < PERF_NR_CONTEXTS; i++)
 		if (G(ks)->recursion_context[i])
@@ -1500,6 +1553,14 @@ static int init_preserved_data(ktap_state_t *ks)
 		G(ks)->percpu_temp_buffer[i] = data;
 	}
 
+	/* init percpu ktap scratch buffer */
+	for (i = 0; i < PERF_NR_CONTEXTS; i++) {
+		data = ALLOC_PERCPU(KTAP_PERCPU_BUFFER_SIZE);
+		if (!data)
+			goto fail;
+		G(ks)->percpu_scratch_buffer[i] = data;
+	}
+
 	/* init percpu ktap recursion context flag */
 	for (i = 0; i < PERF_NR_CONTEXTS; i++) {
 		data = alloc_percpu(int);
@@ -1533,6 +1594,7 @@ static void wait_user_completion(ktap_state_t *ks)
 {
 	struct task_struct *tsk = G(ks)->task;
 	G(ks)->wait_user = 1;
+	kp_transport_wakeup(ks);
 
 	while (1) {
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -1552,6 +1614,10 @@ static void sleep_loop(ktap_state_t *ks,
 		/* sleep for 100 msecs, and try again. */
 		schedule_timeout(HZ / 10);
 
+		/* grow mempool here, it cannot be grown in probe context */
+		kp_mempool_grow(ks, 0);
+		kp_stackmap_resize(ks);
+
 		if (actor(ks, arg))
 			return;
 	}
@@ -1620,6 +1686,8 @@ void kp_vm_exit(ktap_state_t *ks)
 	    !list_empty(&G(ks)->timers))
 		wait_user_interrupt(ks);
 
+	kp_stats_exit(ks);
+	kp_export_exit(ks);
 	kp_exit_timers(ks);
 	kp_events_exit(ks);
 
@@ -1627,8 +1695,10 @@ void kp_vm_exit(ktap_state_t *ks)
 #ifdef CONFIG_KTAP_FFI
 	ffi_free_symbols(ks);
 #endif
-	kp_str_freeall(ks);
-	kp_mempool_destroy(ks);
+	/* lost records report drains buffer first, stats fit in it then */
+	kp_transport_report(ks);
+	kp_stats_report(ks);
+	kp_events_free(ks);
 
 	func_closeuv(ks, 0); /* close all open upvals, let below call free it */
 	kp_obj_freeall(ks);
@@ -1641,6 +1711,15 @@ void kp_vm_exit(ktap_state_t *ks)
 
 	wait_user_completion(ks);
 
+	/*
+	 * binary printf records in ring buffer point to formats
+	 * in mempool, free mempool after reader is done.
+	 */
+	kp_str_freeall(ks);
+	kp_stackmap_exit(ks);
+	kp_symcache_exit(ks);
+	kp_mempool_destroy(ks);
+
 	/* should invoke after wait_user_completion */
 	if (G(ks)->trace_task)
 		put_task_struct(G(ks)->trace_task);
@@ -1676,6 +1755,7 @@ ktap_state_t *kp_vm_new_state(ktap_option_t *parm, struct dentry *dir)
 	g->state = KTAP_RUNNING;
 	INIT_LIST_HEAD(&(g->timers));
 	INIT_LIST_HEAD(&(g->events_head));
+	INIT_LIST_HEAD(&(g->exports));
 
 	if (kp_transport_init(ks, dir))
 		goto out;
@@ -1719,12 +1799,25 @@ ktap_state_t *kp_vm_new_state(ktap_option_t *parm, struct dentry *dir)
 		cpumask_set_cpu(cpu, g->cpumask);
 	}
 
-	if (kp_mempool_init(ks, KP_MAX_MEMPOOL_SIZE))
+	if (kp_mempool_init(ks, parm->mempool_size > 0 ?
+				parm->mempool_size : KP_DEF_MEMPOOL_SIZE))
 		goto out;
 
 	if (kp_str_resize(ks, 1024 - 1)) /* set string hashtable size */
 		goto out;
 
+	if (kp_stackmap_init(ks))
+		goto out;
+
+	if (kp_symcache_init(ks))
+		goto out;
+
+	if (kp_stats_init(ks, dir))
+		goto out;
+
+	if (kp_export_init(ks, dir))
+		goto out;
+
 	if (init_registry(ks))
 		goto out;
 	if (init_arguments(ks, parm->argc, parm->argv))
@@ -20,6 +20,7 @@ ktap_state_t *kp_vm_new_thread(ktap_state_t *mainthread, int rctx)
 
 	ks = kp_this_cpu_state(mainthread, rctx);
 	ks->top = ks->stack;
+	ks->scratch_pos = 0;
 	return ks;
 }
 
@@ -48,7 +48,9 @@
 #include "../include/ktap_types.h"
 #include "ktap.h"
 #include "kp_bcread.h"
+#include "kp_mempool.h"
 #include "kp_vm.h"
+#include "kp_transport.h"
 
 /* common helper function */
 long gettimeofday_ns(void)
@@ -96,7 +98,12 @@ static int ktap_main(struct file *file, ktap_option_t *parm)
 	if (unlikely(!ks))
 		return -ENOEXEC;
 
-	file->private_data = ks;
+	/*
+	 * reader may mmap per-cpu buffers on ktap fd before running,
+	 * they only carry text, so not used for raw output.
+	 */
+	if (!parm->raw_output)
+		G(ks)->mmap = file->private_data;
 
 	ret = load_trunk(parm, &buff);
 	if (ret) {
@@ -104,6 +111,9 @@ static int ktap_main(struct file *file, ktap_option_t *parm)
 		goto out;
 	}
 
+	/* constant strings in trunk are allocated from mempool */
+	kp_mempool_grow(ks, parm->trunk_len);
+
 	pt = kp_bcread(ks, (unsigned char *)buff, parm->trunk_len);
 
 	vfree(buff);
@@ -162,9 +172,17 @@ static long ktap_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         return 0;
 }
 
+static int ktap_release(struct inode *inode, struct file *file)
+{
+	kp_transport_mmap_free(file);
+	return 0;
+}
+
 static const struct file_operations ktap_fops = {
 	.llseek                 = no_llseek,
 	.unlocked_ioctl         = ktap_ioctl,
+	.mmap			= kp_transport_mmap,
+	.release		= ktap_release,
 };
 
 static long ktapvm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
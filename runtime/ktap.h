@@ -86,6 +86,27 @@ static inline void *kp_this_cpu_temp_buffer(ktap_state_t *ks)
 	return this_cpu_ptr(G(ks)->percpu_temp_buffer[trace_get_context_bit()]);
 }
 
+#define KTAP_PERCPU_BUFFER_SIZE	(3 * PAGE_SIZE)
+
+/*
+ * Allocate transient string from percpu scratch buffer, it's valid until
+ * current event handler returns, so it only can be used as string view.
+ * mainthread may sleep and migrate to other cpu, it cannot use it.
+ */
+static inline char *kp_scratch_alloc(ktap_state_t *ks, int size)
+{
+	char *buf;
+
+	if (ks == G(ks)->mainthread ||
+	    ks->scratch_pos + size > KTAP_PERCPU_BUFFER_SIZE)
+		return NULL;
+
+	buf = this_cpu_ptr(G(ks)->percpu_scratch_buffer[trace_get_context_bit()]);
+	buf += ks->scratch_pos;
+	ks->scratch_pos += size;
+	return buf;
+}
+
 #define kp_verbose_printf(ks, ...) \
 	if (G(ks)->parm->verbose)	\
 		kp_printf(ks, "[verbose] "__VA_ARGS__);
@@ -105,11 +126,11 @@ static inline void *kp_this_cpu_temp_buffer(ktap_state_t *ks)
 #define kp_arg_checkstring(ks, idx)				\
 	({							\
 		ktap_val_t *o = kp_arg(ks, idx);		\
-		if (unlikely(!is_string(o))) {			\
+		if (unlikely(!is_string(o) && !is_strview(o))) {	\
 			kp_error(ks, "wrong type of argument %d\n", idx); \
 			return -1;				\
 		}						\
-		svalue(o);					\
+		is_strview(o) ? strviewvalue(o) : svalue(o);	\
 	})
 
 #define kp_arg_checkfunction(ks, idx)				\
@@ -43,6 +43,7 @@
 #include "kp_transport.h"
 #include "kp_events.h"
 #include "kp_vm.h"
+#include "kp_symcache.h"
 
 static int kplib_print(ktap_state_t *ks)
 {
@@ -60,10 +61,36 @@ static int kplib_print(ktap_state_t *ks)
 	return 0;
 }
 
-/* don't engage with intern string in printf, use buffer directly */
+/*
+ * don't engage with intern string in printf, and don't format it in
+ * probe context, only record format and raw arguments in buffer.
+ */
 static int kplib_printf(ktap_state_t *ks)
+{
+	void *buf;
+	int len;
+
+	preempt_disable_notrace();
+
+	buf = kp_this_cpu_print_buffer(ks);
+	len = kp_str_bfmt(ks, buf, PAGE_SIZE);
+	if (len > 0)
+		kp_transport_bprint(ks, buf, len);
+
+	preempt_enable_notrace();
+	return 0;
+}
+
+/*
+ * format into a string, result is a transient string view in event
+ * handler, so it's interned only when stored into table or upvalue.
+ */
+static int kplib_sprintf(ktap_state_t *ks)
 {
 	struct trace_seq *seq;
+	ktap_str_t *ts = NULL;
+	char *str = NULL;
+	int len;
 
 	preempt_disable_notrace();
 
@@ -73,12 +100,26 @@ static int kplib_printf(ktap_state_t *ks)
 	if (kp_str_fmt(ks, seq))
 		goto out;
 
-	seq->buffer[TRACE_SEQ_LEN(seq)] = '\0';
-	kp_transport_write(ks, seq->buffer, TRACE_SEQ_LEN(seq) + 1);
+	len = TRACE_SEQ_LEN(seq);
+	str = kp_scratch_alloc(ks, len + 1);
+	if (str) {
+		memcpy(str, seq->buffer, len);
+		str[len] = '\0';
+		set_strview(ks->top, str);
+	} else {
+		ts = kp_str_new(ks, (const char *)seq->buffer, len);
+		if (ts)
+			set_string(ks->top, ts);
+	}
 
  out:
 	preempt_enable_notrace();
-	return 0;
+
+	if (!str && !ts)
+		return -1;
+
+	incr_top(ks);
+	return 1;
 }
 
 #define HISTOGRAM_DEFAULT_TOP_NUM	20
@@ -98,6 +139,14 @@ static int kplib_print_hist(ktap_state_t *ks)
 	return 0;
 }
 
+static int kplib_print_folded(ktap_state_t *ks)
+{
+	kp_arg_check(ks, 1, KTAP_TTAB);
+
+	kp_tab_print_folded(ks, hvalue(kp_arg(ks, 1)));
+	return 0;
+}
+
 static int kplib_pairs(ktap_state_t *ks)
 {
 	kp_arg_check(ks, 1, KTAP_TTAB);
@@ -148,6 +197,26 @@ static int kplib_stack(ktap_state_t *ks)
 }
 #endif
 
+#ifdef CONFIG_USER_STACKTRACE_SUPPORT
+static int kplib_ustack(ktap_state_t *ks)
+{
+	uint16_t depth;
+
+	depth = kp_arg_checkoptnumber(ks, 1, 10); /* default as 10 */
+	depth = min_t(uint16_t, depth, KP_MAX_STACK_DEPTH);
+
+	set_ustack(ks->top, depth);
+	incr_top(ks);
+	return 1;
+}
+#else
+static int kplib_ustack(ktap_state_t *ks)
+{
+	kp_error(ks, "ustack() is not supported in this architecture\n");
+	return -1;
+}
+#endif
+
 
 extern unsigned long long ns2usecs(cycle_t nsec);
 static int kplib_print_trace_clock(ktap_state_t *ks)
@@ -250,8 +319,10 @@ static int kplib_stringof(ktap_state_t *ks)
 	} else if (itype(v) == KTAP_TKIP) {
 		char str[KSYM_SYMBOL_LEN];
 
-		SPRINT_SYMBOL(str, nvalue(v));
+		kp_symcache_sprint(ks, str, nvalue(v), 0);
 		ts = kp_str_newz(ks, str);
+	} else if (is_strview(v)) {
+		ts = kp_str_newz(ks, strviewvalue(v));
 	}
 
 	if (unlikely(!ts))
@@ -370,13 +441,16 @@ static int kplib_exit(ktap_state_t *ks)
 static const ktap_libfunc_t base_lib_funcs[] = {
 	{"print", kplib_print},
 	{"printf", kplib_printf},
+	{"sprintf", kplib_sprintf},
 	{"print_hist", kplib_print_hist},
+	{"print_folded", kplib_print_folded},
 
 	{"pairs", kplib_pairs},
 	{"len", kplib_len},
 	{"delete", kplib_delete},
 
 	{"stack", kplib_stack},
+	{"ustack", kplib_ustack},
 	{"print_trace_clock", kplib_print_trace_clock},
 
 	{"num_cpus", kplib_num_cpus},
@@ -26,6 +26,7 @@
 #include "kp_obj.h"
 #include "kp_vm.h"
 #include "kp_tab.h"
+#include "kp_export.h"
 
 static int kplib_table_new(ktap_state_t *ks)
 {
@@ -44,8 +45,28 @@ static int kplib_table_new(ktap_state_t *ks)
 	return 1;
 }
 
+/* expose table as debugfs file while tracing, see kp_export.c */
+static int kplib_table_export(ktap_state_t *ks)
+{
+	const char *name;
+
+	kp_arg_check(ks, 1, KTAP_TTAB);
+	name = kp_arg_checkstring(ks, 2);
+
+	if (ks != G(ks)->mainthread) {
+		kp_error(ks, "table.export only can be called in mainthread\n");
+		return -1;
+	}
+
+	if (kp_export_table(ks, hvalue(kp_arg(ks, 1)), name))
+		return -1;
+
+	return 0;
+}
+
 static const ktap_libfunc_t table_lib_funcs[] = {
 	{"new",	kplib_table_new},
+	{"export", kplib_table_export},
 	{NULL}
 };
 
@@ -46,3 +46,9 @@ sys_close\(fd: \d+\)
 kp_vm_new_state: (.*)
 .*?
 
+
+=== TEST 6: timestamp only at start of line with event in print
+--- args: -T -e 'trace syscalls:sys_enter_close { print("close", argevent) }' -- ls
+--- out_like
+^\s*\d+\.\d{6}: close\tsys_close\(fd: \w+\)$
+--- err
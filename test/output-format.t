@@ -0,0 +1,59 @@
+# vi: ft= et tw=4 sw=4
+
+use lib 'test/lib';
+use Test::ktap 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: print_hist as JSON lines
+--- opts: -F json
+--- src
+var t = {}
+
+t[1] = 3
+t["a\"b"] = 1
+print_hist(t)
+
+--- out
+{"key":1,"count":3}
+{"key":"a\"b","count":1}
+--- err
+
+
+=== TEST 2: print_hist as CSV
+--- opts: -F csv
+--- src
+var t = {}
+
+t["x,y"] = 2
+t[7] = 1
+print_hist(t)
+
+--- out
+key,count
+"x,y",2
+7,1
+--- err
+
+
+=== TEST 3: unknown output format
+--- opts: -F xml
+--- src
+print_hist({})
+
+--- out
+--- err_like
+unknown output format xml
+
+
+
+=== TEST 4: columnar format is only for rendering
+--- opts: -F col
+--- src
+print_hist({})
+
+--- out
+--- err_like
+-F col only renders binary records, use it with -r
@@ -0,0 +1,57 @@
+# vi: ft= et tw=4 sw=4
+
+use lib 'test/lib';
+use Test::ktap 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: printf conversions
+--- src
+printf("%d %5d %-3d| %x %o %c\n", 1, 2, 3, 255, 8, 65)
+printf("%s %.2s %5s\n", "abc", "abc", "ab")
+printf("100%% %s%%\n", "done")
+
+--- out
+1     2 3  | ff 10 A
+abc ab    ab
+100% done%
+--- err
+
+
+=== TEST 2: printf with cached format
+--- src
+var fmt = "%d-%s\n"
+
+for (i = 1, 3) {
+	printf(fmt, i, "x")
+}
+
+--- out
+1-x
+2-x
+3-x
+--- err
+
+
+=== TEST 3: printf with missing argument
+--- src
+printf("%d %d\n", 1)
+
+--- out_like
+error: bad argument #3: \(no value\)
+--- err
+
+
+=== TEST 4: sprintf
+--- src
+var s = sprintf("%s-%d", "a", 1)
+
+print(s)
+print(s .. sprintf("%5s", "b"))
+
+--- out
+a-1
+a-1    b
+--- err
@@ -78,4 +78,122 @@ if (days[2] != "Monday") {
 --- err
 
 
+=== TEST 2: print_folded
+--- src
+var s = {}
+
+s["a;b"] = 3
+print_folded(s)
+
+--- out
+a;b 3
+--- err
+
+
+
+=== TEST 3: table.export
+--- src
+var s = {}
+
+table.export(s, "s")
+s[1] = 1
+
+--- out
+--- err
+
+
+=== TEST 4: table.export with invalid name
+--- src
+table.export({}, "a/b")
+
+--- out
+error: invalid export name "a/b"
+--- err
+
+
+=== TEST 5: cannot call table.export in trace_end context
+--- opts: -q
+--- src
+
+trace_end {
+	table.export({}, "s")
+}
+
+--- out
+error: cannot export table after tracing ends
+--- err
+
+
+
+=== TEST 6: read exported table back while tracing
+--- opts: -q
+--- src
+var s = {}
 
+table.export(s, "s")
+s["a"] = 1
+s[2] = 3
+
+var i = 0
+while (i < 2) {
+	s[stack(16, 0)] += 1
+	i = i + 1
+}
+
+tick-10s {
+	exit()
+}
+
+--- args: -- sh -c 'cat /sys/kernel/debug/ktap/tables_$PPID/s'
+--- out_like
+(?=.*^a 1$)(?=.*^2 3$)(?=.*^(?:[a-z_][^;\n]*;)*[a-z_][^;\n]* 2$)
+--- err
+
+
+=== TEST 7: identical stacks are one table entry
+--- src
+var s = {}
+
+var i = 0
+while (i < 100) {
+	s[stack(16, 0)] += 1
+	i = i + 1
+}
+
+var n = 0
+for (k, v in pairs(s)) {
+	n = n + 1
+	if (v != 100) {
+		print("failed")
+	}
+}
+print(n)
+
+--- out
+1
+--- err
+
+
+=== TEST 8: stack map grows past its initial 1024 buckets
+--- opts: -v -q
+--- src
+var s = {}
+
+trace kmem:* {
+	s[stack(-1)] += 1
+}
+
+trace_end {
+	var n = 0
+	for (k, v in pairs(s)) {
+		n = n + 1
+	}
+	if (n > 1024) {
+		print("more than 1024 stacks")
+	}
+}
+
+--- args: -- sh -c 'find / -xdev -ls > /dev/null 2>&1'
+--- out_like
+(?=.*^more than 1024 stacks$)(?=.*stack map: \d+ stacks, (?:[2-9]\d{3}|\d{5,}) buckets)
+--- err
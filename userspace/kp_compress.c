@@ -0,0 +1,182 @@
+/*
+ * kp_compress.c - compress output file in a separate thread
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/*
+ * Reader thread only queues output chunks, compressing and writing
+ * happen in compressor thread, so slow compression never stalls the
+ * draining of ring buffer. If compressor falls too far behind, queued
+ * memory is bounded by dropping new output, and dropped bytes are
+ * reported at the end. Raw output cannot lose part of stream, record
+ * framing would be broken, so reader waits for compressor instead, and
+ * ring buffer drops whole records meanwhile.
+ */
+
+#define COMPRESS_MAX_QUEUED	(256 * 1024 * 1024)
+
+struct compress_chunk {
+	struct compress_chunk *next;
+	size_t len;
+	char data[0];
+};
+
+static struct compress_chunk *chunk_head, *chunk_tail;
+static size_t queued, dropped;
+static int finished, lossless;
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compress_space = PTHREAD_COND_INITIALIZER;
+static pthread_t compressor;
+static gzFile gz_file;
+
+ssize_t kp_compress_write(int fd, const void *data, size_t len)
+{
+	struct compress_chunk *chunk;
+
+	pthread_mutex_lock(&compress_lock);
+	while (lossless && queued && queued + len > COMPRESS_MAX_QUEUED)
+		pthread_cond_wait(&compress_space, &compress_lock);
+
+	if (queued + len > COMPRESS_MAX_QUEUED) {
+		dropped += len;
+		pthread_mutex_unlock(&compress_lock);
+		return len;
+	}
+	queued += len;
+	pthread_mutex_unlock(&compress_lock);
+
+	chunk = malloc(sizeof(*chunk) + len);
+	if (!chunk) {
+		pthread_mutex_lock(&compress_lock);
+		queued -= len;
+		dropped += len;
+		pthread_mutex_unlock(&compress_lock);
+		return len;
+	}
+
+	chunk->next = NULL;
+	chunk->len = len;
+	memcpy(chunk->data, data, len);
+
+	pthread_mutex_lock(&compress_lock);
+	if (chunk_tail)
+		chunk_tail->next = chunk;
+	else
+		chunk_head = chunk;
+	chunk_tail = chunk;
+	pthread_cond_signal(&compress_cond);
+	pthread_mutex_unlock(&compress_lock);
+
+	return len;
+}
+
+static void *compress_thread(void *arg)
+{
+	struct compress_chunk *chunk, *next;
+
+	for (;;) {
+		pthread_mutex_lock(&compress_lock);
+		while (!chunk_head && !finished)
+			pthread_cond_wait(&compress_cond, &compress_lock);
+
+		/* take the whole queue, compress it without lock */
+		chunk = chunk_head;
+		chunk_head = chunk_tail = NULL;
+		pthread_mutex_unlock(&compress_lock);
+
+		if (!chunk)
+			break;
+
+		for (; chunk; chunk = next) {
+			int ret;
+
+			next = chunk->next;
+			ret = gzwrite(gz_file, chunk->data, chunk->len);
+
+			pthread_mutex_lock(&compress_lock);
+			if (ret <= 0)
+				dropped += chunk->len;
+			queued -= chunk->len;
+			pthread_cond_signal(&compress_space);
+			pthread_mutex_unlock(&compress_lock);
+			free(chunk);
+		}
+	}
+
+	return NULL;
+}
+
+/* raw is set when output is raw records, which are never dropped */
+int kp_compress_open(const char *output, int raw)
+{
+	lossless = raw;
+
+	/* fastest level, long captures are bound by compression speed */
+	gz_file = gzopen(output, "wb1");
+	if (!gz_file) {
+		fprintf(stderr, "Cannot open output file %s\n", output);
+		return -1;
+	}
+
+	if (pthread_create(&compressor, NULL, compress_thread, NULL)) {
+		fprintf(stderr, "Cannot create compressor thread\n");
+		gzclose(gz_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* flush queued output and wait for compressor thread */
+void kp_compress_close(void)
+{
+	pthread_mutex_lock(&compress_lock);
+	finished = 1;
+	pthread_cond_signal(&compress_cond);
+	pthread_mutex_unlock(&compress_lock);
+
+	pthread_join(compressor, NULL);
+	gzclose(gz_file);
+
+	if (dropped)
+		fprintf(stderr, "ktap: compressor fell behind, %lu bytes of "
+				"output dropped\n", (unsigned long)dropped);
+}
+
+/* input of -r, gzip file or plain file, which gzread reads as is */
+void *kp_compress_input_open(const char *input)
+{
+	return gzopen(input, "rb");
+}
+
+ssize_t kp_compress_input_read(void *in, void *buf, size_t len)
+{
+	return gzread(in, buf, len);
+}
+
+void kp_compress_input_close(void *in)
+{
+	gzclose(in);
+}
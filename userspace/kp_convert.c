@@ -0,0 +1,294 @@
+/*
+ * kp_convert.c - convert timestamped output into Chrome trace JSON
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/ktap_types.h"
+#include "kp_util.h"
+
+#define handle_error(str) do { perror(str); exit(-1); } while(0)
+
+/*
+ * Input is output of "ktap -T -o file", each timestamped line is
+ *     <sec>.<usec>: <text>        or
+ *     <sec>.<usec> [<cpu>]: <text>    with -U
+ * Lines printed by script as
+ *     begin <name> [<id>]
+ *     end <name> [<id>]
+ * are paired into complete ("X") events, other lines become instant
+ * events. Numeric id is used as thread id, so concurrent regions with
+ * the same name are told apart, e.g. printf("begin read %d\n", tid).
+ * Untimestamped lines, like stack trace lines, are skipped.
+ *
+ * Input is processed line by line, memory is bounded by open begin
+ * markers, when there are too many of them, begin is written as "B"
+ * event and its end as "E" event, viewer pairs them by itself.
+ *
+ * Output can be loaded by chrome://tracing and Perfetto UI.
+ */
+
+#define CONVERT_MAX_OPEN	65536
+#define CONVERT_HASH_SIZE	4096
+
+struct open_marker {
+	struct open_marker *next;
+	uint64_t ts;
+	int tid;
+	char key[0];	/* "<name> <id>" */
+};
+
+static struct open_marker *open_hash[CONVERT_HASH_SIZE];
+static int nr_open;
+static int nr_events;
+static FILE *out;
+
+static unsigned int key_hash(const char *key)
+{
+	unsigned int h = 0;
+
+	while (*key)
+		h = h * 31 + (unsigned char)*key++;
+
+	return h % CONVERT_HASH_SIZE;
+}
+
+static void put_string(const char *str, int len)
+{
+	int i;
+
+	fputc('"', out);
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void put_event(const char *name, int len, const char *ph,
+		      uint64_t ts, uint64_t dur, int tid)
+{
+	fputs(nr_events++ ? ",\n{\"name\":" : "{\"name\":", out);
+	put_string(name, len);
+	fprintf(out, ",\"ph\":\"%s\",\"ts\":%llu", ph, (unsigned long long)ts);
+	if (!strcmp(ph, "X"))
+		fprintf(out, ",\"dur\":%llu", (unsigned long long)dur);
+	else if (!strcmp(ph, "i"))
+		fputs(",\"s\":\"t\"", out);
+	fprintf(out, ",\"pid\":0,\"tid\":%d}", tid);
+}
+
+/* parse "<sec>.<usec>[ [<cpu>]]: ", return text after it, or NULL */
+static char *parse_timestamp(char *line, uint64_t *ts, int *cpu)
+{
+	unsigned long sec, usec;
+	char *p = line, *end;
+
+	while (*p == ' ')
+		p++;
+
+	sec = strtoul(p, &end, 10);
+	if (end == p || *end != '.')
+		return NULL;
+
+	p = end + 1;
+	usec = strtoul(p, &end, 10);
+	if (end - p != 6)
+		return NULL;
+
+	p = end;
+	*cpu = 0;
+	if (p[0] == ' ' && p[1] == '[') {
+		*cpu = strtoul(p + 2, &end, 10);
+		if (*end != ']')
+			return NULL;
+		p = end + 1;
+	}
+
+	if (p[0] != ':' || p[1] != ' ')
+		return NULL;
+
+	*ts = (uint64_t)sec * 1000000 + usec;
+	return p + 2;
+}
+
+/* key of marker is "<name>" or "<name> <id>", numeric id is thread id */
+static int parse_marker(char *text, char **key, int *tid)
+{
+	char *name, *end, *id, *p;
+	long n;
+
+	name = text + strspn(text, " ");
+	end = name + strcspn(name, " ");
+	if (end == name)
+		return -1;
+
+	id = end + strspn(end, " ");
+	id[strcspn(id, " ")] = '\0';
+	if (*id) {
+		n = strtol(id, &p, 10);
+		if (!*p)
+			*tid = n;
+		*end = ' ';
+		memmove(end + 1, id, strlen(id) + 1);
+	} else
+		*end = '\0';
+
+	*key = name;
+	return 0;
+}
+
+static int marker_name_len(const char *key)
+{
+	return strcspn(key, " ");
+}
+
+static void convert_begin(char *text, uint64_t ts, int tid)
+{
+	struct open_marker *m;
+	unsigned int h;
+	char *key;
+
+	if (parse_marker(text, &key, &tid))
+		return;
+
+	if (nr_open == CONVERT_MAX_OPEN) {
+		put_event(key, marker_name_len(key), "B", ts, 0, tid);
+		return;
+	}
+
+	m = malloc(sizeof(*m) + strlen(key) + 1);
+	if (!m)
+		handle_error("malloc failed");
+
+	strcpy(m->key, key);
+	m->ts = ts;
+	m->tid = tid;
+
+	/* nested begin with the same key is found first */
+	h = key_hash(key);
+	m->next = open_hash[h];
+	open_hash[h] = m;
+	nr_open++;
+}
+
+static void convert_end(char *text, uint64_t ts, int tid)
+{
+	struct open_marker **pm, *m;
+	char *key;
+
+	if (parse_marker(text, &key, &tid))
+		return;
+
+	for (pm = &open_hash[key_hash(key)]; (m = *pm); pm = &m->next) {
+		if (!strcmp(m->key, key))
+			break;
+	}
+
+	if (!m) {
+		put_event(key, marker_name_len(key), "E", ts, 0, tid);
+		return;
+	}
+
+	put_event(key, marker_name_len(key), "X", m->ts,
+		  ts > m->ts ? ts - m->ts : 0, m->tid);
+
+	*pm = m->next;
+	free(m);
+	nr_open--;
+}
+
+/* begin markers without end are left open in viewer */
+static void convert_flush_open(void)
+{
+	struct open_marker *m;
+	int i;
+
+	for (i = 0; i < CONVERT_HASH_SIZE; i++) {
+		while ((m = open_hash[i])) {
+			put_event(m->key, marker_name_len(m->key), "B", m->ts,
+				  0, m->tid);
+			open_hash[i] = m->next;
+			free(m);
+		}
+	}
+
+	nr_open = 0;
+}
+
+int kp_convert_chrome(const char *input, const char *output)
+{
+	char *line = NULL, *text;
+	size_t size = 0;
+	ssize_t len;
+	uint64_t ts;
+	int cpu;
+	FILE *in;
+
+	in = fopen(input, "r");
+	if (!in) {
+		fprintf(stderr, "Cannot open file %s\n", input);
+		return -1;
+	}
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			fprintf(stderr, "Cannot open output file %s\n", output);
+			fclose(in);
+			return -1;
+		}
+	} else
+		out = stdout;
+
+	fputs("{\"traceEvents\":[\n", out);
+
+	while ((len = getline(&line, &size, in)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		text = parse_timestamp(line, &ts, &cpu);
+		if (!text)
+			continue;
+
+		if (!strncmp(text, "begin ", 6))
+			convert_begin(text + 6, ts, cpu);
+		else if (!strncmp(text, "end ", 4))
+			convert_end(text + 4, ts, cpu);
+		else if (*text)
+			put_event(text, strlen(text), "i", ts, 0, cpu);
+	}
+
+	convert_flush_open();
+	fputs("\n]}\n", out);
+
+	free(line);
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
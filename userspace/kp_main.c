@@ -52,9 +52,28 @@ static void usage(const char *msg_fmt, ...)
 "\n"
 "Options and arguments:\n"
 "  -o file        : send script output to file, instead of stderr\n"
+#ifndef NO_LIBZ
+"  -z             : compress output file with gzip\n"
+#endif
+"  -S size        : rotate output file when it reaches size in Mbytes\n"
+"  -t seconds     : rotate output file after seconds\n"
+"  -N files       : number of rotated output files to keep(default 8)\n"
 "  -p pid         : specific tracing pid\n"
 "  -C cpu         : cpu to monitor in system-wide\n"
-"  -T             : show timestamp for event\n"
+"  -m size        : initial string mempool size in Kbytes(default 512)\n"
+"  -M             : read output through mmaped per-cpu buffers\n"
+"  -W records     : wake up reader after this many records(default 1)\n"
+"  -B size        : per-cpu ring buffer size in Kbytes(default 1408)\n"
+"  -D             : drop newest records when ring buffer is full,\n"
+"                   instead of overwriting oldest ones\n"
+"  -R             : write binary records as output, render it by -r\n"
+"  -r file        : render binary records file into text\n"
+"  -F format      : text, json or csv, for print_hist, events and -r,\n"
+"                   or col for columnar binary, only with -r\n"
+"  -J file        : convert -T text output file into Chrome trace JSON\n"
+"  -T             : show timestamp for event and printed line\n"
+"  -U             : output records per cpu, not ordered by timestamp\n"
+"  -P             : read each cpu buffer in its own thread on that cpu\n"
 "  -V             : show version\n"
 "  -v             : enable verbose mode\n"
 "  -q             : suppress start tracing message\n"
@@ -127,6 +146,16 @@ static int fork_workload(int ktap_fd)
 #define KTAPVM_PATH "/sys/kernel/debug/ktap/ktapvm"
 
 static char *output_filename;
+static int use_mmap;
+static int raw_output;
+static int compress_output;
+static int percpu_readers;
+static int output_format;
+static int rotate_size;
+static int rotate_interval;
+static int rotate_count = 8;
+static char *render_file;
+static char *convert_file;
 
 static int run_ktapvm()
 {
@@ -141,7 +170,8 @@ static int run_ktapvm()
 	if (ktap_fd < 0)
 		handle_error("ioctl ktapvm failed");
 
-	kp_create_reader(output_filename);
+	kp_create_reader(output_filename, use_mmap ? ktap_fd : -1, raw_output,
+			 compress_output, percpu_readers);
 
 	if (forks) {
 		uparm.trace_pid = fork_workload(ktap_fd);
@@ -170,6 +200,11 @@ static char oneline_src[1024];
 static int trace_pid = -1;
 static int trace_cpu = -1;
 static int print_timestamp;
+static int mempool_size;
+static int wakeup_watermark;
+static int unordered_output;
+static int buffer_size;
+static int drop_newest;
 
 #define SIMPLE_ONE_LINER_FMT	\
 	"trace %s { print(cpu(), tid(), execname(), argstr) }"
@@ -227,7 +262,12 @@ static void parse_option(int argc, char **argv)
 		next_arg = argv[i + 1];
 
 		/* These flags require arguments. */
-		if (!next_arg && (argv[i][1] == 'o' || argv[i][1] == 'e' || argv[i][1] == 'p' || argv[i][1] == 'C' || argv[i][1] == 'l'))
+		if (!next_arg && (argv[i][1] == 'o' || argv[i][1] == 'e' || argv[i][1] == 'p' || argv[i][1] == 'C' || argv[i][1] == 'l' ||
+				  argv[i][1] == 'm' || argv[i][1] == 'r' ||
+				  argv[i][1] == 'W' || argv[i][1] == 'B' ||
+				  argv[i][1] == 'S' || argv[i][1] == 't' ||
+				  argv[i][1] == 'N' || argv[i][1] == 'F' ||
+				  argv[i][1] == 'J'))
 				usage("flag -%s requires an argument\n", argv[i][1]);
 
 		switch (argv[i][1]) {
@@ -253,6 +293,81 @@ static void parse_option(int argc, char **argv)
 			trace_cpu = atoi(cpu_str);
 			i++;
 			break;
+		case 'm':
+			mempool_size = atoi(next_arg);
+			if (mempool_size <= 0)
+				usage("invalid mempool size %s\n", next_arg);
+			i++;
+			break;
+		case 'M':
+			use_mmap = 1;
+			break;
+		case 'W':
+			wakeup_watermark = atoi(next_arg);
+			if (wakeup_watermark <= 0)
+				usage("invalid wakeup watermark %s\n", next_arg);
+			i++;
+			break;
+		case 'R':
+			raw_output = 1;
+			break;
+#ifndef NO_LIBZ
+		case 'z':
+			compress_output = 1;
+			break;
+#endif
+		case 'U':
+			unordered_output = 1;
+			break;
+		case 'P':
+			percpu_readers = 1;
+			break;
+		case 'F':
+			if (!strcmp(next_arg, "json"))
+				output_format = KTAP_FORMAT_JSON;
+			else if (!strcmp(next_arg, "csv"))
+				output_format = KTAP_FORMAT_CSV;
+			else if (!strcmp(next_arg, "col"))
+				output_format = KTAP_FORMAT_COLUMNAR;
+			else if (strcmp(next_arg, "text"))
+				usage("unknown output format %s\n", next_arg);
+			i++;
+			break;
+		case 'S':
+			rotate_size = atoi(next_arg);
+			if (rotate_size <= 0)
+				usage("invalid rotate size %s\n", next_arg);
+			i++;
+			break;
+		case 't':
+			rotate_interval = atoi(next_arg);
+			if (rotate_interval <= 0)
+				usage("invalid rotate interval %s\n", next_arg);
+			i++;
+			break;
+		case 'N':
+			rotate_count = atoi(next_arg);
+			if (rotate_count <= 0)
+				usage("invalid rotate files %s\n", next_arg);
+			i++;
+			break;
+		case 'B':
+			buffer_size = atoi(next_arg);
+			if (buffer_size <= 0)
+				usage("invalid buffer size %s\n", next_arg);
+			i++;
+			break;
+		case 'D':
+			drop_newest = 1;
+			break;
+		case 'r':
+			render_file = next_arg;
+			i++;
+			break;
+		case 'J':
+			convert_file = next_arg;
+			i++;
+			break;
 		case 'T':
 			print_timestamp = 1;
 			break;
@@ -404,6 +519,33 @@ int main(int argc, char **argv)
 
 	parse_option(argc, argv);
 
+	if (convert_file)
+		return kp_convert_chrome(convert_file, output_filename);
+
+	if (render_file)
+		return kp_render_raw(render_file, output_filename,
+				     print_timestamp, output_format);
+
+	if (output_format == KTAP_FORMAT_COLUMNAR)
+		usage("-F col only renders binary records, use it with -r\n");
+
+	if (compress_output && !output_filename)
+		usage("-z requires output file by -o\n");
+
+	/* raw header and mmap buffers are consumed by one reader */
+	if (percpu_readers && (raw_output || use_mmap))
+		usage("-P cannot be used with -R or -M\n");
+
+	if (rotate_size || rotate_interval) {
+		if (!output_filename)
+			usage("rotation requires output file by -o\n");
+		/* rotated file must be complete on its own */
+		if (compress_output || raw_output)
+			usage("rotation cannot be used with -z or -R\n");
+		kp_reader_rotate(rotate_size * 1024UL * 1024, rotate_interval,
+				 rotate_count);
+	}
+
 	if (oneline_src[0] != '\0')
 		script_file = "(command line)";
 
@@ -452,6 +594,15 @@ int main(int argc, char **argv)
 	uparm.print_timestamp = print_timestamp;
 	uparm.quiet = quiet;
 	uparm.dry_run = dry_run;
+	uparm.mempool_size = mempool_size;
+	uparm.wakeup_watermark = wakeup_watermark;
+	uparm.unordered_output = unordered_output;
+	uparm.percpu_readers = percpu_readers;
+	uparm.output_format = output_format;
+	uparm.buffer_size = buffer_size;
+	uparm.drop_newest = drop_newest;
+	uparm.user_symbolize = 1; /* symbols resolved by reader */
+	uparm.raw_output = raw_output;
 
 	/* start running into kernel ktapvm */
 	ret = run_ktapvm();
@@ -17,19 +17,29 @@
  * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
 #include <sys/signal.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
 #include <pthread.h>
+#include "../include/ktap_types.h"
+#include "kp_util.h"
+#include "kp_symbol.h"
 
 #define MAX_BUFLEN  131072
+#ifndef PATH_MAX
 #define PATH_MAX 128
+#endif
+#define MAX_SYMTOKEN 64
 
 #define handle_error(str) do { perror(str); exit(-1); } while(0)
 
@@ -48,16 +58,586 @@ static void block_sigint()
 	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 }
 
+/* per thread, cpu readers resolve and flush output on their own */
+static __thread char out_buf[MAX_BUFLEN];
+static __thread int out_len;
+
+/* where output ends up, write(2), compressor or rotating files */
+static ssize_t (*output_sink)(int fd, const void *data, size_t len) = write;
+
+/*
+ * Output file rotation: when current file reaches rotate_size bytes or
+ * is older than rotate_interval seconds, file.N-2 .. file.1 and file
+ * are renamed one step older and a new file is opened. Only renames
+ * and open happen in read loop, the oldest file is dropped by rename.
+ */
+static const char *rotate_path;
+static unsigned long rotate_size;
+static int rotate_interval;
+static int rotate_count;
+static int rotate_fd = -1;
+static unsigned long rotate_written;
+static int rotate_eol = 1;	/* last byte written is newline */
+static time_t rotate_start;
+static pthread_mutex_t rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int rotate_open(void)
+{
+	rotate_fd = open(rotate_path, O_CREAT | O_WRONLY | O_TRUNC,
+				      S_IRUSR|S_IWUSR);
+	if (rotate_fd < 0) {
+		fprintf(stderr, "Cannot open output file %s\n", rotate_path);
+		return -1;
+	}
+
+	rotate_written = 0;
+	rotate_eol = 1;
+	rotate_start = time(NULL);
+	return 0;
+}
+
+static void rotate_files(void)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+
+	close(rotate_fd);
+
+	for (i = rotate_count - 2; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", rotate_path, i);
+		snprintf(to, sizeof(to), "%s.%d", rotate_path, i + 1);
+		rename(from, to);
+	}
+
+	if (rotate_count > 1) {
+		snprintf(to, sizeof(to), "%s.1", rotate_path);
+		rename(rotate_path, to);
+	}
+
+	rotate_open();
+}
+
+static int rotate_due(size_t len)
+{
+	if (!rotate_written)
+		return 0;
+
+	if (rotate_size && rotate_written + len > rotate_size)
+		return 1;
+
+	if (rotate_interval && time(NULL) - rotate_start >= rotate_interval)
+		return 1;
+
+	return 0;
+}
+
+static ssize_t __rotate_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t total = len, n;
+
+	if (rotate_fd < 0)
+		return -1;
+
+	if (rotate_due(len)) {
+		/* finish current line in old file, keep lines whole */
+		if (!rotate_eol) {
+			const char *nl = memchr(p, '\n', len);
+
+			n = nl ? nl - p + 1 : len;
+			write(rotate_fd, p, n);
+			rotate_written += n;
+			rotate_eol = nl != NULL;
+			p += n;
+			len -= n;
+		}
+
+		/* line goes on in next chunk, rotate after it ends */
+		if (rotate_eol) {
+			rotate_files();
+			if (rotate_fd < 0)
+				return -1;
+		}
+	}
+
+	if (len) {
+		write(rotate_fd, p, len);
+		rotate_written += len;
+		rotate_eol = p[len - 1] == '\n';
+	}
+
+	return total;
+}
+
+static ssize_t rotate_write(int fd, const void *data, size_t len)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&rotate_lock);
+	ret = __rotate_write(fd, data, len);
+	pthread_mutex_unlock(&rotate_lock);
+
+	return ret;
+}
+
+void kp_reader_rotate(unsigned long size, int interval, int count)
+{
+	rotate_size = size;
+	rotate_interval = interval;
+	rotate_count = count;
+}
+
+static void output_flush(int fd)
+{
+	if (out_len)
+		output_sink(fd, out_buf, out_len);
+	out_len = 0;
+}
+
+/*
+ * flush complete lines of a full out_buf, cpu readers share output fd,
+ * so a line must not be split by other reader's output. Only a line
+ * longer than out_buf is flushed in pieces.
+ */
+static void output_flush_lines(int fd)
+{
+	char *end = memrchr(out_buf, '\n', out_len);
+	int n;
+
+	if (!end) {
+		output_flush(fd);
+		return;
+	}
+
+	n = end - out_buf + 1;
+	output_sink(fd, out_buf, n);
+	out_len -= n;
+	memmove(out_buf, out_buf + n, out_len);
+}
+
+static void output_write(int fd, const char *data, int len)
+{
+	while (out_len + len > sizeof(out_buf)) {
+		int n = sizeof(out_buf) - out_len;
+
+		memcpy(out_buf + out_len, data, n);
+		out_len += n;
+		data += n;
+		len -= n;
+		output_flush_lines(fd);
+	}
+
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+/* symbol caches are shared by cpu readers */
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* resolve one kernel symbol token into str, see KTAP_SYM_BEGIN */
+static int symbol_sprint(char *str, int size, const char *tok)
+{
+	char sym[256];
+	unsigned long addr;
+	int width = 0, len;
+	char *end;
+
+	if (tok[0] == 'u' || tok[0] == 'U') {
+		/* user address, "u<pid>:<address>" */
+		end = strchr(tok, ':');
+		addr = end ? strtoul(end + 1, NULL, 16) : 0;
+#ifndef NO_LIBELF
+		pthread_mutex_lock(&symbol_lock);
+		len = usym_sprint(str, size, atoi(tok + 1), addr,
+				  tok[0] == 'U');
+		pthread_mutex_unlock(&symbol_lock);
+#else
+		len = snprintf(str, size, "0x%lx", addr);
+#endif
+		return len >= size ? size - 1 : len;
+	}
+
+	addr = strtoul(tok + 1, &end, 16);
+	if (*end == ',')
+		width = atoi(end + 1);
+	if (width >= size)
+		width = size - 1;
+
+	pthread_mutex_lock(&symbol_lock);
+	len = kallsyms_sprint(sym, sizeof(sym), addr, tok[0] == 'S');
+	pthread_mutex_unlock(&symbol_lock);
+	if (len >= sizeof(sym))
+		len = sizeof(sym) - 1;
+
+	if (!width) {
+		if (len >= size)
+			len = size - 1;
+		memcpy(str, sym, len);
+		return len;
+	}
+
+	if (len > width + 1) {
+		/* too long, truncate it with "..." */
+		memset(sym + width - 3, '.', 3);
+		sym[width] = '\0';
+	}
+
+	len = snprintf(str, size, "%*s", width, sym);
+	return len >= size ? size - 1 : len;
+}
+
+static void output_symbol(int fd, const char *tok)
+{
+	char str[256];
+
+	output_write(fd, str, symbol_sprint(str, sizeof(str), tok));
+}
+
+/*
+ * write buf to output with kernel symbol tokens resolved, a token
+ * split by read boundary is moved to start of buf, return its length.
+ */
+static int output_resolve(int fd, char *buf, int len)
+{
+	char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		char *tok = memchr(p, KTAP_SYM_BEGIN, end - p);
+		char *tok_end;
+
+		if (!tok) {
+			output_write(fd, p, end - p);
+			break;
+		}
+
+		output_write(fd, p, tok - p);
+
+		tok_end = memchr(tok, KTAP_SYM_END, end - tok);
+		if (!tok_end) {
+			if (end - tok < MAX_SYMTOKEN) {
+				len = end - tok;
+				memmove(buf, tok, len);
+				return len;
+			}
+
+			/* not a symbol token */
+			output_write(fd, tok, 1);
+			p = tok + 1;
+			continue;
+		}
+
+		*tok_end = '\0';
+		output_symbol(fd, tok + 1);
+		p = tok_end + 1;
+	}
+
+	return 0;
+}
+
+/* per-cpu buffers mmaped on ktap fd, see ktap_mmap_page_t */
+static char *mmap_base;
+static int mmap_nr_cpus;
+static long mmap_page_size;
+static char mmap_buf[MAX_BUFLEN];
+
+#define MMAP_CPU_SIZE	((1 + KTAP_MMAP_PAGES) * mmap_page_size)
+
+/* return position after the last '\n' between tail and head */
+static unsigned long mmap_line_end(const char *data, unsigned long size,
+				   unsigned long tail, unsigned long head)
+{
+	for (; head != tail; head--) {
+		if (data[(head - 1) & (size - 1)] == '\n')
+			break;
+	}
+
+	return head;
+}
+
+/*
+ * consume complete lines in mmap buffers, line being written on a cpu
+ * is left there, so lines of cpus never interleave, unless all is set
+ * or the line fills whole buffer. Data without symbol token is written
+ * out directly from mmap buffer, return consumed bytes.
+ */
+static int output_mmap(int fd, int all)
+{
+	int cpu, total = 0;
+
+	for (cpu = 0; cpu < mmap_nr_cpus; cpu++) {
+		ktap_mmap_page_t *hdr;
+		unsigned long head, tail;
+		char *data;
+		int left = 0;
+
+		hdr = (ktap_mmap_page_t *)(mmap_base + cpu * MMAP_CPU_SIZE);
+		data = (char *)hdr + mmap_page_size;
+		head = hdr->data_head;
+		tail = hdr->data_tail;
+		/* read data after data_head, pairs with kernel writer */
+		__sync_synchronize();
+
+		if (!all && head - tail < hdr->data_size)
+			head = mmap_line_end(data, hdr->data_size, tail, head);
+
+		while (tail != head) {
+			unsigned long off = tail & (hdr->data_size - 1);
+			unsigned long n = head - tail;
+
+			if (n > hdr->data_size - off)
+				n = hdr->data_size - off;
+
+			if (!left && !memchr(data + off, KTAP_SYM_BEGIN, n)) {
+				output_flush(fd);
+				output_sink(fd, data + off, n);
+			} else {
+				if (n > sizeof(mmap_buf) - left)
+					n = sizeof(mmap_buf) - left;
+				memcpy(mmap_buf + left, data + off, n);
+				left = output_resolve(fd, mmap_buf, left + n);
+			}
+
+			tail += n;
+			total += n;
+		}
+
+		if (left)
+			output_write(fd, mmap_buf, left);
+
+		/* consume data before releasing it to kernel */
+		__sync_synchronize();
+		hdr->data_tail = tail;
+	}
+
+	output_flush(fd);
+	return total;
+}
+
+static void report_mmap_lost(void)
+{
+	unsigned int lost = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < mmap_nr_cpus; cpu++) {
+		ktap_mmap_page_t *hdr;
+
+		hdr = (ktap_mmap_page_t *)(mmap_base + cpu * MMAP_CPU_SIZE);
+		lost += hdr->lost;
+	}
+
+	if (lost)
+		fprintf(stderr, "ktap: %u records lost in mmap buffers\n",
+			lost);
+}
+
+/* kernel allocates mmap buffers for all possible cpus */
+static int possible_cpus(void)
+{
+	char line[256], *p;
+	FILE *file;
+
+	file = fopen("/sys/devices/system/cpu/possible", "r");
+	if (!file)
+		return -1;
+
+	if (!fgets(line, sizeof(line), file)) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	/* like "0-7" or "0,2-3", the last number is max cpu id */
+	p = line + strcspn(line, "\n");
+	while (p > line && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+
+	return atoi(p) + 1;
+}
+
+static int setup_mmap(int ktap_fd)
+{
+	void *base;
+	int nr;
+
+	nr = possible_cpus();
+	if (nr <= 0)
+		return -1;
+
+	mmap_page_size = sysconf(_SC_PAGESIZE);
+	base = mmap(NULL, nr * MMAP_CPU_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, ktap_fd, 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	mmap_base = base;
+	mmap_nr_cpus = nr;
+	return 0;
+}
+
+/* stream binary records to output as is, see raw_output */
+static int raw_output;
+static int compress_output;
+
+/* copy what's left in pipe into output, after splice into it failed */
+static void pipe_drain(int pipefd, int out_fd, ssize_t len)
+{
+	char buf[MAX_BUFLEN];
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(pipefd, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (n <= 0)
+			break;
+
+		output_sink(out_fd, buf, n);
+		len -= n;
+	}
+}
+
+/*
+ * Move raw output from trace_pipe into output file through a pipe,
+ * pages are never copied into userspace.
+ * Return 0 at end of trace_pipe, or -1 if splice cannot go on, caller
+ * falls back to read trace_pipe then, nothing spliced is lost.
+ */
+static int splice_output(int fd, int out_fd)
+{
+	int pipefd[2];
+	ssize_t len, n;
+
+	if (pipe(pipefd) < 0)
+		return -1;
+
+	for (;;) {
+		len = splice(fd, NULL, pipefd[1], NULL, MAX_BUFLEN,
+			     SPLICE_F_MOVE);
+		if (len <= 0)
+			break;
+
+		while (len > 0) {
+			n = splice(pipefd[0], NULL, out_fd, NULL, len,
+				   SPLICE_F_MOVE);
+			if (n <= 0) {
+				/* records are out of trace_pipe already */
+				pipe_drain(pipefd[0], out_fd, len);
+				len = -1;
+				goto out;
+			}
+			len -= n;
+		}
+	}
+
+ out:
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return len ? -1 : 0;
+}
+
+/* one reader thread per cpu buffer, see percpu_readers */
+static int percpu_readers;
+
+struct cpu_reader {
+	pthread_t thread;
+	int cpu;
+	int fd;
+	int out_fd;
+};
+
+static void *cpu_reader_thread(void *data)
+{
+	struct cpu_reader *r = data;
+	char buf[MAX_BUFLEN];
+	cpu_set_t set;
+	int len, left = 0;
+
+	/* consume on the producing cpu, its buffer pages stay cache hot */
+	CPU_ZERO(&set);
+	CPU_SET(r->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	while ((len = read(r->fd, buf + left, sizeof(buf) - left)) > 0) {
+		left = output_resolve(r->out_fd, buf, left + len);
+		output_flush(r->out_fd);
+	}
+
+	if (left)
+		output_sink(r->out_fd, buf, left);
+
+	close(r->fd);
+	return NULL;
+}
+
+/* read trace_pipe_<pid>.<cpu> files in parallel, all into out_fd */
+static void read_cpu_pipes(int out_fd)
+{
+	struct cpu_reader *readers;
+	char filename[PATH_MAX];
+	int nr_cpus, cpu;
+
+	nr_cpus = possible_cpus();
+	if (nr_cpus <= 0) {
+		fprintf(stderr, "Cannot get possible cpus\n");
+		return;
+	}
+
+	readers = calloc(nr_cpus, sizeof(*readers));
+	if (!readers)
+		handle_error("calloc failed");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		struct cpu_reader *r = &readers[cpu];
+
+		sprintf(filename, "/sys/kernel/debug/ktap/trace_pipe_%d.%d",
+			getpid(), cpu);
+
+		/* no file for offline cpu */
+		r->fd = open(filename, O_RDONLY);
+		if (r->fd < 0)
+			continue;
+
+		r->cpu = cpu;
+		r->out_fd = out_fd;
+		if (pthread_create(&r->thread, NULL, cpu_reader_thread, r)) {
+			fprintf(stderr, "Cannot create reader for cpu %d\n",
+				cpu);
+			close(r->fd);
+			r->fd = -1;
+		}
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (readers[cpu].fd >= 0)
+			pthread_join(readers[cpu].thread, NULL);
+	}
+
+	free(readers);
+}
+
 static void *reader_thread(void *data)
 {
 	char buf[MAX_BUFLEN];
 	char filename[PATH_MAX];
 	const char *output = data; 
-	int failed = 0, fd, out_fd, len;
+	int failed = 0, fd, out_fd, len, left = 0;
 
 	block_sigint();
 
-	if (output) {
+#ifndef NO_LIBZ
+	if (output && compress_output) {
+		if (kp_compress_open(output, raw_output))
+			return NULL;
+		output_sink = kp_compress_write;
+		out_fd = -1;
+	} else
+#endif
+	if (output && (rotate_size || rotate_interval)) {
+		rotate_path = output;
+		if (rotate_open())
+			return NULL;
+		output_sink = rotate_write;
+		out_fd = -1;
+	} else if (output) {
 		out_fd = open(output, O_CREAT | O_WRONLY | O_TRUNC,
 					S_IRUSR|S_IWUSR);
 		if (out_fd < 0) {
@@ -70,7 +650,8 @@ static void *reader_thread(void *data)
 	sprintf(filename, "/sys/kernel/debug/ktap/trace_pipe_%d", getpid());
 
  open_again:
-	fd = open(filename, O_RDONLY);
+	/* don't block in trace_pipe, mmap buffers need to be drained */
+	fd = open(filename, mmap_base ? O_RDONLY | O_NONBLOCK : O_RDONLY);
 	if (fd < 0) {
 		usleep(10000);
 
@@ -81,19 +662,71 @@ static void *reader_thread(void *data)
 		goto open_again;
 	}
 
-	while ((len = read(fd, buf, sizeof(buf))) > 0)
-		write(out_fd, buf, len);
+	/* trace_pipe exists, so do cpu files, it's not read then */
+	if (percpu_readers) {
+		read_cpu_pipes(out_fd);
+		goto out;
+	}
+
+	/* raw records need no rendering, splice them into output file */
+	if (raw_output && out_fd > 1 && !splice_output(fd, out_fd))
+		goto out;
+
+	for (;;) {
+		int n = mmap_base ? output_mmap(out_fd, 0) : 0;
+
+		len = read(fd, buf + left, sizeof(buf) - left);
+		if (len > 0 && raw_output) {
+			output_sink(out_fd, buf, len);
+		} else if (len > 0) {
+			left = output_resolve(out_fd, buf, left + len);
+			output_flush(out_fd);
+		} else if (len < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+			/* trace_pipe is readable when any buffer has data */
+			if (!n)
+				poll(&pfd, 1, 100);
+		} else
+			break;
+	}
+
+	if (left)
+		output_sink(out_fd, buf, left);
 
+	if (mmap_base) {
+		/* drain output written before tracing finished */
+		output_mmap(out_fd, 1);
+		report_mmap_lost();
+	}
+
+ out:
 	close(fd);
-	close(out_fd);
+	if (out_fd >= 0)
+		close(out_fd);
+	if (rotate_fd >= 0)
+		close(rotate_fd);
+#ifndef NO_LIBZ
+	if (compress_output)
+		kp_compress_close();
+#endif
 
 	return NULL;
 }
 
-int kp_create_reader(const char *output)
+int kp_create_reader(const char *output, int mmap_fd, int raw, int compress,
+		     int percpu)
 {
 	pthread_t reader;
 
+	raw_output = raw;
+	compress_output = compress;
+	percpu_readers = percpu;
+
+	if (mmap_fd >= 0 && setup_mmap(mmap_fd))
+		fprintf(stderr, "ktap: cannot mmap output buffers, "
+				"use trace_pipe instead\n");
+
 	signal(SIGINT, sigfunc);
 
 	if (pthread_create(&reader, NULL, reader_thread, (void *)output) < 0)
@@ -102,3 +735,1006 @@ int kp_create_reader(const char *output)
 	return 0;
 }
 
+#define EVENTS_PATH "/sys/kernel/debug/tracing/events"
+
+enum {
+	FIELD_NUM,
+	FIELD_STR,	/* char array */
+	FIELD_DATA_LOC,	/* __data_loc, offset and length of dynamic data */
+	FIELD_OTHER,
+};
+
+/* one "field:" line of event format file */
+struct event_field {
+	char *name;
+	int kind;
+	int offset;
+	int size;
+	int is_signed;
+};
+
+struct event_format {
+	char *name;	/* "system:event" */
+	struct event_field *fields;
+	int nr_fields;
+};
+
+static struct event_format **event_formats;
+static int event_formats_nr;
+
+/* rendered event and stack records, see KTAP_FORMAT_JSON */
+static int render_format;
+
+/* parse "field:<declaration>;	offset:<n>;	size:<n>;	signed:<n>;" */
+static int parse_event_field(const char *line, struct event_field *field)
+{
+	const char *decl, *end, *name, *p;
+
+	decl = strstr(line, "field:");
+	if (!decl)
+		return -1;
+
+	decl += 6;
+	end = strchr(decl, ';');
+	if (!end)
+		return -1;
+
+	/* name is the last word of declaration, without array size */
+	p = end;
+	if (p[-1] == ']') {
+		while (p > decl && *p != '[')
+			p--;
+	}
+	name = p;
+	while (name > decl && name[-1] != ' ' && name[-1] != '*')
+		name--;
+
+	if (!strncmp(decl, "__data_loc", 10))
+		field->kind = FIELD_DATA_LOC;
+	else if (memchr(decl, '[', end - decl))
+		field->kind = strncmp(decl, "char", 4) ? FIELD_OTHER : FIELD_STR;
+	else
+		field->kind = FIELD_NUM;
+
+	p = strstr(end, "offset:");
+	field->offset = p ? atoi(p + 7) : 0;
+	p = strstr(end, "size:");
+	field->size = p ? atoi(p + 5) : 0;
+	p = strstr(end, "signed:");
+	field->is_signed = p ? atoi(p + 7) : 0;
+
+	field->name = strndup(name, strcspn(name, "[;"));
+	return 0;
+}
+
+static void load_event_format(const char *path, const char *name)
+{
+	struct event_format *format;
+	struct event_field field;
+	char line[1024];
+	FILE *file;
+	int id = -1;
+
+	file = fopen(path, "r");
+	if (!file)
+		return;
+
+	format = calloc(1, sizeof(*format));
+	if (!format)
+		goto out;
+
+	while (fgets(line, sizeof(line), file)) {
+		struct event_field *fields;
+
+		if (sscanf(line, "ID: %d", &id) == 1)
+			continue;
+
+		if (parse_event_field(line, &field))
+			continue;
+
+		fields = realloc(format->fields,
+				 (format->nr_fields + 1) * sizeof(field));
+		if (!fields)
+			break;
+
+		format->fields = fields;
+		format->fields[format->nr_fields++] = field;
+	}
+
+	if (id > 0 && id < event_formats_nr && !event_formats[id]) {
+		format->name = strdup(name);
+		event_formats[id] = format;
+	} else {
+		free(format->fields);
+		free(format);
+	}
+
+ out:
+	fclose(file);
+}
+
+/* build event id to format map from tracing events directory */
+static void load_event_formats(void)
+{
+	struct dirent *sys, *ev;
+	DIR *sys_dir, *ev_dir;
+	char path[1024], name[512];
+
+	event_formats_nr = 65536;
+	event_formats = calloc(event_formats_nr, sizeof(*event_formats));
+	if (!event_formats)
+		return;
+
+	sys_dir = opendir(EVENTS_PATH);
+	if (!sys_dir)
+		return;
+
+	while ((sys = readdir(sys_dir))) {
+		if (sys->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), EVENTS_PATH "/%s", sys->d_name);
+		ev_dir = opendir(path);
+		if (!ev_dir)
+			continue;
+
+		while ((ev = readdir(ev_dir))) {
+			if (ev->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), EVENTS_PATH "/%s/%s/format",
+				 sys->d_name, ev->d_name);
+			snprintf(name, sizeof(name), "%s:%s", sys->d_name,
+				 ev->d_name);
+			load_event_format(path, name);
+		}
+		closedir(ev_dir);
+	}
+	closedir(sys_dir);
+}
+
+static void render_timestamp(int fd, uint64_t ts)
+{
+	char str[64];
+	int len;
+
+	ts /= 1000;
+	len = sprintf(str, "%5lu.%06lu: ", (unsigned long)(ts / 1000000),
+		      (unsigned long)(ts % 1000000));
+	output_write(fd, str, len);
+}
+
+/* JSON or CSV value of string, same as kp_str_quote in runtime */
+static void render_quoted(int fd, const char *str, int len)
+{
+	char buf[512];
+	int i, n = 0, quote = (render_format == KTAP_FORMAT_JSON);
+
+	for (i = 0; !quote && i < len; i++) {
+		if (str[i] == ',' || str[i] == '"' || str[i] == '\n' ||
+		    str[i] == '\r')
+			quote = 1;
+	}
+
+	if (quote)
+		buf[n++] = '"';
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (n > sizeof(buf) - 8) {
+			output_write(fd, buf, n);
+			n = 0;
+		}
+
+		if (render_format == KTAP_FORMAT_CSV) {
+			if (c == '"')
+				buf[n++] = '"';
+			buf[n++] = c;
+		} else if (c == '"' || c == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = c;
+		} else if (c < 0x20)
+			n += sprintf(buf + n, "\\u%04x", c);
+		else
+			buf[n++] = c;
+	}
+
+	if (quote)
+		buf[n++] = '"';
+
+	output_write(fd, buf, n);
+}
+
+/* "ts,cpu," prefix of structured record, see KTAP_FORMAT_JSON */
+static void render_record_start(int fd, const ktap_raw_record_t *rec)
+{
+	char str[64];
+	int len;
+
+	if (render_format == KTAP_FORMAT_JSON)
+		len = sprintf(str, "{\"ts\":%llu,\"cpu\":%d,",
+			      (unsigned long long)rec->timestamp, rec->cpu);
+	else
+		len = sprintf(str, "%llu,%d,",
+			      (unsigned long long)rec->timestamp, rec->cpu);
+	output_write(fd, str, len);
+}
+
+static void render_field(int fd, const struct event_field *field,
+			 const char *data, int len)
+{
+	const char *p = data + field->offset;
+	char str[32];
+	int n = 0;
+
+	if (field->offset + field->size > len)
+		goto null;
+
+	switch (field->kind) {
+	case FIELD_DATA_LOC: {
+		uint32_t loc = *(uint32_t *)p;
+		int off = loc & 0xffff, size = loc >> 16;
+
+		if (off + size > len)
+			goto null;
+		render_quoted(fd, data + off, strnlen(data + off, size));
+		return;
+	}
+	case FIELD_STR:
+		render_quoted(fd, p, strnlen(p, field->size));
+		return;
+	case FIELD_NUM:
+		switch (field->size) {
+		case 1:
+			n = field->is_signed ? sprintf(str, "%d", *(int8_t *)p) :
+					       sprintf(str, "%u", *(uint8_t *)p);
+			break;
+		case 2:
+			n = field->is_signed ? sprintf(str, "%d", *(int16_t *)p) :
+					       sprintf(str, "%u", *(uint16_t *)p);
+			break;
+		case 4:
+			n = field->is_signed ? sprintf(str, "%d", *(int32_t *)p) :
+					       sprintf(str, "%u", *(uint32_t *)p);
+			break;
+		case 8:
+			n = sprintf(str, field->is_signed ? "%lld" : "%llu",
+				    *(unsigned long long *)p);
+			break;
+		}
+		if (n) {
+			output_write(fd, str, n);
+			return;
+		}
+		break;
+	}
+
+ null:
+	if (render_format == KTAP_FORMAT_JSON)
+		output_write(fd, "null", 4);
+}
+
+/* event record with all fields, same as kp_event_print_fields */
+static void render_event_fields(int fd, const ktap_raw_record_t *rec,
+				const struct event_format *format,
+				const char *data, int len)
+{
+	char str[300];
+	int i, n;
+
+	render_record_start(fd, rec);
+	if (render_format == KTAP_FORMAT_JSON)
+		output_write(fd, "\"event\":", 8);
+	render_quoted(fd, format->name, strlen(format->name));
+	if (render_format == KTAP_FORMAT_JSON)
+		output_write(fd, ",\"fields\":{", 11);
+
+	for (i = 0; i < format->nr_fields; i++) {
+		const struct event_field *field = &format->fields[i];
+
+		if (render_format == KTAP_FORMAT_JSON)
+			n = snprintf(str, sizeof(str), "%s\"%s\":",
+				     i ? "," : "", field->name);
+		else
+			n = sprintf(str, ",");
+		output_write(fd, str, n);
+
+		render_field(fd, field, data, len);
+	}
+
+	if (render_format == KTAP_FORMAT_JSON)
+		output_write(fd, "}}\n", 3);
+	else
+		output_write(fd, "\n", 1);
+}
+
+static int stack_sprint(char *sym, int size, unsigned long addr, int pid)
+{
+	if (pid) {
+#ifndef NO_LIBELF
+		return usym_sprint(sym, size, pid, addr, 1);
+#else
+		return snprintf(sym, size, "0x%lx", addr);
+#endif
+	}
+
+	return kallsyms_sprint(sym, size, addr, 1);
+}
+
+static void render_stack(int fd, const char *title, const unsigned long *entries,
+			 int nr, int pid)
+{
+	char sym[256], str[300];
+	int i, len;
+
+	output_write(fd, title, strlen(title));
+	for (i = 0; i < nr; i++) {
+		if (entries[i] == -1UL || !entries[i])
+			break;
+
+		stack_sprint(sym, sizeof(sym), entries[i], pid);
+		len = snprintf(str, sizeof(str), " => %s\n", sym);
+		output_write(fd, str, len);
+	}
+}
+
+/* stack as folded frames from root to leaf, like print_hist keys */
+static void render_stack_fields(int fd, const ktap_raw_record_t *rec,
+				const char *kind, const unsigned long *entries,
+				int nr, int pid)
+{
+	char frames[4096], sym[256], str[64];
+	int i, n, len = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (entries[i] == -1UL || !entries[i])
+			break;
+	}
+
+	/* first entry is the leaf frame */
+	while (--i >= 0 && len < sizeof(frames) - 1) {
+		stack_sprint(sym, sizeof(sym), entries[i], pid);
+		len += snprintf(frames + len, sizeof(frames) - len, "%s%s",
+				len ? ";" : "", sym);
+	}
+	if (len > sizeof(frames) - 1)
+		len = sizeof(frames) - 1;
+
+	render_record_start(fd, rec);
+	if (render_format == KTAP_FORMAT_JSON)
+		n = sprintf(str, "\"%s\":", kind);
+	else
+		n = sprintf(str, "%s,", kind);
+	output_write(fd, str, n);
+
+	render_quoted(fd, frames, len);
+
+	if (render_format == KTAP_FORMAT_JSON)
+		n = pid ? sprintf(str, ",\"pid\":%d}\n", pid) :
+			  sprintf(str, "}\n");
+	else
+		n = pid ? sprintf(str, ",%d\n", pid) : sprintf(str, "\n");
+	output_write(fd, str, n);
+}
+
+static void render_fn_fields(int fd, const ktap_raw_record_t *rec,
+			     const char *sym, const char *parent)
+{
+	int json = (render_format == KTAP_FORMAT_JSON);
+
+	render_record_start(fd, rec);
+	output_write(fd, json ? "\"fn\":" : "fn,", json ? 5 : 3);
+	render_quoted(fd, sym, strlen(sym));
+	output_write(fd, json ? ",\"parent\":" : ",", json ? 10 : 1);
+	render_quoted(fd, parent, strlen(parent));
+	output_write(fd, json ? "}\n" : "\n", json ? 2 : 1);
+}
+
+/* column values of one schema, see ktap_col_header_t */
+struct col_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct col_column {
+	char *name;
+	int type;	/* KTAP_COL_* */
+	int size;	/* value size of KTAP_COL_INT and KTAP_COL_UINT */
+	struct col_buf values;
+	struct col_buf lens;	/* uint32_t length of KTAP_COL_STR values */
+};
+
+struct col_table {
+	int id;
+	char *name;
+	int written;	/* SCHEMA block is written */
+	int nr_rows;
+	int nr_columns;
+	struct col_column *columns;
+};
+
+/* rows of a table are written as one block */
+#define COL_BLOCK_ROWS	4096
+
+static struct col_table **col_tables;	/* indexed by schema id */
+static int col_tables_nr;
+static struct col_table *col_raw_tables[KTAP_RAW_EVENT + 1];
+static struct col_table **col_event_tables;	/* indexed by event id */
+static struct col_buf col_text;	/* resolved text of print record */
+
+static void col_put(struct col_buf *buf, const void *data, size_t len)
+{
+	if (!len)
+		return;
+
+	if (buf->len + len > buf->size) {
+		buf->size = (buf->len + len) * 2;
+		buf->data = realloc(buf->data, buf->size);
+		if (!buf->data)
+			handle_error("realloc failed");
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void col_put_str(struct col_column *col, const char *str, size_t len)
+{
+	uint32_t n = len;
+
+	col_put(&col->lens, &n, sizeof(n));
+	col_put(&col->values, str, len);
+}
+
+static void col_add_column(struct col_table *t, const char *name, int type,
+			   int size)
+{
+	struct col_column *col;
+
+	t->columns = realloc(t->columns,
+			     (t->nr_columns + 1) * sizeof(*t->columns));
+	if (!t->columns)
+		handle_error("realloc failed");
+
+	col = &t->columns[t->nr_columns++];
+	memset(col, 0, sizeof(*col));
+	col->name = strdup(name);
+	col->type = type;
+	col->size = size;
+}
+
+/* new schema with "ts" and "cpu" columns */
+static struct col_table *col_table_new(const char *name)
+{
+	struct col_table *t;
+
+	col_tables = realloc(col_tables,
+			     (col_tables_nr + 1) * sizeof(*col_tables));
+	t = calloc(1, sizeof(*t));
+	if (!col_tables || !t)
+		handle_error("malloc failed");
+
+	t->id = col_tables_nr;
+	t->name = strdup(name);
+	col_tables[col_tables_nr++] = t;
+
+	col_add_column(t, "ts", KTAP_COL_UINT, sizeof(uint64_t));
+	col_add_column(t, "cpu", KTAP_COL_UINT, sizeof(uint16_t));
+	return t;
+}
+
+static void col_block_start(struct col_buf *buf, int type, int schema)
+{
+	ktap_col_block_t block;
+
+	buf->len = 0;
+	block.size = 0;
+	block.type = type;
+	block.schema = schema;
+	col_put(buf, &block, sizeof(block));
+}
+
+static void col_block_write(int fd, struct col_buf *buf)
+{
+	((ktap_col_block_t *)buf->data)->size = buf->len;
+	output_write(fd, buf->data, buf->len);
+}
+
+static void col_write_schema(int fd, struct col_table *t)
+{
+	static struct col_buf buf;
+	uint16_t n;
+	uint8_t u8;
+	int i;
+
+	col_block_start(&buf, KTAP_COL_SCHEMA, t->id);
+	n = t->nr_columns;
+	col_put(&buf, &n, sizeof(n));
+	n = strlen(t->name);
+	col_put(&buf, &n, sizeof(n));
+	col_put(&buf, t->name, n);
+
+	for (i = 0; i < t->nr_columns; i++) {
+		struct col_column *col = &t->columns[i];
+
+		u8 = col->type;
+		col_put(&buf, &u8, sizeof(u8));
+		u8 = col->type == KTAP_COL_STR ? 0 : col->size;
+		col_put(&buf, &u8, sizeof(u8));
+		n = strlen(col->name);
+		col_put(&buf, &n, sizeof(n));
+		col_put(&buf, col->name, n);
+	}
+
+	col_block_write(fd, &buf);
+	t->written = 1;
+}
+
+static void col_flush(int fd, struct col_table *t)
+{
+	static struct col_buf buf;
+	uint32_t nr_rows = t->nr_rows;
+	int i;
+
+	if (!t->nr_rows)
+		return;
+
+	if (!t->written)
+		col_write_schema(fd, t);
+
+	col_block_start(&buf, KTAP_COL_ROWS, t->id);
+	col_put(&buf, &nr_rows, sizeof(nr_rows));
+
+	for (i = 0; i < t->nr_columns; i++) {
+		struct col_column *col = &t->columns[i];
+
+		col_put(&buf, col->lens.data, col->lens.len);
+		col_put(&buf, col->values.data, col->values.len);
+		col->lens.len = 0;
+		col->values.len = 0;
+	}
+
+	col_block_write(fd, &buf);
+	t->nr_rows = 0;
+}
+
+/* start a row with "ts" and "cpu" values */
+static void col_row_start(struct col_table *t, const ktap_raw_record_t *rec)
+{
+	uint64_t ts = rec->timestamp;
+	uint16_t cpu = rec->cpu;
+
+	col_put(&t->columns[0].values, &ts, sizeof(ts));
+	col_put(&t->columns[1].values, &cpu, sizeof(cpu));
+}
+
+static void col_row_end(int fd, struct col_table *t)
+{
+	if (++t->nr_rows >= COL_BLOCK_ROWS)
+		col_flush(fd, t);
+}
+
+/* schema of non-event record type, columns after "ts" and "cpu" */
+static struct col_table *col_raw_table(int type)
+{
+	struct col_table *t = col_raw_tables[type];
+
+	if (t)
+		return t;
+
+	switch (type) {
+	case KTAP_RAW_PRINT:
+		t = col_table_new("print");
+		col_add_column(t, "text", KTAP_COL_STR, 0);
+		break;
+	case KTAP_RAW_STACK:
+		t = col_table_new("stack");
+		col_add_column(t, "frames", KTAP_COL_STR, 0);
+		break;
+	case KTAP_RAW_USER_STACK:
+		t = col_table_new("ustack");
+		col_add_column(t, "pid", KTAP_COL_UINT, sizeof(uint32_t));
+		col_add_column(t, "frames", KTAP_COL_STR, 0);
+		break;
+	case KTAP_RAW_FN:
+		t = col_table_new("fn");
+		col_add_column(t, "fn", KTAP_COL_STR, 0);
+		col_add_column(t, "parent", KTAP_COL_STR, 0);
+		break;
+	case KTAP_RAW_EVENT:
+		t = col_table_new("event");
+		col_add_column(t, "id", KTAP_COL_UINT, sizeof(uint16_t));
+		col_add_column(t, "data", KTAP_COL_STR, 0);
+		break;
+	}
+
+	col_raw_tables[type] = t;
+	return t;
+}
+
+/* schema of event with format file, one column per event field */
+static struct col_table *col_event_table(int id,
+					 const struct event_format *format)
+{
+	struct col_table *t;
+	int i;
+
+	if (!col_event_tables) {
+		col_event_tables = calloc(event_formats_nr,
+					  sizeof(*col_event_tables));
+		if (!col_event_tables)
+			handle_error("calloc failed");
+	}
+
+	t = col_event_tables[id];
+	if (t)
+		return t;
+
+	t = col_table_new(format->name);
+	for (i = 0; i < format->nr_fields; i++) {
+		const struct event_field *field = &format->fields[i];
+		int size = field->size;
+
+		if (field->kind == FIELD_NUM &&
+		    (size == 1 || size == 2 || size == 4 || size == 8))
+			col_add_column(t, field->name, field->is_signed ?
+				       KTAP_COL_INT : KTAP_COL_UINT, size);
+		else
+			col_add_column(t, field->name, KTAP_COL_STR, 0);
+	}
+
+	col_event_tables[id] = t;
+	return t;
+}
+
+static void col_event_field(struct col_column *col,
+			    const struct event_field *field,
+			    const char *data, int len)
+{
+	static const char zero[8];
+	const char *p = data + field->offset;
+
+	if (field->offset + field->size > len) {
+		if (col->type == KTAP_COL_STR)
+			col_put_str(col, NULL, 0);
+		else
+			col_put(&col->values, zero, col->size);
+		return;
+	}
+
+	if (col->type != KTAP_COL_STR) {
+		col_put(&col->values, p, col->size);
+		return;
+	}
+
+	switch (field->kind) {
+	case FIELD_DATA_LOC: {
+		uint32_t loc = *(uint32_t *)p;
+		int off = loc & 0xffff, size = loc >> 16;
+
+		if (off + size > len)
+			col_put_str(col, NULL, 0);
+		else
+			col_put_str(col, data + off, strnlen(data + off, size));
+		break;
+	}
+	case FIELD_STR:
+		col_put_str(col, p, strnlen(p, field->size));
+		break;
+	default:
+		col_put_str(col, p, field->size);
+		break;
+	}
+}
+
+/* text of print record with kernel symbol tokens resolved */
+static void col_resolve_text(const char *p, const char *end)
+{
+	char tok_str[MAX_SYMTOKEN], str[256];
+
+	col_text.len = 0;
+	while (p < end) {
+		const char *tok = memchr(p, KTAP_SYM_BEGIN, end - p);
+		const char *tok_end;
+
+		if (!tok) {
+			col_put(&col_text, p, end - p);
+			break;
+		}
+
+		col_put(&col_text, p, tok - p);
+
+		tok_end = memchr(tok, KTAP_SYM_END, end - tok);
+		if (!tok_end || tok_end - tok >= sizeof(tok_str)) {
+			/* not a symbol token */
+			col_put(&col_text, tok, 1);
+			p = tok + 1;
+			continue;
+		}
+
+		memcpy(tok_str, tok + 1, tok_end - tok - 1);
+		tok_str[tok_end - tok - 1] = '\0';
+		col_put(&col_text, str, symbol_sprint(str, sizeof(str), tok_str));
+		p = tok_end + 1;
+	}
+}
+
+/* folded frames from root to leaf into col_text, see render_stack_fields */
+static void col_stack_text(const unsigned long *entries, int nr, int pid)
+{
+	char sym[256];
+	int i, n;
+
+	for (i = 0; i < nr; i++) {
+		if (entries[i] == -1UL || !entries[i])
+			break;
+	}
+
+	col_text.len = 0;
+	while (--i >= 0) {
+		if (col_text.len)
+			col_put(&col_text, ";", 1);
+		n = stack_sprint(sym, sizeof(sym), entries[i], pid);
+		col_put(&col_text, sym, n >= sizeof(sym) ? sizeof(sym) - 1 : n);
+	}
+}
+
+/* add raw record as a row of its schema, see ktap_col_header_t */
+static void col_record(int fd, const ktap_raw_record_t *rec, char *data,
+		       int len)
+{
+	const unsigned long *addr = (const unsigned long *)data;
+	const struct event_format *format = NULL;
+	struct col_table *t;
+	char sym[256];
+	uint16_t id = 0;
+	uint32_t pid;
+	int i;
+
+	if (rec->type == KTAP_RAW_EVENT) {
+		id = *(unsigned short *)data;
+
+		if (!event_formats)
+			load_event_formats();
+		if (event_formats && id < event_formats_nr)
+			format = event_formats[id];
+
+		if (format) {
+			t = col_event_table(id, format);
+			col_row_start(t, rec);
+			for (i = 0; i < format->nr_fields; i++)
+				col_event_field(&t->columns[i + 2],
+						&format->fields[i], data, len);
+			col_row_end(fd, t);
+			return;
+		}
+	}
+
+	if (rec->type < KTAP_RAW_PRINT || rec->type > KTAP_RAW_EVENT)
+		return; /* newer record type, skip it */
+
+	t = col_raw_table(rec->type);
+	col_row_start(t, rec);
+
+	switch (rec->type) {
+	case KTAP_RAW_PRINT:
+		col_resolve_text(data, data + strnlen(data, len));
+		col_put_str(&t->columns[2], col_text.data, col_text.len);
+		break;
+	case KTAP_RAW_STACK:
+		col_stack_text(addr, len / sizeof(long), 0);
+		col_put_str(&t->columns[2], col_text.data, col_text.len);
+		break;
+	case KTAP_RAW_USER_STACK:
+		pid = *(unsigned int *)data;
+		col_put(&t->columns[2].values, &pid, sizeof(pid));
+		col_stack_text(addr + 1, len / sizeof(long) - 1, pid);
+		col_put_str(&t->columns[3], col_text.data, col_text.len);
+		break;
+	case KTAP_RAW_FN:
+		kallsyms_sprint(sym, sizeof(sym), addr[0], 1);
+		col_put_str(&t->columns[2], sym, strnlen(sym, sizeof(sym)));
+		kallsyms_sprint(sym, sizeof(sym), addr[1], 1);
+		col_put_str(&t->columns[3], sym, strnlen(sym, sizeof(sym)));
+		break;
+	case KTAP_RAW_EVENT:
+		col_put(&t->columns[2].values, &id, sizeof(id));
+		col_put_str(&t->columns[3], data, len);
+		break;
+	}
+
+	col_row_end(fd, t);
+}
+
+/* write out rows left in all schemas, at end of input */
+static void col_flush_all(int fd)
+{
+	int i;
+
+	for (i = 0; i < col_tables_nr; i++)
+		col_flush(fd, col_tables[i]);
+}
+
+static void render_record(int fd, const ktap_raw_record_t *rec, char *data,
+			  int len, int timestamp)
+{
+	const unsigned long *addr = (const unsigned long *)data;
+	const struct event_format *format = NULL;
+	char sym[256], parent[256], str[600];
+	int n, id;
+
+	if (render_format == KTAP_FORMAT_COLUMNAR) {
+		col_record(fd, rec, data, len);
+		return;
+	}
+
+	switch (rec->type) {
+	case KTAP_RAW_PRINT:
+		n = output_resolve(fd, data, strnlen(data, len));
+		if (n)
+			output_write(fd, data, n);
+		break;
+	case KTAP_RAW_STACK:
+		if (render_format != KTAP_FORMAT_TEXT)
+			render_stack_fields(fd, rec, "stack", addr,
+					    len / sizeof(long), 0);
+		else
+			render_stack(fd, "<stack trace>\n", addr,
+				     len / sizeof(long), 0);
+		break;
+	case KTAP_RAW_USER_STACK:
+		if (render_format != KTAP_FORMAT_TEXT)
+			render_stack_fields(fd, rec, "ustack", addr + 1,
+					    len / sizeof(long) - 1,
+					    *(unsigned int *)data);
+		else
+			render_stack(fd, "<user stack trace>\n", addr + 1,
+				     len / sizeof(long) - 1,
+				     *(unsigned int *)data);
+		break;
+	case KTAP_RAW_FN:
+		kallsyms_sprint(sym, sizeof(sym), addr[0], 1);
+		kallsyms_sprint(parent, sizeof(parent), addr[1], 1);
+		if (render_format != KTAP_FORMAT_TEXT) {
+			render_fn_fields(fd, rec, sym, parent);
+			break;
+		}
+		if (timestamp)
+			render_timestamp(fd, rec->timestamp);
+		n = snprintf(str, sizeof(str), "%s <- %s\n", sym, parent);
+		output_write(fd, str, n);
+		break;
+	case KTAP_RAW_EVENT:
+		id = *(unsigned short *)data;
+
+		if (!event_formats)
+			load_event_formats();
+		if (event_formats && id < event_formats_nr)
+			format = event_formats[id];
+
+		if (format && render_format != KTAP_FORMAT_TEXT) {
+			render_event_fields(fd, rec, format, data, len);
+			break;
+		}
+
+		if (timestamp)
+			render_timestamp(fd, rec->timestamp);
+		if (format)
+			n = snprintf(str, sizeof(str), "%s: cpu %d, %d bytes\n",
+				     format->name, rec->cpu, len);
+		else
+			n = snprintf(str, sizeof(str), "event %d: cpu %d, "
+				     "%d bytes\n", id, rec->cpu, len);
+		output_write(fd, str, n);
+		break;
+	default:
+		/* newer record type, skip it */
+		break;
+	}
+}
+
+#ifndef NO_LIBZ
+/* reads plain file as is, so -r takes output of -z -R as well */
+typedef void *raw_input_t;
+#define raw_open(path)		kp_compress_input_open(path)
+#define raw_read(in, buf, len)	kp_compress_input_read(in, buf, len)
+#define raw_close(in)		kp_compress_input_close(in)
+#else
+typedef FILE *raw_input_t;
+#define raw_open(path)		fopen(path, "r")
+#define raw_read(in, buf, len)	fread(buf, 1, len, in)
+#define raw_close(in)		fclose(in)
+#endif
+
+/* render raw output stream into text or columnar, see ktap_raw_header_t */
+int kp_render_raw(const char *input, const char *output, int timestamp,
+		  int format)
+{
+	ktap_raw_header_t header;
+	ktap_raw_record_t rec;
+	char *data = NULL;
+	size_t size = 0;
+	int out_fd, ret = 0;
+	raw_input_t in;
+
+	in = raw_open(input);
+	if (!in) {
+		fprintf(stderr, "Cannot open file %s\n", input);
+		return -1;
+	}
+
+	if (raw_read(in, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != KTAP_RAW_MAGIC) {
+		fprintf(stderr, "%s is not ktap raw output\n", input);
+		raw_close(in);
+		return -1;
+	}
+
+	if (header.version != KTAP_RAW_VERSION ||
+	    header.long_size != sizeof(long)) {
+		fprintf(stderr, "unsupported raw output version %d\n",
+			header.version);
+		raw_close(in);
+		return -1;
+	}
+
+	if (output) {
+		out_fd = open(output, O_CREAT | O_WRONLY | O_TRUNC,
+					S_IRUSR|S_IWUSR);
+		if (out_fd < 0) {
+			fprintf(stderr, "Cannot open output file %s\n", output);
+			raw_close(in);
+			return -1;
+		}
+	} else
+		out_fd = 1;
+
+	render_format = format;
+	if (format == KTAP_FORMAT_COLUMNAR) {
+		ktap_col_header_t col_header;
+
+		col_header.magic = KTAP_COL_MAGIC;
+		col_header.version = KTAP_COL_VERSION;
+		col_header.reserved = 0;
+		output_write(out_fd, (char *)&col_header, sizeof(col_header));
+	}
+
+	while (raw_read(in, &rec, sizeof(rec)) == sizeof(rec)) {
+		size_t len;
+
+		if (rec.size < sizeof(rec)) {
+			fprintf(stderr, "corrupted record in %s\n", input);
+			ret = -1;
+			break;
+		}
+
+		len = rec.size - sizeof(rec);
+		if (len >= size) {
+			size = len + 1;
+			data = realloc(data, size);
+			if (!data)
+				handle_error("realloc failed");
+		}
+
+		if (raw_read(in, data, len) != len) {
+			fprintf(stderr, "truncated record in %s\n", input);
+			ret = -1;
+			break;
+		}
+		data[len] = '\0';
+
+		render_record(out_fd, &rec, data, len, timestamp);
+	}
+
+	if (format == KTAP_FORMAT_COLUMNAR)
+		col_flush_all(out_fd);
+	output_flush(out_fd);
+	free(data);
+	raw_close(in);
+	if (out_fd != 1)
+		close(out_fd);
+
+	return ret;
+}
@@ -356,3 +356,317 @@ int parse_dso_symbols(const char *exec, int type, symbol_actor actor, void *arg)
 	close(fd);
 	return symbols_count;
 }
+
+/*
+ * Symbolization of user stack addresses for reader.
+ *
+ * DSO symbols are loaded once per build-id and kept sorted, resolved
+ * (pid, address) pairs are cached, so repeated address only costs a
+ * hash lookup.
+ */
+
+#define BUILD_ID_SIZE 20
+#define UADDR_HASH_SIZE 4096
+
+struct usym_t {
+	vaddr_t addr;
+	char *name;
+};
+
+struct dso_cache_t {
+	struct dso_cache_t *next;
+	char *path;
+	unsigned long inode;
+	char build_id[BUILD_ID_SIZE * 2 + 1];
+	vaddr_t bias;		/* file offset + bias = address in syms */
+	int nr;
+	int size;
+	struct usym_t *syms;
+};
+
+struct uaddr_cache_t {
+	struct uaddr_cache_t *next;
+	int pid;
+	unsigned long addr;
+	const struct usym_t *sym; /* NULL if not resolved */
+	unsigned long offset;	/* offset of addr in sym */
+	const char *dso;	/* DSO name, NULL if not file backed */
+};
+
+static struct dso_cache_t *dso_cache;
+static struct uaddr_cache_t *uaddr_hash[UADDR_HASH_SIZE];
+
+/*
+ * symbols of dso_symbols are relative to load address, but addresses in
+ * process are resolved to file offsets, text segment maps one to other.
+ */
+static vaddr_t dso_text_bias(Elf *elf)
+{
+	vaddr_t load_address;
+	GElf_Phdr phdr;
+	size_t i, phdrnum;
+
+	if (find_load_address(elf, &load_address) ||
+	    elf_getphdrnum(elf, &phdrnum))
+		return 0;
+
+	for (i = 0; i < phdrnum; i++) {
+		if (gelf_getphdr(elf, i, &phdr) == NULL)
+			return 0;
+
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X))
+			return phdr.p_vaddr - phdr.p_offset - load_address;
+	}
+
+	return 0;
+}
+
+/* read build-id and text bias of DSO, return -1 if no build-id */
+static int dso_build_id(const char *exec, char *build_id, vaddr_t *bias)
+{
+	Elf_Scn *scn = NULL;
+	GElf_Shdr shdr;
+	int found = 0;
+	Elf *elf;
+	int fd;
+
+	build_id[0] = '\0';
+	*bias = 0;
+
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		return -1;
+
+	fd = open(exec, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	if (elf)
+		*bias = dso_text_bias(elf);
+
+	while (elf && !found && (scn = elf_nextscn(elf, scn))) {
+		size_t next, name_off, desc_off, offset;
+		GElf_Nhdr nhdr;
+		Elf_Data *data;
+
+		gelf_getshdr(scn, &shdr);
+		if (shdr.sh_type != SHT_NOTE)
+			continue;
+
+		data = elf_getdata(scn, NULL);
+		for (offset = 0;
+		     (next = gelf_getnote(data, offset, &nhdr, &name_off,
+					  &desc_off)) > 0;
+		     offset = next) {
+			const unsigned char *desc;
+			int i;
+
+			if (nhdr.n_type != NT_GNU_BUILD_ID ||
+			    nhdr.n_namesz != sizeof("GNU") ||
+			    memcmp(data->d_buf + name_off, "GNU", sizeof("GNU")))
+				continue;
+
+			desc = data->d_buf + desc_off;
+			for (i = 0; i < nhdr.n_descsz && i < BUILD_ID_SIZE; i++)
+				sprintf(build_id + i * 2, "%02x", desc[i]);
+			found = 1;
+			break;
+		}
+	}
+
+	if (elf)
+		elf_end(elf);
+	close(fd);
+	return found ? 0 : -1;
+}
+
+static int usym_add(const char *name, vaddr_t addr, void *arg)
+{
+	struct dso_cache_t *dso = arg;
+
+	if (dso->nr == dso->size) {
+		dso->size = dso->size ? dso->size * 2 : 1024;
+		dso->syms = realloc(dso->syms, dso->size * sizeof(*dso->syms));
+		if (!dso->syms)
+			return -1;
+	}
+
+	dso->syms[dso->nr].addr = addr;
+	dso->syms[dso->nr].name = strdup(name);
+	dso->nr++;
+	return 0;
+}
+
+static int usym_cmp(const void *a, const void *b)
+{
+	const struct usym_t *sa = a, *sb = b;
+
+	if (sa->addr == sb->addr)
+		return 0;
+	return sa->addr < sb->addr ? -1 : 1;
+}
+
+static struct dso_cache_t *dso_cache_get(const char *path, unsigned long inode)
+{
+	char build_id[BUILD_ID_SIZE * 2 + 1];
+	struct dso_cache_t *dso;
+	vaddr_t bias;
+
+	for (dso = dso_cache; dso; dso = dso->next) {
+		if (dso->inode == inode && !strcmp(dso->path, path))
+			return dso;
+	}
+
+	/* same binary in other path shares symbols with it */
+	if (!dso_build_id(path, build_id, &bias)) {
+		for (dso = dso_cache; dso; dso = dso->next) {
+			if (!strcmp(dso->build_id, build_id))
+				break;
+		}
+	}
+
+	if (!dso) {
+		dso = calloc(1, sizeof(*dso));
+		if (!dso)
+			return NULL;
+
+		strcpy(dso->build_id, build_id);
+		dso->bias = bias;
+		if (parse_dso_symbols(path, FIND_SYMBOL, usym_add, dso) > 0)
+			qsort(dso->syms, dso->nr, sizeof(*dso->syms), usym_cmp);
+		else
+			dso->nr = 0;
+	} else {
+		struct dso_cache_t *alias = malloc(sizeof(*alias));
+
+		if (!alias)
+			return NULL;
+		*alias = *dso;
+		dso = alias;
+	}
+
+	dso->path = strdup(path);
+	dso->inode = inode;
+	dso->next = dso_cache;
+	dso_cache = dso;
+	return dso;
+}
+
+static const struct usym_t *dso_lookup(struct dso_cache_t *dso, vaddr_t addr)
+{
+	int lo = 0, hi = dso->nr - 1;
+
+	if (!dso->nr || addr < dso->syms[0].addr)
+		return NULL;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (dso->syms[mid].addr <= addr)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return &dso->syms[lo];
+}
+
+/*
+ * find file backed mapping of addr in process pid,
+ * return file offset of addr.
+ */
+static int find_mapping(int pid, unsigned long addr, char *path,
+			unsigned long *offset, unsigned long *inode)
+{
+	char maps[64], line[PATH_MAX + 128];
+	int found = -1;
+	FILE *file;
+
+	sprintf(maps, "/proc/%d/maps", pid);
+	file = fopen(maps, "r");
+	if (!file)
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long start, end, pgoff, ino;
+		char perms[8], dev[16];
+		char *p;
+		int n;
+
+		if (sscanf(line, "%lx-%lx %7s %lx %15s %lu %n", &start, &end,
+			   perms, &pgoff, dev, &ino, &n) < 6)
+			continue;
+
+		if (addr < start || addr >= end)
+			continue;
+
+		p = line + n;
+		if (*p != '/')
+			break;
+
+		p[strcspn(p, "\n")] = '\0';
+		strncpy(path, p, PATH_MAX - 1);
+		path[PATH_MAX - 1] = '\0';
+		*offset = addr - start + pgoff;
+		*inode = ino;
+		found = 0;
+		break;
+	}
+
+	fclose(file);
+	return found;
+}
+
+static struct uaddr_cache_t *uaddr_resolve(int pid, unsigned long addr)
+{
+	unsigned int h = (addr ^ (addr >> 12) ^ pid) % UADDR_HASH_SIZE;
+	struct dso_cache_t *dso = NULL;
+	unsigned long offset, inode;
+	struct uaddr_cache_t *ua;
+	char path[PATH_MAX];
+
+	for (ua = uaddr_hash[h]; ua; ua = ua->next) {
+		if (ua->pid == pid && ua->addr == addr)
+			return ua;
+	}
+
+	ua = calloc(1, sizeof(*ua));
+	if (!ua)
+		return NULL;
+
+	ua->pid = pid;
+	ua->addr = addr;
+
+	if (!find_mapping(pid, addr, path, &offset, &inode))
+		dso = dso_cache_get(path, inode);
+
+	if (dso) {
+		offset += dso->bias;
+		ua->dso = strrchr(dso->path, '/') + 1;
+		ua->sym = dso_lookup(dso, offset);
+		if (ua->sym)
+			ua->offset = offset - ua->sym->addr;
+	}
+
+	ua->next = uaddr_hash[h];
+	uaddr_hash[h] = ua;
+	return ua;
+}
+
+int usym_sprint(char *buf, size_t size, int pid, unsigned long addr,
+		int offset)
+{
+	struct uaddr_cache_t *ua = uaddr_resolve(pid, addr);
+
+	if (!ua || !ua->sym) {
+		if (ua && ua->dso && offset)
+			return snprintf(buf, size, "0x%lx [%s]", addr, ua->dso);
+		return snprintf(buf, size, "0x%lx", addr);
+	}
+
+	if (!offset)
+		return snprintf(buf, size, "%s", ua->sym->name);
+
+	return snprintf(buf, size, "%s+0x%lx [%s]", ua->sym->name, ua->offset,
+			ua->dso);
+}
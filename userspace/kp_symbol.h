@@ -45,4 +45,12 @@ typedef int (*symbol_actor)(const char *name, vaddr_t addr, void *arg);
  */
 int
 parse_dso_symbols(const char *exec, int type, symbol_actor actor, void *arg);
+
+/**
+ * Print symbol of user address in process @pid, "name+0xoff [dso]"
+ * with @offset, otherwise "name". DSO symbols and resolved addresses
+ * are cached.
+ */
+int usym_sprint(char *buf, size_t size, int pid, unsigned long addr,
+		int offset);
 #endif
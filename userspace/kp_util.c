@@ -572,6 +572,99 @@ unsigned long find_kernel_symbol(const char *symbol)
 	return arg.addr;
 }
 
+/*
+ * sorted index of kernel symbols, built once from /proc/kallsyms on
+ * first use, used to resolve symbol tokens in trace_pipe output.
+ */
+struct ksym_t {
+	unsigned long addr;
+	char *name;
+};
+
+static struct ksym_t *ksym_index;
+static int ksym_nr;
+static int ksym_size;
+static int ksym_loaded;
+
+static int ksym_add(void *arg, const char *name, char type,
+		    unsigned long start)
+{
+	/* absolute and undefined symbols don't cover any text */
+	if (!name || type == 'a' || type == 'A' || type == 'U')
+		return 0;
+
+	if (ksym_nr == ksym_size) {
+		ksym_size = ksym_size ? ksym_size * 2 : 4096;
+		ksym_index = realloc(ksym_index, ksym_size * sizeof(*ksym_index));
+		if (!ksym_index)
+			handle_error("realloc ksym index failed");
+	}
+
+	ksym_index[ksym_nr].addr = start;
+	ksym_index[ksym_nr].name = strdup(name);
+	ksym_nr++;
+	return 0;
+}
+
+static int ksym_cmp(const void *a, const void *b)
+{
+	const struct ksym_t *sa = a, *sb = b;
+
+	if (sa->addr == sb->addr)
+		return 0;
+	return sa->addr < sb->addr ? -1 : 1;
+}
+
+static const struct ksym_t *ksym_lookup(unsigned long addr)
+{
+	int lo, hi;
+
+	if (!ksym_loaded) {
+		kallsyms_parse(NULL, ksym_add);
+		qsort(ksym_index, ksym_nr, sizeof(*ksym_index), ksym_cmp);
+		ksym_loaded = 1;
+	}
+
+	if (!ksym_nr || addr < ksym_index[0].addr)
+		return NULL;
+
+	lo = 0;
+	hi = ksym_nr - 1;
+
+	/* find the last symbol which starts at or below addr */
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (ksym_index[mid].addr <= addr)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return &ksym_index[lo];
+}
+
+/*
+ * sprint symbol of kernel address like kernel sprint_symbol,
+ * "name+0xoff/0xsize" with offset, "name" without offset.
+ */
+int kallsyms_sprint(char *buf, size_t size, unsigned long addr, int offset)
+{
+	const struct ksym_t *sym = ksym_lookup(addr);
+
+	if (!sym)
+		return snprintf(buf, size, "0x%lx", addr);
+
+	if (!offset)
+		return snprintf(buf, size, "%s", sym->name);
+
+	if (sym + 1 < ksym_index + ksym_nr)
+		return snprintf(buf, size, "%s+0x%lx/0x%lx", sym->name,
+				addr - sym->addr, sym[1].addr - sym->addr);
+
+	return snprintf(buf, size, "%s+0x%lx", sym->name, addr - sym->addr);
+}
+
 
 #define AVAILABLE_EVENTS_PATH "/sys/kernel/debug/tracing/available_events"
 
@@ -97,6 +97,7 @@ int kallsyms_parse(void *arg,
 		   char type, unsigned long start));
 
 unsigned long find_kernel_symbol(const char *symbol);
+int kallsyms_sprint(char *buf, size_t size, unsigned long addr, int offset);
 void list_available_events(const char *match);
 void process_available_tracepoints(const char *sys, const char *event,
 				   int (*process)(const char *sys,
@@ -132,5 +133,19 @@ void kp_dump_proto(ktap_proto_t *pt);
 typedef int (*ktap_writer)(const void* p, size_t sz, void* ud);
 int kp_bcwrite(ktap_proto_t *pt, ktap_writer writer, void *data, int strip);
 
-int kp_create_reader(const char *output);
+int kp_create_reader(const char *output, int mmap_fd, int raw, int compress,
+		     int percpu);
+void kp_reader_rotate(unsigned long size, int interval, int count);
+int kp_render_raw(const char *input, const char *output, int timestamp,
+		  int format);
+int kp_convert_chrome(const char *input, const char *output);
+
+#ifndef NO_LIBZ
+ssize_t kp_compress_write(int fd, const void *data, size_t len);
+int kp_compress_open(const char *output, int raw);
+void kp_compress_close(void);
+void *kp_compress_input_open(const char *input);
+ssize_t kp_compress_input_read(void *in, void *buf, size_t len);
+void kp_compress_input_close(void *in);
+#endif
 #endif
@@ -0,0 +1,33 @@
+/*
+ * amalg.c - ktapvm amalgamation for ktap-replay.
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* same order as runtime/amalg.c, kp_replay_vm.c stands for the rest */
+#include "../../runtime/kp_obj.c"
+#include "../../runtime/kp_bcread.c"
+#include "../../runtime/kp_str.c"
+#include "../../runtime/kp_mempool.c"
+#include "../../runtime/kp_stackmap.c"
+#include "../../runtime/kp_symcache.c"
+#include "../../runtime/kp_tab.c"
+#include "../../runtime/kp_vm.c"
+#include "../../runtime/lib_base.c"
+#include "../../runtime/lib_ansi.c"
+#include "../../runtime/lib_table.c"
+#include "kp_replay_vm.c"
@@ -0,0 +1 @@
+/* replay build, see kp_replay.h */
@@ -0,0 +1,259 @@
+/*
+ * kp_replay.c - run ktap script on ktapvm built for userspace
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../../include/ktap_types.h"
+#include "../kp_lex.h"
+#include "../kp_parse.h"
+#include "../kp_util.h"
+#include "../cparser.h"
+#include "libktapvm.h"
+
+/*
+ * ktap-replay compiles script as ktap does, and runs it in ktapvm linked
+ * into this process, no module, no root and no tracing needed. Trace and
+ * timer probes are fired synthetically, so it's for testing scripts and
+ * measuring ktapvm itself, like time of one handler, see kp_replay_vm.c.
+ */
+
+static void usage(const char *msg_fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg_fmt);
+	vfprintf(stderr, msg_fmt, ap);
+	va_end(ap);
+
+	fprintf(stderr,
+"Usage: ktap-replay [options] file [script args]\n"
+"   or: ktap-replay [options] -e one-liner\n"
+"\n"
+"Options and arguments:\n"
+"  -n loops       : fire each probe this many times(default 1)\n"
+"  -m size        : initial string mempool size in Kbytes(default 512)\n"
+"  -v             : enable verbose mode\n"
+"  file           : program read from script file\n");
+
+	exit(EXIT_FAILURE);
+}
+
+#define handle_error(str) do { perror(str); exit(-1); } while(0)
+
+static ktap_option_t uparm;
+static int ktap_trunk_mem_size = 1024;
+
+static int kp_writer(const void* p, size_t sz, void* ud)
+{
+	if (uparm.trunk_len + sz > ktap_trunk_mem_size) {
+		int new_size = (uparm.trunk_len + sz) * 2;
+		uparm.trunk = realloc(uparm.trunk, new_size);
+		ktap_trunk_mem_size = new_size;
+	}
+
+	memcpy(uparm.trunk + uparm.trunk_len, p, sz);
+	uparm.trunk_len += sz;
+
+	return 0;
+}
+
+/*
+ * stands for kp_parse_events.c, events are not looked up in tracefs,
+ * trace block gets one probe named by its eventdef.
+ */
+ktap_eventdesc_t *kp_parse_events(const char *eventdef)
+{
+	kp_replay_eventdesc_t *evdesc;
+	char *name;
+	int len;
+
+	while (isspace(*eventdef))
+		eventdef++;
+
+	len = strlen(eventdef);
+	while (len && isspace(eventdef[len - 1]))
+		len--;
+
+	name = strndup(eventdef, len);
+	evdesc = calloc(1, sizeof(*evdesc));
+	if (!name || !evdesc) {
+		free(name);
+		free(evdesc);
+		return NULL;
+	}
+
+	evdesc->eventdef = name;
+	return &evdesc->desc;
+}
+
+int verbose;
+static int loops = 1;
+static int mempool_size;
+static char oneline_src[1024];
+static const char *script_file;
+static int script_args_start;
+static int script_args_end;
+
+static void parse_option(int argc, char **argv)
+{
+	char *next_arg;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			script_file = argv[i];
+			script_args_start = i + 1;
+			script_args_end = argc;
+			return;
+		}
+
+		next_arg = argv[i + 1];
+
+		/* These flags require arguments. */
+		if (!next_arg && (argv[i][1] == 'e' || argv[i][1] == 'n' ||
+				  argv[i][1] == 'm'))
+			usage("flag -%c requires an argument\n", argv[i][1]);
+
+		switch (argv[i][1]) {
+		case 'e':
+			if (strlen(next_arg) >= sizeof(oneline_src))
+				usage("one-liner is too long\n");
+			strcpy(oneline_src, next_arg);
+			i++;
+			break;
+		case 'n':
+			loops = atoi(next_arg);
+			if (loops < 0)
+				usage("invalid loops %s\n", next_arg);
+			i++;
+			break;
+		case 'm':
+			mempool_size = atoi(next_arg);
+			if (mempool_size <= 0)
+				usage("invalid mempool size %s\n", next_arg);
+			i++;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage("wrong argument\n");
+			break;
+		}
+	}
+}
+
+static ktap_proto_t *parse(const char *chunkname, const char *src)
+{
+	LexState ls;
+
+	ls.chunkarg = chunkname ? chunkname : "?";
+	kp_lex_init();
+	kp_buf_init(&ls.sb);
+	kp_lex_setup(&ls, src);
+	return kp_parse(&ls);
+}
+
+static void compile(const char *input)
+{
+	ktap_proto_t *pt;
+	char *buff;
+	struct stat sb;
+	int fdin;
+
+	kp_str_resize();
+
+	if (oneline_src[0] != '\0') {
+		ffi_cparser_init();
+		pt = parse(input, oneline_src);
+		goto dump;
+	}
+
+	fdin = open(input, O_RDONLY);
+	if (fdin < 0) {
+		fprintf(stderr, "open file %s failed\n", input);
+		exit(-1);
+	}
+
+	if (fstat(fdin, &sb) == -1)
+		handle_error("fstat failed");
+
+	buff = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
+	if (buff == MAP_FAILED)
+		handle_error("mmap failed");
+
+	ffi_cparser_init();
+	pt = parse(input, buff);
+
+	munmap(buff, sb.st_size);
+	close(fdin);
+
+ dump:
+	/* bcwrite */
+	uparm.trunk = malloc(ktap_trunk_mem_size);
+	if (!uparm.trunk)
+		handle_error("malloc failed");
+
+	kp_bcwrite(pt, kp_writer, NULL, 0);
+	ffi_cparser_free();
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc == 1)
+		usage("");
+
+	parse_option(argc, argv);
+
+	if (oneline_src[0] != '\0')
+		script_file = "(command line)";
+
+	if (!script_file)
+		usage("");
+
+	compile(script_file);
+
+	/* argv of script, arg[0] is script itself */
+	uparm.argc = script_args_end - script_args_start + 1;
+	uparm.argv = malloc(sizeof(char *) * uparm.argc);
+	if (!uparm.argv)
+		handle_error("malloc failed");
+
+	uparm.argv[0] = (char *)script_file;
+	for (i = 1; i < uparm.argc; i++)
+		uparm.argv[i] = argv[script_args_start + i - 1];
+
+	uparm.verbose = verbose;
+	uparm.trace_pid = -1;
+	uparm.trace_cpu = -1;
+	uparm.quiet = 1;
+	uparm.mempool_size = mempool_size;
+
+	return kp_replay_run(&uparm, loops);
+}
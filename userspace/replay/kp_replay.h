@@ -0,0 +1,529 @@
+/*
+ * kp_replay.h - kernel API used by ktapvm runtime, implemented in userspace
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __KTAP_REPLAY_H__
+#define __KTAP_REPLAY_H__
+
+/*
+ * This header is force included (-include) when runtime files are built
+ * for ktap-replay, the <linux/...> headers they include are empty files
+ * under replay/include. Only what runtime needs is here, modelled as a
+ * kernel with one cpu, running in process context, without preemption:
+ * locks are no-ops, per-cpu data has one instance, allocations are libc.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(4, 4, 0)
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint32_t __be32;
+typedef unsigned int gfp_t;
+typedef u64 cycle_t;
+typedef _Bool bool;
+
+#define true	1
+#define false	0
+
+#define __user
+#define __percpu
+#define __kprobes
+#define __read_mostly
+#define notrace
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define THIS_MODULE		NULL
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+#define PAGE_SIZE		4096UL
+#define KSYM_NAME_LEN		128
+#define KSYM_SYMBOL_LEN		512
+#define PERF_NR_CONTEXTS	4
+
+#define NSEC_PER_SEC		1000000000L
+#define NSEC_PER_MSEC		1000000L
+#define NSEC_PER_USEC		1000L
+#define USEC_PER_SEC		1000000L
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
+#define WARN_ON(cond)		({ int __c = !!(cond); __c; })
+#define WARN_ONCE(cond, ...)	WARN_ON(cond)
+#define BUG_ON(cond)		do { if (cond) abort(); } while (0)
+#define ACCESS_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+
+#define IS_ERR(ptr)		((unsigned long)(ptr) >= (unsigned long)-4095)
+#define PTR_ERR(ptr)		((long)(ptr))
+#define ERR_PTR(err)		((void *)(long)(err))
+
+#define printk			printf
+#define KERN_INFO		""
+#define pr_err(...)		fprintf(stderr, __VA_ARGS__)
+#define pr_info(...)		fprintf(stderr, __VA_ARGS__)
+#define pr_warn(...)		fprintf(stderr, __VA_ARGS__)
+
+static inline int vscnprintf(char *buf, size_t size, const char *fmt,
+			     va_list args)
+{
+	int len = vsnprintf(buf, size, fmt, args);
+
+	if (len < 0)
+		return 0;
+	return (size_t)len < size ? len : (size ? size - 1 : 0);
+}
+
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vscnprintf(buf, size, fmt, args);
+	va_end(args);
+	return len;
+}
+
+static inline size_t strlcpy(char *dest, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size) {
+		size_t n = len >= size ? size - 1 : len;
+
+		memcpy(dest, src, n);
+		dest[n] = '\0';
+	}
+	return len;
+}
+
+static inline int kstrtoint(const char *s, unsigned int base, int *res)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, base);
+	if (errno || end == s || (*end && *end != '\n'))
+		return -EINVAL;
+	*res = n;
+	return 0;
+}
+
+#define do_div(n, base) ({			\
+	u32 __rem = (n) % (base);		\
+	(n) /= (base);				\
+	__rem;					\
+})
+
+/* memory */
+#define GFP_KERNEL		0x01u
+#define GFP_ATOMIC		0x02u
+#define __GFP_NORETRY		0x04u
+#define __GFP_NOWARN		0x08u
+#define __GFP_RECLAIM		0x10u
+#define __GFP_ZERO		0x20u
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return flags & __GFP_ZERO ? calloc(1, size) : malloc(size);
+}
+
+#define kzalloc(size, flags)	calloc(1, size)
+#define kcalloc(n, size, flags)	calloc(n, size)
+#define krealloc(p, size, flags) realloc(p, size)
+#define kfree(p)		free((void *)(p))
+#define vmalloc(size)		malloc(size)
+#define vzalloc(size)		calloc(1, size)
+#define vfree(p)		free((void *)(p))
+
+/* one cpu, per-cpu data has one instance */
+#define NR_CPUS			1
+#define nr_cpu_ids		1
+#define smp_processor_id()	0
+#define raw_smp_processor_id()	0
+#define num_online_cpus()	1
+#define num_possible_cpus()	1
+#define cpu_online(cpu)		((cpu) == 0)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define for_each_online_cpu(cpu) for_each_possible_cpu(cpu)
+#define for_each_cpu(cpu, mask)	for_each_possible_cpu(cpu)
+
+#define __alloc_percpu(size, align)	calloc(1, size)
+#define alloc_percpu(type)	((type *)calloc(1, sizeof(type)))
+#define free_percpu(p)		free((void *)(p))
+#define per_cpu_ptr(p, cpu)	((void)(cpu), (p))
+#define this_cpu_ptr(p)		(p)
+#define raw_cpu_ptr(p)		(p)
+
+typedef struct { unsigned long bits; } cpumask_t;
+typedef cpumask_t *cpumask_var_t;
+
+extern const cpumask_t *cpu_online_mask;
+
+static inline bool alloc_cpumask_var(cpumask_var_t *mask, gfp_t flags)
+{
+	*mask = calloc(1, sizeof(cpumask_t));
+	return *mask != NULL;
+}
+
+#define free_cpumask_var(mask)	free(mask)
+#define cpumask_copy(dst, src)	(*(dst) = *(src))
+#define cpumask_clear(mask)	((mask)->bits = 0)
+#define cpumask_set_cpu(cpu, mask) ((mask)->bits |= 1UL << (cpu))
+#define cpumask_test_cpu(cpu, mask) (!!((mask)->bits & (1UL << (cpu))))
+
+/* process context, nothing preempts or interrupts event handler */
+#define in_interrupt()		0
+#define in_nmi()		0
+#define in_irq()		0
+#define preempt_disable()	do { } while (0)
+#define preempt_enable()	do { } while (0)
+#define preempt_disable_notrace() do { } while (0)
+#define preempt_enable_notrace() do { } while (0)
+#define local_irq_save(flags)	((flags) = 0)
+#define local_irq_restore(flags) ((void)(flags))
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define cond_resched()		do { } while (0)
+#define smp_mb()		__sync_synchronize()
+#define smp_wmb()		__sync_synchronize()
+#define smp_rmb()		__sync_synchronize()
+#define cmpxchg(ptr, old, new)	__sync_val_compare_and_swap(ptr, old, new)
+
+typedef struct { volatile unsigned int slock; } arch_spinlock_t;
+#define __ARCH_SPIN_LOCK_UNLOCKED	{ 0 }
+#define arch_spin_lock(lock)	((void)(lock))
+#define arch_spin_unlock(lock)	((void)(lock))
+#define arch_spin_trylock(lock)	((void)(lock), 1)
+
+typedef struct { int locked; } spinlock_t;
+#define spin_lock_init(lock)	((lock)->locked = 0)
+#define spin_lock(lock)		((void)(lock))
+#define spin_unlock(lock)	((void)(lock))
+#define spin_lock_irqsave(lock, flags) ((flags) = 0, (void)(lock))
+#define spin_unlock_irqrestore(lock, flags) ((void)(flags), (void)(lock))
+
+typedef struct { int counter; } atomic_t;
+#define atomic_read(v)		((v)->counter)
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_inc(v)		((v)->counter++)
+#define atomic_inc_return(v)	(++(v)->counter)
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+	     n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* kernel objects referred by runtime, only as pointers mostly */
+struct dentry;
+struct file;
+struct inode;
+struct module;
+struct ring_buffer;
+struct perf_event;
+struct perf_sample_data;
+struct perf_event_attr;
+struct syscall_metadata;
+struct pt_regs;
+struct pid;
+struct vm_area_struct;
+
+typedef struct { int x; } wait_queue_head_t;
+struct irq_work { void (*func)(struct irq_work *); };
+struct kprobe { const char *symbol_name; };
+
+#define TASK_RUNNING		0
+#define TASK_INTERRUPTIBLE	1
+#define TASK_DEAD		64
+#define PIDTYPE_PID		0
+
+struct task_struct {
+	pid_t pid;
+	pid_t tgid;
+	long state;
+	int in_iowait;
+	char comm[16];
+};
+
+/* the replaying process is the only task */
+extern struct task_struct kp_replay_task;
+#define current			(&kp_replay_task)
+
+#define task_pid_vnr(task)	((task)->pid)
+#define task_tgid_vnr(task)	((task)->tgid)
+#define get_task_struct(task)	((void)(task))
+#define put_task_struct(task)	((void)(task))
+#define find_vpid(nr)		((struct pid *)NULL)
+#define pid_task(pid, type)	((struct task_struct *)NULL)
+#define get_nr_threads(task)	((void)(task), 1)
+#define set_current_state(state) ((void)(state))
+#define __set_current_state(state) ((void)(state))
+#define schedule_timeout(timeout) usleep((timeout) * 1000000 / HZ)
+#define HZ			100
+
+/* SIGINT sets it, see kp_replay_vm.c */
+extern volatile sig_atomic_t kp_replay_interrupted;
+#define signal_pending(task)	kp_replay_interrupted
+#define flush_signals(task)	(kp_replay_interrupted = 0)
+#define send_sig(sig, task, priv) ((void)(task))
+
+typedef struct { uid_t val; } kuid_t;
+#define current_uid()		((kuid_t){ getuid() })
+#define current_user_ns()	NULL
+#define from_kuid_munged(ns, uid) ((uid).val)
+
+struct new_utsname {
+	char sysname[65];
+	char nodename[65];
+	char release[65];
+	char version[65];
+	char machine[65];
+};
+
+struct new_utsname *utsname(void);
+
+/* time */
+struct timespec;
+u64 local_clock(void);
+#define sched_clock()		local_clock()
+void getnstimeofday(struct timespec *ts);
+#define ring_buffer_time_stamp(buffer, cpu) local_clock()
+
+/* user memory is the same address space */
+#define copy_from_user(to, from, n)	(memcpy(to, from, n), 0UL)
+#define copy_to_user(to, from, n)	(memcpy(to, from, n), 0UL)
+#define __copy_from_user_inatomic(to, from, n) (memcpy(to, from, n), 0UL)
+#define strlen_user(str)		((long)strlen(str) + 1)
+#define strncpy_from_user(dst, src, n)	\
+	((long)strlen(strncpy(dst, src, n)))
+#define pagefault_disable()		do { } while (0)
+#define pagefault_enable()		do { } while (0)
+
+/* symbols and stacks, no kernel to resolve or unwind, stacks are empty */
+#define CONFIG_STACKTRACE		1
+#define CONFIG_USER_STACKTRACE_SUPPORT	1
+
+#define sprint_symbol(buf, addr)	sprintf(buf, "0x%lx", addr)
+#define sprint_symbol_no_offset(buf, addr) sprintf(buf, "0x%lx", addr)
+
+static inline const char *kallsyms_lookup(unsigned long addr,
+					  unsigned long *symbolsize,
+					  unsigned long *offset,
+					  char **modname, char *namebuf)
+{
+	return NULL;
+}
+
+#define kallsyms_lookup_name(name)	0UL
+
+struct stack_trace {
+	unsigned int nr_entries, max_entries;
+	unsigned long *entries;
+	int skip;
+};
+
+#define save_stack_trace(trace)		((trace)->nr_entries = 0)
+#define save_stack_trace_user(trace)	((trace)->nr_entries = 0)
+
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+
+/* Bob Jenkins' one-at-a-time, only needs to spread stack entries */
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+	const u8 *p = key;
+	u32 h = initval;
+
+	while (length--) {
+		h += *p++;
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	return h;
+}
+
+#define GOLDEN_RATIO_PRIME_32	0x9e370001UL
+#define hash_long(val, bits) \
+	((u32)((unsigned long)(val) * GOLDEN_RATIO_PRIME_32) >> (32 - (bits)))
+
+/* trace_seq, layout of 3.19 and later */
+struct seq_buf {
+	size_t len;
+	size_t readpos;
+};
+
+struct trace_seq {
+	unsigned char buffer[PAGE_SIZE];
+	struct seq_buf seq;
+	int full;
+};
+
+static inline void trace_seq_init(struct trace_seq *s)
+{
+	s->seq.len = 0;
+	s->seq.readpos = 0;
+	s->full = 0;
+}
+
+static inline bool trace_seq_has_overflowed(struct trace_seq *s)
+{
+	return s->full;
+}
+
+static inline void trace_seq_vprintf(struct trace_seq *s, const char *fmt,
+				     va_list args)
+{
+	size_t left = PAGE_SIZE - 1 - s->seq.len;
+	int len;
+
+	if (s->full)
+		return;
+
+	len = vsnprintf((char *)s->buffer + s->seq.len, left + 1, fmt, args);
+	if (len < 0 || (size_t)len > left) {
+		s->full = 1;
+		return;
+	}
+	s->seq.len += len;
+}
+
+static inline void trace_seq_printf(struct trace_seq *s, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	trace_seq_vprintf(s, fmt, args);
+	va_end(args);
+}
+
+static inline void trace_seq_putc(struct trace_seq *s, unsigned char c)
+{
+	if (s->full || s->seq.len >= PAGE_SIZE - 1) {
+		s->full = 1;
+		return;
+	}
+	s->buffer[s->seq.len++] = c;
+}
+
+static inline void trace_seq_putmem(struct trace_seq *s, const void *mem,
+				    unsigned int len)
+{
+	if (s->full || len > PAGE_SIZE - 1 - s->seq.len) {
+		s->full = 1;
+		return;
+	}
+	memcpy(s->buffer + s->seq.len, mem, len);
+	s->seq.len += len;
+}
+
+#define trace_seq_puts(s, str)	trace_seq_putmem(s, str, strlen(str))
+
+/* declared by trace_events.h, events never come from kernel in replay */
+struct trace_event_call;
+struct trace_event_class;
+
+#endif /* __KTAP_REPLAY_H__ */
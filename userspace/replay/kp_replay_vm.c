@@ -0,0 +1,563 @@
+/*
+ * kp_replay_vm.c - kernel side services of ktapvm for ktap-replay
+ *
+ * Copyright (C) 2012-2016, Huawei Technologies.
+ *
+ * ktap is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * ktap is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/utsname.h>
+#include "../../include/ktap_types.h"
+#include "../../runtime/ktap.h"
+#include "../../runtime/kp_obj.h"
+#include "../../runtime/kp_str.h"
+#include "../../runtime/kp_mempool.h"
+#include "../../runtime/kp_bcread.h"
+#include "../../runtime/kp_symcache.h"
+#include "../../runtime/kp_transport.h"
+#include "../../runtime/kp_events.h"
+#include "../../runtime/kp_stats.h"
+#include "../../runtime/kp_export.h"
+#include "../../runtime/kp_vm.h"
+#include "libktapvm.h"
+
+/*
+ * This file stands for ktap.c, kp_transport.c, kp_events.c, kp_stats.c,
+ * kp_export.c, lib_kdebug.c, lib_timer.c and lib_net.c of the module,
+ * the rest of runtime is built as is, see amalg.c.
+ *
+ * Output of script goes to stdout. Probes of trace and timer blocks are
+ * not attached to anything, they are kept in replay_probes and fired by
+ * kp_replay_run() back to back, through the same path as perf_callback:
+ * recursion context, per-cpu thread and kp_vm_call. A trace probe fires
+ * with event context but no event data, argN is nil, argstr is the name
+ * of probe; a timer probe fires without event context, as in kernel.
+ */
+
+struct task_struct kp_replay_task;
+volatile sig_atomic_t kp_replay_interrupted;
+
+static const cpumask_t replay_online_mask = { 1 };
+const cpumask_t *cpu_online_mask = &replay_online_mask;
+
+int kp_max_loop_count = 100000;
+
+struct replay_probe {
+	struct ktap_event event;
+	int timer;	/* fires without event context */
+};
+
+static LIST_HEAD(replay_probes);
+
+u64 local_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+void getnstimeofday(struct timespec *ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/* common helper function */
+long gettimeofday_ns(void)
+{
+	struct timespec now;
+
+	getnstimeofday(&now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+unsigned long long ns2usecs(cycle_t nsec)
+{
+	return nsec / NSEC_PER_USEC;
+}
+
+struct new_utsname *utsname(void)
+{
+	static struct new_utsname name;
+	struct utsname u;
+
+	if (!name.sysname[0] && !uname(&u)) {
+		strlcpy(name.sysname, u.sysname, sizeof(name.sysname));
+		strlcpy(name.nodename, u.nodename, sizeof(name.nodename));
+		strlcpy(name.release, u.release, sizeof(name.release));
+		strlcpy(name.version, u.version, sizeof(name.version));
+		strlcpy(name.machine, u.machine, sizeof(name.machine));
+	}
+
+	return &name;
+}
+
+static void replay_sigint(int sig)
+{
+	kp_replay_interrupted = 1;
+}
+
+/* -- transport ----------------------------------------------------------- */
+
+int _trace_seq_puts(struct trace_seq *s, const char *str)
+{
+	int len = strlen(str);
+
+	if (s->full)
+		return 0;
+
+	if (len > ((PAGE_SIZE - 1) - TRACE_SEQ_LEN(s))) {
+		s->full = 1;
+		return 0;
+	}
+
+	memcpy(s->buffer + TRACE_SEQ_LEN(s), str, len);
+	TRACE_SEQ_LEN(s) += len;
+
+	return len;
+}
+
+int kp_sprint_symbol(ktap_state_t *ks, char *buffer, unsigned long addr,
+		     int offset, int width)
+{
+	char str[KSYM_SYMBOL_LEN];
+
+	if (!width)
+		return kp_symcache_sprint(ks, buffer, addr, offset);
+
+	kp_symcache_sprint(ks, str, addr, offset);
+	return sprintf(buffer, "%*s", width, str);
+}
+
+int kp_sprint_usymbol(ktap_state_t *ks, char *buffer, int pid,
+		      unsigned long addr, int offset)
+{
+	return sprintf(buffer, "0x%lx", addr);
+}
+
+void kp_transport_write(ktap_state_t *ks, const void *data, size_t length)
+{
+	fwrite(data, strnlen(data, length), 1, stdout);
+}
+
+void kp_transport_bprint(ktap_state_t *ks, const void *data, size_t length)
+{
+	struct trace_seq *seq = kp_this_cpu_temp_buffer(ks);
+
+	trace_seq_init(seq);
+	kp_str_bfmt_print(ks, seq, data, length);
+	fwrite(seq->buffer, TRACE_SEQ_LEN(seq), 1, stdout);
+}
+
+/* argstr of replayed event is its probe name, no newline as in kernel */
+void kp_transport_event_write(ktap_state_t *ks, struct ktap_event_data *e)
+{
+	fputs(kp_event_name(e->event), stdout);
+}
+
+/* nothing to unwind in replay */
+void kp_transport_print_kstack(ktap_state_t *ks, uint16_t depth, uint16_t skip)
+{
+}
+
+void kp_transport_print_ustack(ktap_state_t *ks, uint16_t depth)
+{
+}
+
+void kp_transport_wakeup(ktap_state_t *ks)
+{
+	fflush(stdout);
+}
+
+void kp_transport_report(ktap_state_t *ks)
+{
+}
+
+void kp_transport_exit(ktap_state_t *ks)
+{
+	fflush(stdout);
+}
+
+int kp_transport_init(ktap_state_t *ks, struct dentry *dir)
+{
+	return 0;
+}
+
+/* general print function */
+void kp_printf(ktap_state_t *ks, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+void __kp_puts(ktap_state_t *ks, const char *str)
+{
+	fputs(str, stdout);
+}
+
+void __kp_bputs(ktap_state_t *ks, const char *str)
+{
+	fputs(str, stdout);
+}
+
+/* -- events -------------------------------------------------------------- */
+
+const char *kp_event_name(struct ktap_event *event)
+{
+	return getstr(event->name);
+}
+
+void kp_event_getarg(ktap_state_t *ks, ktap_val_t *ra, int idx)
+{
+	set_nil(ra);
+}
+
+const char *kp_event_tostr(ktap_state_t *ks)
+{
+	/* need to check current context is vaild tracing context */
+	if (!ks->current_event) {
+		kp_error(ks, "cannot stringify event str in invalid context\n");
+		return NULL;
+	}
+
+	return kp_event_name(ks->current_event->event);
+}
+
+const ktap_str_t *kp_event_stringify(ktap_state_t *ks)
+{
+	if (!ks->current_event) {
+		kp_error(ks, "cannot stringify event str in invalid context\n");
+		return NULL;
+	}
+
+	return ks->current_event->event->name;
+}
+
+static int replay_add_probe(ktap_state_t *ks, const char *name,
+			    ktap_func_t *fn, int timer)
+{
+	struct replay_probe *p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	p->event.stats = alloc_percpu(struct ktap_event_stats);
+	if (!p->event.stats) {
+		kfree(p);
+		return -ENOMEM;
+	}
+
+	p->event.type = timer ? KTAP_EVENT_TYPE_PERF :
+				KTAP_EVENT_TYPE_TRACEPOINT;
+	p->event.ks = ks;
+	p->event.fn = fn;
+	p->event.name = kp_str_newz(ks, name);
+	p->timer = timer;
+
+	list_add_tail(&p->event.list, &replay_probes);
+	return 0;
+}
+
+static void replay_fire(ktap_state_t *mainthread, struct replay_probe *p)
+{
+	struct ktap_event *event = &p->event;
+	struct ktap_event_stats *stats = kp_event_stats(event);
+	struct ktap_event_data e;
+	ktap_state_t *ks;
+	ktap_val_t *func;
+	u64 start;
+	int rctx;
+
+	rctx = get_recursion_context(mainthread);
+	if (unlikely(rctx < 0)) {
+		stats->recursion_missed++;
+		return;
+	}
+
+	e.event = event;
+	e.data = NULL;
+	e.regs = NULL;
+	e.argstr = NULL;
+
+	start = local_clock();
+
+	ks = kp_vm_new_thread(mainthread, rctx);
+	set_func(ks->top, event->fn);
+	func = ks->top;
+	incr_top(ks);
+
+	ks->current_event = p->timer ? NULL : &e;
+
+	kp_vm_call(ks, func, 0);
+
+	ks->current_event = NULL;
+	kp_vm_exit_thread(ks);
+
+	if (unlikely(G(ks)->state == KTAP_ERROR))
+		stats->errors++;
+	stats->hits++;
+	stats->time += local_clock() - start;
+
+	put_recursion_context(mainthread, rctx);
+}
+
+void kp_events_exit(ktap_state_t *ks)
+{
+	if (!G(ks)->trace_enabled)
+		return;
+
+	/* call trace_end_closure after all event unregistered */
+	if ((G(ks)->state != KTAP_ERROR) && G(ks)->trace_end_closure) {
+		G(ks)->state = KTAP_TRACE_END;
+		set_func(ks->top, G(ks)->trace_end_closure);
+		incr_top(ks);
+		kp_vm_call(ks, ks->top - 1, 0);
+		G(ks)->trace_end_closure = NULL;
+	}
+
+	G(ks)->trace_enabled = 0;
+}
+
+void kp_events_free(ktap_state_t *ks)
+{
+	struct replay_probe *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &replay_probes, event.list) {
+		list_del(&p->event.list);
+		free_percpu(p->event.stats);
+		kfree(p);
+	}
+}
+
+int kp_events_init(ktap_state_t *ks)
+{
+	G(ks)->trace_enabled = 1;
+	return 0;
+}
+
+/* -- stats and export ---------------------------------------------------- */
+
+/* printed to stderr, so it's not mixed with output of script */
+void kp_stats_report(ktap_state_t *ks)
+{
+	struct replay_probe *p;
+	struct ktap_event_stats *stats;
+
+	if (list_empty(&replay_probes))
+		return;
+
+	fflush(stdout);
+	fprintf(stderr, "%-32s %12s %10s %8s %14s %8s\n", "probe", "hits",
+		"recursion", "errors", "time(ns)", "avg(ns)");
+
+	list_for_each_entry(p, &replay_probes, event.list) {
+		stats = kp_event_stats(&p->event);
+		fprintf(stderr, "%-32s %12llu %10llu %8llu %14llu %8llu\n",
+			kp_event_name(&p->event),
+			(unsigned long long)stats->hits,
+			(unsigned long long)stats->recursion_missed,
+			(unsigned long long)stats->errors,
+			(unsigned long long)stats->time,
+			(unsigned long long)(stats->hits ?
+				stats->time / stats->hits : 0));
+	}
+
+	fprintf(stderr, "mempool: used %d/%d Kbytes, %d segments, "
+		"%d strings, %d allocations failed\n",
+		G(ks)->mp_used / 1024, G(ks)->mp_size / 1024,
+		G(ks)->mp_nseg, G(ks)->strnum, G(ks)->mp_failed);
+}
+
+void kp_stats_exit(ktap_state_t *ks)
+{
+}
+
+int kp_stats_init(ktap_state_t *ks, struct dentry *dir)
+{
+	return 0;
+}
+
+/* no debugfs, exported table is only readable by script itself */
+int kp_export_table(ktap_state_t *ks, ktap_tab_t *t, const char *name)
+{
+	if (G(ks)->state != KTAP_RUNNING) {
+		kp_error(ks, "cannot export table after tracing ends\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void kp_export_exit(ktap_state_t *ks)
+{
+}
+
+int kp_export_init(ktap_state_t *ks, struct dentry *dir)
+{
+	return 0;
+}
+
+/* -- libraries ----------------------------------------------------------- */
+
+static int kplib_kdebug_trace_by_id(ktap_state_t *ks)
+{
+	unsigned long uaddr = kp_arg_checknumber(ks, 1);
+	ktap_func_t *fn = kp_arg_checkfunction(ks, 2);
+	kp_replay_eventdesc_t *evdesc = (kp_replay_eventdesc_t *)uaddr;
+
+	if (G(ks)->mainthread != ks) {
+		kp_error(ks,
+		    "kdebug.trace_by_id only can be called in mainthread\n");
+		return -1;
+	}
+
+	/* kdebug.trace_by_id cannot be called in trace_end state */
+	if (G(ks)->state != KTAP_RUNNING) {
+		kp_error(ks,
+		    "kdebug.trace_by_id only can be called in RUNNING state\n");
+		return -1;
+	}
+
+	/* one probe for all events of eventdef, nothing to tell them apart */
+	return replay_add_probe(ks, evdesc->eventdef, fn, 0);
+}
+
+static int kplib_kdebug_trace_end(ktap_state_t *ks)
+{
+	/* trace_end_closure will be called when ktap main thread exit */
+	G(ks)->trace_end_closure = kp_arg_checkfunction(ks, 1);
+	return 0;
+}
+
+static const ktap_libfunc_t kdebug_lib_funcs[] = {
+	{"trace_by_id", kplib_kdebug_trace_by_id},
+	{"trace_end", kplib_kdebug_trace_end},
+	{NULL}
+};
+
+int kp_lib_init_kdebug(ktap_state_t *ks)
+{
+	return kp_vm_register_lib(ks, "kdebug", kdebug_lib_funcs);
+}
+
+/* interval is only part of probe name, timers fire as often as probes */
+static int do_tick_profile(ktap_state_t *ks, const char *type)
+{
+	const char *interval = kp_arg_checkstring(ks, 1);
+	ktap_func_t *fn = kp_arg_checkfunction(ks, 2);
+	char name[64];
+
+	if (G(ks)->state != KTAP_RUNNING) {
+		kp_error(ks, "timer.%s only can be called in RUNNING state\n",
+			 type);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "%s-%s", type, interval);
+	return replay_add_probe(ks, name, fn, 1);
+}
+
+static int kplib_timer_tick(ktap_state_t *ks)
+{
+	return do_tick_profile(ks, "tick");
+}
+
+static int kplib_timer_profile(ktap_state_t *ks)
+{
+	return do_tick_profile(ks, "profile");
+}
+
+void kp_exit_timers(ktap_state_t *ks)
+{
+}
+
+static const ktap_libfunc_t timer_lib_funcs[] = {
+	{"profile",	kplib_timer_profile},
+	{"tick",	kplib_timer_tick},
+	{NULL}
+};
+
+int kp_lib_init_timer(ktap_state_t *ks)
+{
+	return kp_vm_register_lib(ks, "timer", timer_lib_funcs);
+}
+
+/* functions of net library read sockets of event, there is none */
+static const ktap_libfunc_t net_lib_funcs[] = {
+	{NULL}
+};
+
+int kp_lib_init_net(ktap_state_t *ks)
+{
+	return kp_vm_register_lib(ks, "net", net_lib_funcs);
+}
+
+/* -- entry --------------------------------------------------------------- */
+
+int kp_replay_run(ktap_option_t *parm, int loops)
+{
+	struct replay_probe *p;
+	ktap_state_t *ks;
+	ktap_proto_t *pt;
+	long start_time, delta_time;
+	int i;
+
+	kp_replay_task.pid = kp_replay_task.tgid = getpid();
+	strlcpy(kp_replay_task.comm, "ktap-replay", sizeof(kp_replay_task.comm));
+	signal(SIGINT, replay_sigint);
+
+	start_time = gettimeofday_ns();
+
+	ks = kp_vm_new_state(parm, NULL);
+	if (unlikely(!ks))
+		return -ENOEXEC;
+
+	/* constant strings in trunk are allocated from mempool */
+	kp_mempool_grow(ks, parm->trunk_len);
+
+	pt = kp_bcread(ks, (unsigned char *)parm->trunk, parm->trunk_len);
+	if (!pt)
+		goto out;
+
+	/* validate byte code */
+	if (kp_vm_validate_code(ks, pt, ks->stack))
+		goto out;
+
+	delta_time = (gettimeofday_ns() - start_time) / NSEC_PER_USEC;
+	kp_verbose_printf(ks, "booting time: %d (us)\n", delta_time);
+
+	/* enter vm */
+	kp_vm_call_proto(ks, pt);
+
+	for (i = 0; i < loops; i++) {
+		list_for_each_entry(p, &replay_probes, event.list) {
+			if (ks->stop || G(ks)->state != KTAP_RUNNING ||
+			    kp_replay_interrupted)
+				goto out;
+
+			replay_fire(ks, p);
+		}
+
+		/* grow mempool here, it cannot be grown in probe context */
+		kp_mempool_grow(ks, 0);
+	}
+
+ out:
+	kp_vm_exit(ks);
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef __KTAP_LIBKTAPVM_H__
+#define __KTAP_LIBKTAPVM_H__
+
+/*
+ * ktapvm built for userspace, see kp_replay_vm.c. Runtime symbols are
+ * local to libktapvm.a, they clash with the compiler of same names.
+ */
+
+/* passed as trace block argument instead of events of kp_parse_events */
+typedef struct kp_replay_eventdesc {
+	ktap_eventdesc_t desc;
+	const char *eventdef;	/* probe name in report and argstr */
+} kp_replay_eventdesc_t;
+
+/*
+ * run byte code of parm->trunk, then fire each probe it registered
+ * loops times, print timing report to stderr.
+ */
+int kp_replay_run(ktap_option_t *parm, int loops);
+
+#endif /* __KTAP_LIBKTAPVM_H__ */